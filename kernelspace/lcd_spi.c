@@ -23,16 +23,23 @@
 #include <linux/of.h>
 #include <linux/of_device.h>
 #include <linux/completion.h>
-#include <linux/gpio.h>
+#include <linux/gpio/consumer.h>
 #include <linux/spi/spi.h>
 #include <linux/delay.h>
 #include <linux/uaccess.h>
 #include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/idr.h>
+#include <linux/kref.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
 
 #include <linux/timer.h>
 #include <linux/moduleparam.h>
 
 #include "touchpad_notifier.h"
+#include "lcd_spi_xfer.h"
 
 #define DRIVER_NAME "lcd_spi"
 #define HEIGHT 320
@@ -40,6 +47,7 @@
 #define BY_PER_PIX 2
 #define TOT_MEM_SIZE BY_PER_PIX*HEIGHT*LENGTH
 #define SPI_SPEED 6600000
+#define LCDD_MINORS 4
 
 #ifdef DEBUG
 #define debug_message() printk(KERN_EMERG "DEBUG %s %d\n", __FUNCTION__, \
@@ -53,25 +61,117 @@
 #define SPI_IO_WR_CMD		_IOW(SPI_IOC_MAGIC, 7, struct lcdd_transfer)
 #define SPI_IO_RD_CMD		_IOR(SPI_IOC_MAGIC, 7, struct lcdd_transfer)
 
+/*
+ * controller commands the driver follows for every opener: window setting,
+ * memory write and continue, memory read and continue
+ */
+#define LCDD_CASET 0x2A
+#define LCDD_PASET 0x2B
+#define LCDD_RAMWR 0x2C
+#define LCDD_RAMWRC 0x3C
+#define LCDD_RAMRD 0x2E
+#define LCDD_RAMRDC 0x3E
+/* arguments of other commands kept to be sent again */
+#define LCDD_ARGS_MAX 16
+
 unsigned int delay_time = 10;
 module_param(delay_time, uint, S_IRUGO);
 EXPORT_SYMBOL(delay_time);
 
 #define BACKLIGHT_DELAY		delay_time * HZ
 
+/*
+ * data writes of at least zerocopy_min bytes are sent straight from the
+ * pinned user pages, smaller ones go through the bounce buffer; 0 disables.
+ * Pinning and mapping have not been timed against the copy yet, so it is
+ * off until a threshold is measured on the target.
+ */
+unsigned int zerocopy_min;
+module_param(zerocopy_min, uint, S_IRUGO | S_IWUSR);
+
+/*
+ * pages of bounce memory allocated per panel at probe, one full screen by
+ * default and at least 2; larger writes are sent in pool sized pieces and
+ * a read may use up to half of the pool
+ */
+unsigned int pool_pages = DIV_ROUND_UP(TOT_MEM_SIZE + 2, PAGE_SIZE);
+module_param(pool_pages, uint, S_IRUGO);
+
+/*
+ * One instance per panel, allocated when its spi_device is probed. The
+ * control lines come from the panel's DT node (dc-gpios, reset-gpios and
+ * optional led-gpios), and an optional touchscreen phandle ties the
+ * backlight to the touchpad sitting on top of it. Every open file holds a
+ * reference, so the instance and its pool outlive remove until the last
+ * one is closed; transfers fail with -ENODEV once removed is set.
+ */
 struct lcdd {
 	struct cdev *cdev;
+	struct kref kref;
+	bool removed;
 	dev_t devt;
-	struct file_operations fops;
-	struct class *class;
 	struct device *device;
 	struct spi_device *spi_device;
-	uint8_t *tx;
-	uint8_t *rx;
+	struct gpio_desc *dc;
+	struct gpio_desc *reset;
+	struct gpio_desc *led;
+	struct device_node *touch_node;
+	struct timer_list backlight_timer;
+	struct notifier_block pressed;
+	/*
+	 * bounce memory built from single pages, mapped contiguously at
+	 * pool_mem
+	 */
+	struct page **pool;
+	unsigned int pool_cnt;
+	uint8_t *pool_mem;
+	/*
+	 * arbitrates the bus and the pool between all files open on this
+	 * panel; panels on other chip selects or buses are not held up
+	 */
+	struct mutex io_lock;
+	/*
+	 * file whose command the controller is executing and file whose
+	 * window is set, NULL when none is; under io_lock
+	 */
+	struct lcdd_file *owner;
+	struct lcdd_file *window_owner;
 	spinlock_t lock;
 };
 
-static struct lcdd lcdd;
+/*
+ * Context of one open file. A command and its data come in separate
+ * ioctls, so each file keeps the window it set and the command it is in
+ * the middle of; when another opener used the bus in between, both are
+ * sent again before the file's next transfer and pixels continue where
+ * the file left off. All of it is under io_lock.
+ */
+struct lcdd_file {
+	struct lcdd *lcdd;
+	uint8_t caset[4];
+	uint8_t paset[4];
+	/* LCDD_CASET and LCDD_PASET bits of arguments kept */
+	uint8_t window;
+	bool has_cmd;
+	uint8_t cmd;
+	uint8_t args[LCDD_ARGS_MAX];
+	/* data bytes sent after cmd */
+	size_t sent;
+};
+
+#define LCDD_WINDOW_CASET 1
+#define LCDD_WINDOW_PASET 2
+#define LCDD_WINDOW_SET (LCDD_WINDOW_CASET | LCDD_WINDOW_PASET)
+
+static struct class *lcdd_class;
+static dev_t lcdd_devt;
+static DEFINE_IDA(lcdd_minors);
+/*
+ * panels by minor, open looks them up under lcdd_list_lock so it cannot
+ * race with remove
+ */
+static DEFINE_MUTEX(lcdd_list_lock);
+static struct lcdd *lcdd_devices[LCDD_MINORS];
 
 struct lcdd_transfer {
 	uint32_t byte_cnt;
@@ -79,13 +179,6 @@ struct lcdd_transfer {
 	uint8_t __user *rx;
 };
 
-
-static struct gpio lcd_gpio[] = {
-	{ 24, GPIOF_OUT_INIT_LOW, "DC" },
-	{ 25, GPIOF_OUT_INIT_HIGH, "RESET" },
-	{ 18, GPIOF_OUT_INIT_HIGH, "LED" }
-};
-
 /*
  * Interrupt handling routines:
  *	lcdd_backlight_timer_handler
@@ -94,87 +187,148 @@ static struct gpio lcd_gpio[] = {
 
 void lcdd_backlight_timer_handler(unsigned long arg)
 {
+	struct lcdd *lcdd = (struct lcdd *)arg;
 	unsigned long flags;
-	spin_lock_irqsave(&lcdd.lock, flags);
-	gpio_set_value(lcd_gpio[2].gpio, 0);
-	spin_unlock_irqrestore(&lcdd.lock, flags);
+	spin_lock_irqsave(&lcdd->lock, flags);
+	gpiod_set_value(lcdd->led, 0);
+	spin_unlock_irqrestore(&lcdd->lock, flags);
 }
 
-static struct timer_list lcdd_backlight_timer;
-
+/*
+ * _param is the touchpad's struct device; a panel bound to a touchscreen
+ * only wakes up for that one
+ */
 static int lcdd_notf_pressed(struct notifier_block *nblock, unsigned long code,
 			     void *_param)
 {
+	struct lcdd *lcdd = container_of(nblock, struct lcdd, pressed);
+	struct device *touch = _param;
 	unsigned long flags;
-	spin_lock_irqsave(&lcdd.lock, flags);
-	mod_timer(&lcdd_backlight_timer, jiffies + BACKLIGHT_DELAY);
-	gpio_set_value(lcd_gpio[2].gpio, 1);
-	spin_unlock_irqrestore(&lcdd.lock, flags);
+	if (lcdd->touch_node && touch && touch->of_node != lcdd->touch_node)
+		return 0;
+	spin_lock_irqsave(&lcdd->lock, flags);
+	mod_timer(&lcdd->backlight_timer, jiffies + BACKLIGHT_DELAY);
+	gpiod_set_value(lcdd->led, 1);
+	spin_unlock_irqrestore(&lcdd->lock, flags);
 	return 0;
 }
 
-static struct notifier_block lcdd_pressed = {
-	.notifier_call = lcdd_notf_pressed
-};
+static void lcdd_pool_free(struct lcdd *lcdd);
+
+static void lcdd_free(struct kref *kref)
+{
+	struct lcdd *lcdd = container_of(kref, struct lcdd, kref);
+	lcdd_pool_free(lcdd);
+	kfree(lcdd);
+}
 
 int lcdd_open(struct inode *inode, struct file *file)
 {
-	/*device can be opened only once at a moment*/
-	if  (atomic_read(&file->f_count) != 1) 
-		return -EINVAL;
-	lcdd.tx = kmalloc(TOT_MEM_SIZE + 2, GFP_KERNEL);
-	if (!lcdd.tx)
-		return -ENOMEM;
-	lcdd.rx = kmalloc(TOT_MEM_SIZE + 2, GFP_KERNEL);
-	if (!lcdd.rx) {
-		kfree(lcdd.tx);
+	struct lcdd *lcdd;
+	struct lcdd_file *ctx = kzalloc(sizeof(struct lcdd_file), GFP_KERNEL);
+	if (!ctx)
 		return -ENOMEM;
+	mutex_lock(&lcdd_list_lock);
+	lcdd = lcdd_devices[iminor(inode)];
+	if (lcdd)
+		kref_get(&lcdd->kref);
+	mutex_unlock(&lcdd_list_lock);
+	if (!lcdd) {
+		kfree(ctx);
+		return -ENODEV;
 	}
-	file->private_data = &lcdd;
+	ctx->lcdd = lcdd;
+	file->private_data = ctx;
 	return 0;
 }
 
 int lcdd_release(struct inode *inode, struct file *file)
 {
-	kfree(lcdd.rx);
-	lcdd.rx = NULL;
-	kfree(lcdd.tx);
-	lcdd.tx = NULL;
+	struct lcdd_file *ctx = file->private_data;
+	struct lcdd *lcdd = ctx->lcdd;
+	mutex_lock(&lcdd->io_lock);
+	if (lcdd->owner == ctx)
+		lcdd->owner = NULL;
+	if (lcdd->window_owner == ctx)
+		lcdd->window_owner = NULL;
+	mutex_unlock(&lcdd->io_lock);
+	kref_put(&lcdd->kref, lcdd_free);
+	kfree(ctx);
 	return 0;
-}	
+}
 
-static inline int lcdd_set_gpio(void)
+static void lcdd_pool_free(struct lcdd *lcdd)
 {
-	int ret;
-	ret = gpio_request_array(lcd_gpio, ARRAY_SIZE(lcd_gpio));
-	return ret;	
+	unsigned int i;
+	if (lcdd->pool_mem)
+		vunmap(lcdd->pool_mem);
+	for (i = 0; lcdd->pool && i < lcdd->pool_cnt; i++)
+		if (lcdd->pool[i])
+			__free_page(lcdd->pool[i]);
+	kfree(lcdd->pool);
+}
+
+/*
+ * Only order-0 pages are allocated, so the pool can be set up however
+ * fragmented memory is.
+ */
+static int lcdd_pool_alloc(struct lcdd *lcdd)
+{
+	unsigned int i;
+	lcdd->pool_cnt = max(pool_pages, 2u);
+	lcdd->pool = kcalloc(lcdd->pool_cnt, sizeof(struct page *), GFP_KERNEL);
+	if (!lcdd->pool)
+		return -ENOMEM;
+	for (i = 0; i < lcdd->pool_cnt; i++) {
+		lcdd->pool[i] = alloc_page(GFP_KERNEL);
+		if (!lcdd->pool[i])
+			goto err;
+	}
+	lcdd->pool_mem = vmap(lcdd->pool, lcdd->pool_cnt, VM_MAP, PAGE_KERNEL);
+	if (!lcdd->pool_mem)
+		goto err;
+	return 0;
+err:
+	lcdd_pool_free(lcdd);
+	lcdd->pool = NULL;
+	lcdd->pool_mem = NULL;
+	return -ENOMEM;
 }
 
-static inline void lcdd_unset_gpio(void)
+static int lcdd_set_gpio(struct lcdd *lcdd, struct device *dev)
 {
-	gpio_free_array(lcd_gpio, ARRAY_SIZE(lcd_gpio));
+	lcdd->dc = devm_gpiod_get(dev, "dc", GPIOD_OUT_LOW);
+	if (IS_ERR(lcdd->dc))
+		return PTR_ERR(lcdd->dc);
+	lcdd->reset = devm_gpiod_get(dev, "reset", GPIOD_OUT_HIGH);
+	if (IS_ERR(lcdd->reset))
+		return PTR_ERR(lcdd->reset);
+	lcdd->led = devm_gpiod_get_optional(dev, "led", GPIOD_OUT_HIGH);
+	if (IS_ERR(lcdd->led))
+		return PTR_ERR(lcdd->led);
+	return 0;
 }
 
-static inline void lcdd_reset(void) 
+static inline void lcdd_reset(struct lcdd *lcdd)
 {
-	gpio_set_value(lcd_gpio[1].gpio, 0);
+	gpiod_set_value(lcdd->reset, 0);
 	udelay(25);
-	gpio_set_value(lcd_gpio[1].gpio, 1);
+	gpiod_set_value(lcdd->reset, 1);
 	mdelay(10);
 }
 
-static inline void lcdd_set_data_cmd_pin(uint8_t data_cmd)
+static inline void lcdd_set_data_cmd_pin(struct lcdd *lcdd, uint8_t data_cmd)
 {
 	if (data_cmd)
-		gpio_set_value(lcd_gpio[0].gpio, 1);
+		gpiod_set_value(lcdd->dc, 1);
 	else
-		gpio_set_value(lcd_gpio[0].gpio, 0);
+		gpiod_set_value(lcdd->dc, 0);
 }
 
-static int lcdd_parse_user_data(const char __user *message, 
+static int lcdd_parse_user_data(const char __user *message,
 			        struct lcdd_transfer *transfer)
 {
-	int ret = copy_from_user(transfer, message, 
+	int ret = copy_from_user(transfer, message,
 			     sizeof(struct lcdd_transfer));
 	if (ret)
 		return -EAGAIN;
@@ -189,45 +343,13 @@ static int lcdd_parse_user_data(const char __user *message,
 	return 0;
 }
 
-static int lcdd_init_spi_transfer(struct lcdd_transfer *transfer, 
-				  struct spi_transfer *spi_transfer, int op)
-{
-	int ret;
-	memset(spi_transfer, 0, sizeof(struct spi_transfer));
-	switch (op) {
-	case SPI_IO_WR_DATA:
-	case SPI_IO_WR_CMD:
-		spi_transfer->tx_buf = lcdd.tx;
-		spi_transfer->len = transfer->byte_cnt;
-		memset(lcdd.tx, 0, TOT_MEM_SIZE);
-		ret = copy_from_user(lcdd.tx, transfer->tx, transfer->byte_cnt);
-		if (ret) {
-			spi_transfer->tx_buf = NULL;
-			return -EAGAIN;
-		}
-		return 0;
-	case SPI_IO_RD_CMD:
-		spi_transfer->tx_buf = lcdd.tx;
-		spi_transfer->rx_buf = lcdd.rx;
-		spi_transfer->len = transfer->byte_cnt;
-		memset(lcdd.tx, 0, TOT_MEM_SIZE);
-		ret = copy_from_user(lcdd.tx, transfer->tx, 1);
-		if (ret) {
-			spi_transfer->tx_buf = NULL;
-			spi_transfer->rx_buf = NULL;
-		}
-		return 0;
-	}
-	return -EINVAL;
-}
-
-
 static void lcdd_complete_transfer(void *context)
 {
 	complete(context);
 }
 
-static int lcdd_message_send(struct spi_transfer *spi_transfer, uint8_t data_cmd)
+static int lcdd_message_send(struct lcdd *lcdd,
+			     struct spi_transfer *spi_transfer, uint8_t data_cmd)
 {
 	int ret;
 	struct spi_message spi_message;
@@ -236,9 +358,9 @@ static int lcdd_message_send(struct spi_transfer *spi_transfer, uint8_t data_cmd
 	spi_message_add_tail(spi_transfer, &spi_message);
 	spi_message.complete = lcdd_complete_transfer;
 	spi_message.context = &done;
-	lcdd_set_data_cmd_pin(data_cmd);
+	lcdd_set_data_cmd_pin(lcdd, data_cmd);
 	//udelay(1); works without
-	ret = spi_async(lcdd.spi_device, &spi_message);
+	ret = spi_async(lcdd->spi_device, &spi_message);
 	if (ret) {
 		debug_message();
 		return ret;
@@ -247,59 +369,389 @@ static int lcdd_message_send(struct spi_transfer *spi_transfer, uint8_t data_cmd
 	return 0;
 }
 
-static int lcdd_write(struct file *file, unsigned long arg, int op) 
+/*
+ * Sends a data write without copying it: the user pages are pinned chunk by
+ * chunk, mapped contiguously and handed to the SPI core, which builds the
+ * scatterlist and DMA-maps it for the controller. Called with io_lock
+ * held, so other openers cannot split the pixel stream.
+ */
+static int lcdd_write_pinned(struct lcdd *lcdd, struct lcdd_transfer *transfer)
+{
+	int ret = 0;
+	int pinned;
+	unsigned int i, nr;
+	unsigned long uaddr = (unsigned long)transfer->tx;
+	size_t left = transfer->byte_cnt;
+	size_t len;
+	void *vaddr;
+	struct page *pages[LCDD_PIN_PAGES];
+	struct spi_transfer spi_transfer;
+
+	while (left) {
+		len = lcdd_xfer_chunk(uaddr, left);
+		nr = lcdd_xfer_pages(uaddr, len);
+		pinned = get_user_pages_fast(uaddr & PAGE_MASK, nr, 0, pages);
+		if (pinned != nr) {
+			ret = pinned < 0 ? pinned : -EFAULT;
+			nr = pinned < 0 ? 0 : pinned;
+			goto put;
+		}
+		vaddr = vmap(pages, nr, VM_MAP, PAGE_KERNEL);
+		if (!vaddr) {
+			ret = -ENOMEM;
+			goto put;
+		}
+		memset(&spi_transfer, 0, sizeof(struct spi_transfer));
+		spi_transfer.tx_buf = vaddr + offset_in_page(uaddr);
+		spi_transfer.len = len;
+		ret = lcdd_message_send(lcdd, &spi_transfer, 1);
+		vunmap(vaddr);
+put:
+		for (i = 0; i < nr; i++)
+			put_page(pages[i]);
+		if (ret) {
+			debug_message();
+			break;
+		}
+		uaddr += len;
+		left -= len;
+	}
+	return ret;
+}
+
+/*
+ * Writes through the pool, with io_lock held, in pool sized pieces.
+ */
+static int lcdd_write_bounce(struct lcdd *lcdd, struct lcdd_transfer *transfer,
+			     uint8_t data_cmd)
+{
+	int ret = 0;
+	const uint8_t __user *tx = transfer->tx;
+	size_t left = transfer->byte_cnt;
+	size_t len;
+	struct spi_transfer spi_transfer;
+
+	while (left) {
+		len = lcdd_xfer_bounce_chunk(left, lcdd->pool_cnt);
+		if (copy_from_user(lcdd->pool_mem, tx, len)) {
+			ret = -EAGAIN;
+			break;
+		}
+		memset(&spi_transfer, 0, sizeof(struct spi_transfer));
+		spi_transfer.tx_buf = lcdd->pool_mem;
+		spi_transfer.len = len;
+		ret = lcdd_message_send(lcdd, &spi_transfer, data_cmd);
+		if (ret)
+			break;
+		tx += len;
+		left -= len;
+	}
+	return ret;
+}
+
+/*
+ * Sends a command and its arguments from kernel memory, through the pool.
+ */
+static int lcdd_send_cmd_args(struct lcdd *lcdd, uint8_t cmd,
+			      const uint8_t *args, size_t len)
 {
 	int ret;
-	struct lcdd_transfer lcdd_transfer;
 	struct spi_transfer spi_transfer;
-	int data_cmd;
 
-	if (op == SPI_IO_WR_DATA)
-		data_cmd = 1;
-	else
-		data_cmd = 0;
+	memset(&spi_transfer, 0, sizeof(struct spi_transfer));
+	spi_transfer.tx_buf = lcdd->pool_mem;
+	spi_transfer.len = 1;
+	lcdd->pool_mem[0] = cmd;
+	ret = lcdd_message_send(lcdd, &spi_transfer, 0);
+	if (ret || !len)
+		return ret;
+	memcpy(lcdd->pool_mem, args, len);
+	spi_transfer.len = len;
+	return lcdd_message_send(lcdd, &spi_transfer, 1);
+}
 
-	ret = lcdd_parse_user_data((const char __user *)arg, &lcdd_transfer);
+static inline void lcdd_range(uint8_t *args, unsigned int start,
+			      unsigned int end)
+{
+	args[0] = start >> 8;
+	args[1] = start & 0xff;
+	args[2] = end >> 8;
+	args[3] = end & 0xff;
+}
+
+static inline unsigned int lcdd_range_start(const uint8_t *args)
+{
+	return args[0] << 8 | args[1];
+}
+
+static inline unsigned int lcdd_range_end(const uint8_t *args)
+{
+	return args[2] << 8 | args[3];
+}
+
+static inline bool lcdd_window_cmd(uint8_t cmd)
+{
+	return cmd == LCDD_RAMWR || cmd == LCDD_RAMWRC || cmd == LCDD_RAMRD ||
+	       cmd == LCDD_RAMRDC;
+}
+
+static inline bool lcdd_pixel_cmd(uint8_t cmd)
+{
+	return cmd == LCDD_RAMWR || cmd == LCDD_RAMWRC;
+}
+
+/*
+ * Window of the file is set again before it uses the panel memory, when
+ * another opener changed it meanwhile.
+ */
+static int lcdd_claim_window(struct lcdd *lcdd, struct lcdd_file *ctx,
+			     uint8_t cmd)
+{
+	int ret;
+	if (!lcdd_window_cmd(cmd) || ctx->window != LCDD_WINDOW_SET ||
+	    lcdd->window_owner == ctx)
+		return 0;
+	ret = lcdd_send_cmd_args(lcdd, LCDD_CASET, ctx->caset, 4);
+	if (!ret)
+		ret = lcdd_send_cmd_args(lcdd, LCDD_PASET, ctx->paset, 4);
+	if (!ret)
+		lcdd->window_owner = ctx;
+	return ret;
+}
+
+static void lcdd_note_cmd(struct lcdd *lcdd, struct lcdd_file *ctx,
+			  uint8_t cmd)
+{
+	/* memory write continue goes on from the pixel reached */
+	if (!(cmd == LCDD_RAMWRC && ctx->has_cmd && lcdd_pixel_cmd(ctx->cmd)))
+		ctx->sent = 0;
+	ctx->has_cmd = true;
+	ctx->cmd = cmd;
+	lcdd->owner = ctx;
+	if (cmd == LCDD_CASET || cmd == LCDD_PASET)
+		lcdd->window_owner = ctx;
+}
+
+/*
+ * Arguments of the command are kept, of pixel writes only their count.
+ */
+static void lcdd_note_data(struct lcdd_file *ctx, const uint8_t __user *tx,
+			   size_t len)
+{
+	size_t cnt = 0;
+	if (!lcdd_pixel_cmd(ctx->cmd) && ctx->sent < LCDD_ARGS_MAX) {
+		cnt = min(len, LCDD_ARGS_MAX - ctx->sent);
+		if (copy_from_user(ctx->args + ctx->sent, tx, cnt))
+			cnt = 0;
+	}
+	ctx->sent += len;
+	if (ctx->sent < 4 || cnt == 0)
+		return;
+	if (ctx->cmd == LCDD_CASET) {
+		memcpy(ctx->caset, ctx->args, 4);
+		ctx->window |= LCDD_WINDOW_CASET;
+	} else if (ctx->cmd == LCDD_PASET) {
+		memcpy(ctx->paset, ctx->args, 4);
+		ctx->window |= LCDD_WINDOW_PASET;
+	}
+}
+
+/*
+ * Pixel write of the file is opened again at the pixel it reached. When
+ * that is in the middle of a row, the rest of the row gets a window of its
+ * own and len is cut to it; the next call opens the rows below.
+ */
+static int lcdd_resume_pixels(struct lcdd *lcdd, struct lcdd_file *ctx,
+			      size_t *len)
+{
+	uint8_t caset[4], paset[4];
+	unsigned int x0 = lcdd_range_start(ctx->caset);
+	unsigned int x1 = lcdd_range_end(ctx->caset);
+	unsigned int y0 = lcdd_range_start(ctx->paset);
+	unsigned int y1 = lcdd_range_end(ctx->paset);
+	unsigned int width = x1 - x0 + 1;
+	size_t pixel, col, row;
+	int ret;
+	if (ctx->window != LCDD_WINDOW_SET || x1 < x0 || y1 < y0 ||
+	    ctx->sent % BY_PER_PIX)
+		return -EBUSY;
+	pixel = ctx->sent / BY_PER_PIX % (width * (y1 - y0 + 1));
+	col = pixel % width;
+	row = pixel / width;
+	lcdd_range(caset, x0 + col, x1);
+	lcdd_range(paset, y0 + row, col ? y0 + row : y1);
+	ret = lcdd_send_cmd_args(lcdd, LCDD_CASET, caset, 4);
+	if (!ret)
+		ret = lcdd_send_cmd_args(lcdd, LCDD_PASET, paset, 4);
+	if (!ret)
+		ret = lcdd_send_cmd_args(lcdd, LCDD_RAMWR, NULL, 0);
 	if (ret)
-		goto err;
-	ret = lcdd_init_spi_transfer(&lcdd_transfer, &spi_transfer, op);
-	if (ret) 
-		goto err;
-	ret = lcdd_message_send(&spi_transfer, data_cmd);
+		return ret;
+	/* the panel window is not the one of the file any more */
+	lcdd->window_owner = NULL;
+	if (col) {
+		*len = min(*len, (width - col) * BY_PER_PIX);
+		lcdd->owner = NULL;
+	} else {
+		lcdd->owner = ctx;
+	}
+	return 0;
+}
+
+/*
+ * The command the file is in the middle of is sent again, with the
+ * arguments already given.
+ */
+static int lcdd_resume(struct lcdd *lcdd, struct lcdd_file *ctx, size_t *len)
+{
+	int ret;
+	if (!ctx->has_cmd)
+		return 0;
+	if (lcdd_pixel_cmd(ctx->cmd))
+		return lcdd_resume_pixels(lcdd, ctx, len);
+	if (ctx->sent > LCDD_ARGS_MAX)
+		return -EBUSY;
+	ret = lcdd_claim_window(lcdd, ctx, ctx->cmd);
+	if (!ret)
+		ret = lcdd_send_cmd_args(lcdd, ctx->cmd, ctx->args, ctx->sent);
+	if (!ret)
+		lcdd->owner = ctx;
+	return ret;
+}
+
+static int lcdd_data(struct lcdd *lcdd, struct lcdd_file *ctx,
+		     struct lcdd_transfer *transfer)
+{
+	int ret;
+	size_t len;
+	struct lcdd_transfer part = *transfer;
+	while (transfer->byte_cnt) {
+		len = transfer->byte_cnt;
+		if (lcdd->owner != ctx) {
+			ret = lcdd_resume(lcdd, ctx, &len);
+			if (ret)
+				return ret;
+		}
+		part.tx = transfer->tx;
+		part.byte_cnt = len;
+		if (lcdd_xfer_zerocopy(len, zerocopy_min))
+			ret = lcdd_write_pinned(lcdd, &part);
+		else
+			ret = lcdd_write_bounce(lcdd, &part, 1);
+		if (ret)
+			return ret;
+		lcdd_note_data(ctx, part.tx, len);
+		transfer->tx += len;
+		transfer->byte_cnt -= len;
+	}
+	return 0;
+}
+
+static int lcdd_command(struct lcdd *lcdd, struct lcdd_file *ctx, uint8_t cmd)
+{
+	int ret = lcdd_claim_window(lcdd, ctx, cmd);
+	if (!ret)
+		ret = lcdd_send_cmd_args(lcdd, cmd, NULL, 0);
+	if (!ret)
+		lcdd_note_cmd(lcdd, ctx, cmd);
+	return ret;
+}
+
+/*
+ * Command byte goes first, the rest of tx is zeros clocked out while rx
+ * fills the second part of the pool. The controller ends whatever command
+ * was running.
+ */
+static int lcdd_read(struct lcdd *lcdd, struct lcdd_file *ctx,
+		     struct lcdd_transfer *transfer)
+{
+	int ret;
+	uint8_t cmd;
+	size_t len = transfer->byte_cnt;
+	struct spi_transfer spi_transfer;
+
+	if (len <= 2 || !lcdd_xfer_read_fits(len, lcdd->pool_cnt))
+		return -EINVAL;
+	if (get_user(cmd, transfer->tx))
+		return -EAGAIN;
+	ret = lcdd_claim_window(lcdd, ctx, cmd);
+	if (ret)
+		return ret;
+	memset(&spi_transfer, 0, sizeof(struct spi_transfer));
+	spi_transfer.tx_buf = lcdd->pool_mem;
+	spi_transfer.rx_buf = lcdd->pool_mem + PAGE_ALIGN(len);
+	spi_transfer.len = len;
+	memset(lcdd->pool_mem, 0, len);
+	lcdd->pool_mem[0] = cmd;
+	ret = lcdd_message_send(lcdd, &spi_transfer, 0);
+	if (ret)
+		return ret;
+	lcdd->owner = ctx;
+	ctx->has_cmd = false;
+	/*
+	 * addition and subtraction to remove not important data
+	 */
+	if (copy_to_user(transfer->rx, spi_transfer.rx_buf + 2, len - 2))
+		return -EAGAIN;
+	return 0;
+}
+
+static int lcdd_write(struct file *file, unsigned long arg, int op)
+{
+	int ret;
+	uint8_t cmd;
+	struct lcdd_file *ctx = file->private_data;
+	struct lcdd *lcdd = ctx->lcdd;
+	struct lcdd_transfer lcdd_transfer;
+
+	ret = lcdd_parse_user_data((const char __user *)arg, &lcdd_transfer);
 	if (ret)
 		goto err;
-	if (op == SPI_IO_RD_CMD) {
-		/*
-		 * addition and subtraction to remove not important data
-		 */
-		ret = copy_to_user(lcdd_transfer.rx, (void *)(spi_transfer.rx_buf + 2),
-			           spi_transfer.len - 2);
-		if (ret) {
-			goto err;
-		}	
+	mutex_lock(&lcdd->io_lock);
+	if (lcdd->removed) {
+		ret = -ENODEV;
+		goto unlock;
+	}
+	switch (op) {
+	case SPI_IO_WR_DATA:
+		ret = lcdd_data(lcdd, ctx, &lcdd_transfer);
+		break;
+	case SPI_IO_WR_CMD:
+		if (lcdd_transfer.byte_cnt != 1)
+			ret = -EINVAL;
+		else if (get_user(cmd, lcdd_transfer.tx))
+			ret = -EAGAIN;
+		else
+			ret = lcdd_command(lcdd, ctx, cmd);
+		break;
+	case SPI_IO_RD_CMD:
+		ret = lcdd_read(lcdd, ctx, &lcdd_transfer);
+		break;
+	default:
+		ret = -EINVAL;
 	}
+unlock:
+	mutex_unlock(&lcdd->io_lock);
+	if (ret < 0)
+		goto err;
 	return 1;
 err:
 	debug_message();
 	return ret;
 }
-	
+
 static long lcdd_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
-{	
+{
 	return lcdd_write(file, arg, cmd);
 }
 
-static struct lcdd lcdd = {
-	.cdev = NULL,
-	.devt = 0,
-	.class = NULL,
-	.fops = {.owner = THIS_MODULE,
-		.open = lcdd_open,
-		.release = lcdd_release,
-		.unlocked_ioctl = lcdd_ioctl,
-		.compat_ioctl = lcdd_ioctl
-	},
-	.device = NULL };
+static const struct file_operations lcdd_fops = {
+	.owner = THIS_MODULE,
+	.open = lcdd_open,
+	.release = lcdd_release,
+	.unlocked_ioctl = lcdd_ioctl,
+	.compat_ioctl = lcdd_ioctl
+};
 
 static const struct of_device_id lcd_spi_dt_ids[] = {
 	{.compatible = DRIVER_NAME },
@@ -313,7 +765,21 @@ static int lcdd_spi_device_set(struct spi_device *spi)
 	spi->max_speed_hz = SPI_SPEED;
 	spi->bits_per_word = 8;
 	spi->mode = 0;
-	return spi_setup(spi);	
+	return spi_setup(spi);
+}
+
+/*
+ * the first panel keeps the historical /dev/lcd_spi name, the others get
+ * their minor appended
+ */
+static struct device *lcdd_device_create(struct lcdd *lcdd, int minor)
+{
+	struct device *parent = &lcdd->spi_device->dev;
+	if (!minor)
+		return device_create(lcdd_class, parent, lcdd->devt, lcdd,
+				     DRIVER_NAME);
+	return device_create(lcdd_class, parent, lcdd->devt, lcdd,
+			     DRIVER_NAME "%d", minor);
 }
 
 /*
@@ -322,30 +788,116 @@ static int lcdd_spi_device_set(struct spi_device *spi)
 static int lcdd_probe(struct spi_device *spi)
 {
 	int ret;
+	int minor;
+	struct lcdd *lcdd;
 	if (spi->dev.of_node && !of_match_device(lcd_spi_dt_ids, &spi->dev)) {
 		debug_message();
 		dev_err(&spi->dev, "buggy DT: lcd_spi listed directly in DT\n");
 		WARN_ON(spi->dev.of_node &&
 			!of_match_device(lcd_spi_dt_ids, &spi->dev));
 	}
-	lcdd.device = device_create(lcdd.class, &spi->dev, lcdd.devt, &lcdd, 
-				    DRIVER_NAME);
-
-	if (IS_ERR(lcdd.device)) {
-		debug_message();
-		dev_err(&spi->dev, "buggy DT: device already exists in system\n");
-		return PTR_ERR(lcdd.device);		
+	lcdd = kzalloc(sizeof(struct lcdd), GFP_KERNEL);
+	if (!lcdd)
+		return -ENOMEM;
+	kref_init(&lcdd->kref);
+	ret = lcdd_set_gpio(lcdd, &spi->dev);
+	if (ret) {
+		dev_err(&spi->dev, "buggy DT: missing dc/reset gpios\n");
+		goto err_free;
+	}
+	ret = lcdd_pool_alloc(lcdd);
+	if (ret)
+		goto err_free;
+	minor = ida_simple_get(&lcdd_minors, 0, LCDD_MINORS, GFP_KERNEL);
+	if (minor < 0) {
+		ret = minor;
+		goto err_free;
 	}
-	lcdd.spi_device = spi;
+	lcdd->devt = MKDEV(MAJOR(lcdd_devt), minor);
+	lcdd->spi_device = spi;
+	spin_lock_init(&lcdd->lock);
+	mutex_init(&lcdd->io_lock);
+	spi_set_drvdata(spi, lcdd);
 	ret = lcdd_spi_device_set(spi);
 	if (ret)
 		debug_message();
-	return 0;	
+	lcdd_reset(lcdd);
+
+	/*
+	 * the cdev is freed by its own refcount, open files may still hold
+	 * it after the instance is gone
+	 */
+	lcdd->cdev = cdev_alloc();
+	if (!lcdd->cdev) {
+		ret = -ENOMEM;
+		goto err_minor;
+	}
+	lcdd->cdev->ops = &lcdd_fops;
+	lcdd->cdev->owner = THIS_MODULE;
+	mutex_lock(&lcdd_list_lock);
+	lcdd_devices[minor] = lcdd;
+	mutex_unlock(&lcdd_list_lock);
+	ret = cdev_add(lcdd->cdev, lcdd->devt, 1);
+	if (ret) {
+		kobject_put(&lcdd->cdev->kobj);
+		goto err_list;
+	}
+	lcdd->device = lcdd_device_create(lcdd, minor);
+	if (IS_ERR(lcdd->device)) {
+		debug_message();
+		dev_err(&spi->dev, "buggy DT: device already exists in system\n");
+		ret = PTR_ERR(lcdd->device);
+		goto err_cdev;
+	}
+
+	setup_timer(&lcdd->backlight_timer, lcdd_backlight_timer_handler,
+		    (unsigned long)lcdd);
+	mod_timer(&lcdd->backlight_timer, jiffies + BACKLIGHT_DELAY);
+	lcdd->touch_node = of_parse_phandle(spi->dev.of_node, "touchscreen", 0);
+	lcdd->pressed.notifier_call = lcdd_notf_pressed;
+	ret = register_touchpad_notifier(&lcdd->pressed);
+	if (ret) {
+		debug_message();
+		goto err_timer;
+	}
+	return 0;
+err_timer:
+	del_timer_sync(&lcdd->backlight_timer);
+	of_node_put(lcdd->touch_node);
+	device_destroy(lcdd_class, lcdd->devt);
+err_cdev:
+	cdev_del(lcdd->cdev);
+err_list:
+	mutex_lock(&lcdd_list_lock);
+	lcdd_devices[minor] = NULL;
+	mutex_unlock(&lcdd_list_lock);
+err_minor:
+	ida_simple_remove(&lcdd_minors, minor);
+err_free:
+	kref_put(&lcdd->kref, lcdd_free);
+	return ret;
 }
 
+/*
+ * Files still open keep the instance; they only get -ENODEV from now on,
+ * as the gpios and the spi_device go away with the device.
+ */
 static int lcdd_remove(struct spi_device *spi)
 {
-	device_destroy(lcdd.class, lcdd.devt);
+	struct lcdd *lcdd = spi_get_drvdata(spi);
+	mutex_lock(&lcdd_list_lock);
+	lcdd_devices[MINOR(lcdd->devt)] = NULL;
+	mutex_unlock(&lcdd_list_lock);
+	mutex_lock(&lcdd->io_lock);
+	lcdd->removed = true;
+	mutex_unlock(&lcdd->io_lock);
+	unregister_touchpad_notifier(&lcdd->pressed);
+	del_timer_sync(&lcdd->backlight_timer);
+	of_node_put(lcdd->touch_node);
+	device_destroy(lcdd_class, lcdd->devt);
+	cdev_del(lcdd->cdev);
+	ida_simple_remove(&lcdd_minors, MINOR(lcdd->devt));
+	kref_put(&lcdd->kref, lcdd_free);
 	return 0;
 }
 
@@ -362,65 +914,31 @@ static struct spi_driver lcd_spi_driver = {
 static int __init lcdd_init(void)
 {
 	int rt;
-	rt = alloc_chrdev_region(&lcdd.devt, 0, 1, DRIVER_NAME);
+	rt = alloc_chrdev_region(&lcdd_devt, 0, LCDD_MINORS, DRIVER_NAME);
 	if (rt)
 		return rt;
-	lcdd.class = class_create(THIS_MODULE, DRIVER_NAME);
-	if (IS_ERR(lcdd.class)) {
-		rt = PTR_ERR(lcdd.class);
-		goto err;
-	}
-	lcdd.cdev = cdev_alloc();
-	if (!lcdd.cdev) {
-		rt = -ENOMEM;
-		goto err;
-	}
-	cdev_init(lcdd.cdev, &lcdd.fops);
-	rt = cdev_add(lcdd.cdev, lcdd.devt, 1);
-	if (rt) {
-		cdev_del(lcdd.cdev);
+	lcdd_class = class_create(THIS_MODULE, DRIVER_NAME);
+	if (IS_ERR(lcdd_class)) {
+		rt = PTR_ERR(lcdd_class);
 		goto err;
 	}
 	rt = spi_register_driver(&lcd_spi_driver);
 	if (rt < 0) {
-		cdev_del(lcdd.cdev);
-		goto err;
-	}
-	spin_lock_init(&lcdd.lock);
-	lcdd_set_gpio();
-	lcdd_reset();
-	setup_timer(&lcdd_backlight_timer, lcdd_backlight_timer_handler, 0);
-	rt = mod_timer(&lcdd_backlight_timer, jiffies + BACKLIGHT_DELAY);
-	if (rt) {
-		debug_message();
-		cdev_del(lcdd.cdev);
-		goto err;
-	}
-	rt = register_touchpad_notifier(&lcdd_pressed);
-	if (rt) {
-		debug_message();
-		cdev_del(lcdd.cdev);
-		del_timer(&lcdd_backlight_timer);
+		class_destroy(lcdd_class);
 		goto err;
 	}
 	return 0;
 err:
-	if (lcdd.class)
-		class_destroy(lcdd.class);
-	unregister_chrdev_region(lcdd.devt, 1);
+	unregister_chrdev_region(lcdd_devt, LCDD_MINORS);
 	return rt;
 }
 
 static void __exit lcdd_exit(void)
 {
-	unregister_touchpad_notifier(&lcdd_pressed);
-	del_timer(&lcdd_backlight_timer);
-	lcdd_unset_gpio();
 	spi_unregister_driver(&lcd_spi_driver);
-	device_destroy(lcdd.class, lcdd.devt);
-	cdev_del(lcdd.cdev);
-	class_destroy(lcdd.class);
-	unregister_chrdev_region(lcdd.devt, 1);
+	class_destroy(lcdd_class);
+	unregister_chrdev_region(lcdd_devt, LCDD_MINORS);
+	ida_destroy(&lcdd_minors);
 }
 
 module_init(lcdd_init);
@@ -0,0 +1,64 @@
+#ifndef _LCD_SPI_XFER_H_
+#define _LCD_SPI_XFER_H_
+#include <linux/types.h>
+#include <linux/mm.h>
+
+/*
+ * Pure helpers deciding how a pixel write is sent. They take no locks and
+ * touch no hardware.
+ */
+
+/*
+ * at most this many user pages are pinned and mapped per spi_transfer
+ */
+#define LCDD_PIN_PAGES 16
+#define LCDD_PIN_MAX (LCDD_PIN_PAGES * PAGE_SIZE)
+
+/*
+ * below min bytes the copy into the bounce buffer is cheaper than pinning
+ */
+static inline bool lcdd_xfer_zerocopy(size_t len, size_t min)
+{
+	return min && len >= min;
+}
+
+/*
+ * number of pages spanned by len bytes starting at user address uaddr
+ */
+static inline unsigned int lcdd_xfer_pages(unsigned long uaddr, size_t len)
+{
+	if (!len)
+		return 0;
+	return ((uaddr + len - 1) >> PAGE_SHIFT) - (uaddr >> PAGE_SHIFT) + 1;
+}
+
+/*
+ * length of the next chunk of a write with left bytes remaining at uaddr:
+ * all of it when it fits in LCDD_PIN_PAGES, otherwise up to the last page
+ * boundary that does, so every chunk but the last ends on a page
+ */
+static inline size_t lcdd_xfer_chunk(unsigned long uaddr, size_t left)
+{
+	size_t max = LCDD_PIN_MAX - offset_in_page(uaddr);
+	return left < max ? left : max;
+}
+
+/*
+ * length of the next piece of a bounce write through a pool of pool_cnt
+ * pages
+ */
+static inline size_t lcdd_xfer_bounce_chunk(size_t left, unsigned int pool_cnt)
+{
+	size_t max = (size_t)pool_cnt * PAGE_SIZE;
+	return left < max ? left : max;
+}
+
+/*
+ * a read needs its tx and, from the next page on, its rx in the pool
+ */
+static inline bool lcdd_xfer_read_fits(size_t len, unsigned int pool_cnt)
+{
+	return 2 * PAGE_ALIGN(len) <= (size_t)pool_cnt * PAGE_SIZE;
+}
+
+#endif
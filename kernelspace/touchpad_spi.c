@@ -23,18 +23,23 @@
 #include <linux/of.h>
 #include <linux/of_device.h>
 #include <linux/completion.h>
-#include <linux/gpio.h>
+#include <linux/gpio/consumer.h>
 #include <linux/spi/spi.h>
 #include <linux/uaccess.h>
 #include <linux/interrupt.h>
 #include <linux/export.h>
 #include <linux/timer.h>
 #include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/idr.h>
+#include <linux/kref.h>
+#include <linux/slab.h>
 
 #include "touchpad_notifier.h"
 
 #define DRIVER_NAME "touchpad_spi"
 #define SPI_SPEED 100000
+#define TOUCH_MINORS 4
 
 #ifdef DEBUG
 #define debug_message() printk(KERN_EMERG "DEBUG %s %d\n", __FUNCTION__, \
@@ -48,21 +53,41 @@
 
 #define TIMER_DELAY  1 * HZ
 
+/*
+ * One instance per touchpad, allocated when its spi_device is probed. The
+ * pen interrupt is the DT interrupt of the node, or irq-gpios when the
+ * node only names the line. Open files hold references, the instance is
+ * freed with the last one; transfers fail with -ENODEV once removed is
+ * set.
+ */
 struct touch {
 	struct cdev *cdev;
+	struct kref kref;
+	bool removed;
 	dev_t devt;
-	struct file_operations fops;
-	struct class *class;
 	struct device *device;
 	struct spi_device *spi_device;
-	uint8_t flag; 
+	struct timer_list timer;
+	/*
+	 * serializes transfers to this touchpad only, tx and rx are used
+	 * under it by all openers
+	 */
+	struct mutex io_lock;
+	uint8_t flag;
 	uint8_t *tx;
 	uint8_t *rx;
 	uint32_t irq;
 	spinlock_t lock;
 };
 
-static struct touch touch;
+static struct class *touch_class;
+static dev_t touch_devt;
+static DEFINE_IDA(touch_minors);
+/*
+ * touchpads by minor, looked up by open under touch_list_lock
+ */
+static DEFINE_MUTEX(touch_list_lock);
+static struct touch *touch_devices[TOUCH_MINORS];
 
 struct touch_transfer {
 	uint32_t byte_cnt;
@@ -70,11 +95,6 @@ struct touch_transfer {
 	uint8_t __user *rx;
 };
 
-
-static struct gpio touch_gpio[] = {
-	{ 23, GPIOF_IN, "IRQ" }
-};
-
 static ATOMIC_NOTIFIER_HEAD(touchpad_notifier_list);
 
 int register_touchpad_notifier(struct notifier_block *nb)
@@ -99,72 +119,81 @@ EXPORT_SYMBOL_GPL(unregister_touchpad_notifier);
 
 void touchpad_turn_on_interrupt(unsigned long arg)
 {
+	struct touch *touch = (struct touch *)arg;
 	unsigned long flags;
-	spin_lock_irqsave(&touch.lock, flags);
-	touch.flag = 1;
-	spin_unlock_irqrestore(&touch.lock, flags);
+	spin_lock_irqsave(&touch->lock, flags);
+	touch->flag = 1;
+	spin_unlock_irqrestore(&touch->lock, flags);
 }
 
-static struct timer_list touchpad_timer;
-
-static irq_handler_t touchpad_interrupt(unsigned int irq, void *dev_id,
-					struct pt_regs *regs)
+/*
+ * listeners get the touchpad's struct device, so a panel can tell its own
+ * touchscreen from the others
+ */
+static irqreturn_t touchpad_interrupt(int irq, void *dev_id)
 {
-	int rt;
+	struct touch *touch = dev_id;
 	unsigned long flags;
-	spin_lock_irqsave(&touch.lock, flags);
-	if (touch.flag) {
-		rt = atomic_notifier_call_chain(&touchpad_notifier_list, 0, NULL); 
-		rt = mod_timer(&touchpad_timer, jiffies + TIMER_DELAY);
-		touch.flag = 0;
+	spin_lock_irqsave(&touch->lock, flags);
+	if (touch->flag) {
+		atomic_notifier_call_chain(&touchpad_notifier_list, 0,
+					   &touch->spi_device->dev);
+		mod_timer(&touch->timer, jiffies + TIMER_DELAY);
+		touch->flag = 0;
 	}
-	spin_unlock_irqrestore(&touch.lock, flags);
-	return (irq_handler_t)IRQ_HANDLED;
+	spin_unlock_irqrestore(&touch->lock, flags);
+	return IRQ_HANDLED;
+}
+
+static void touch_free(struct kref *kref)
+{
+	struct touch *touch = container_of(kref, struct touch, kref);
+	kfree(touch->rx);
+	kfree(touch->tx);
+	kfree(touch);
 }
 
 int touch_open(struct inode *inode, struct file *file)
 {
-	/*device can be opened only once at a moment*/
-	if  (atomic_read(&file->f_count) != 1) 
-		return -EINVAL;
-	touch.tx = kzalloc(3, GFP_KERNEL);
-	if (!touch.tx)
-		return -ENOMEM;
-	touch.rx = kzalloc(3, GFP_KERNEL);
-	if (!touch.rx) {
-		kfree(touch.tx);
-		return -ENOMEM;
-	}
-	file->private_data = &touch;
+	struct touch *touch;
+	mutex_lock(&touch_list_lock);
+	touch = touch_devices[iminor(inode)];
+	if (touch)
+		kref_get(&touch->kref);
+	mutex_unlock(&touch_list_lock);
+	if (!touch)
+		return -ENODEV;
+	file->private_data = touch;
 	return 0;
 }
 
 int touch_release(struct inode *inode, struct file *file)
 {
-	kfree(touch.rx);
-	touch.rx = NULL;
-	kfree(touch.tx);
-	touch.tx = NULL;
+	struct touch *touch = file->private_data;
+	kref_put(&touch->kref, touch_free);
 	return 0;
-}	
-
-static inline int touch_set_gpio(void)
-{
-	int ret;
-	ret = gpio_request_array(touch_gpio, ARRAY_SIZE(touch_gpio));
-	touch.irq = gpio_to_irq(touch_gpio[0].gpio);
-	return ret;	
 }
 
-static inline void touch_unset_gpio(void)
+static int touch_set_irq(struct touch *touch, struct spi_device *spi)
 {
-	gpio_free_array(touch_gpio, ARRAY_SIZE(touch_gpio));
+	struct gpio_desc *irq_gpio;
+	if (spi->irq > 0) {
+		touch->irq = spi->irq;
+		return 0;
+	}
+	irq_gpio = devm_gpiod_get(&spi->dev, "irq", GPIOD_IN);
+	if (IS_ERR(irq_gpio))
+		return PTR_ERR(irq_gpio);
+	touch->irq = gpiod_to_irq(irq_gpio);
+	if ((int)touch->irq < 0)
+		return touch->irq;
+	return 0;
 }
 
-static int touch_parse_user_data(const char __user *message, 
+static int touch_parse_user_data(const char __user *message,
 			        struct touch_transfer *transfer)
 {
-	int ret = copy_from_user(transfer, message, 
+	int ret = copy_from_user(transfer, message,
 			     sizeof(struct touch_transfer));
 	if (ret)
 		return -EAGAIN;
@@ -175,17 +204,18 @@ static int touch_parse_user_data(const char __user *message,
 	return 0;
 }
 
-static int touch_init_spi_transfer(struct touch_transfer *transfer, 
-				  struct spi_transfer *spi_transfer, int op)
+static int touch_init_spi_transfer(struct touch *touch,
+				   struct touch_transfer *transfer,
+				   struct spi_transfer *spi_transfer, int op)
 {
 	int ret;
 	memset(spi_transfer, 0, sizeof(struct spi_transfer));
 	switch (op) {
 	case SPI_IO_RD_CMD:
-		spi_transfer->tx_buf = touch.tx;
-		spi_transfer->rx_buf = touch.rx;
+		spi_transfer->tx_buf = touch->tx;
+		spi_transfer->rx_buf = touch->rx;
 		spi_transfer->len = 3;
-		ret = copy_from_user(touch.tx, transfer->tx, 1);
+		ret = copy_from_user(touch->tx, transfer->tx, 1);
 		if (ret) {
 			spi_transfer->tx_buf = NULL;
 			spi_transfer->rx_buf = NULL;
@@ -201,7 +231,8 @@ static void touch_complete_transfer(void *context)
 	complete(context);
 }
 
-static int touch_message_send(struct spi_transfer *spi_transfer, uint8_t data_cmd)
+static int touch_message_send(struct touch *touch,
+			      struct spi_transfer *spi_transfer, uint8_t data_cmd)
 {
 	int ret;
 	struct spi_message spi_message;
@@ -213,20 +244,22 @@ static int touch_message_send(struct spi_transfer *spi_transfer, uint8_t data_cm
 	/*
 	 * disabling irqline because in time of measure there are false irqs
 	 */
-	disable_irq_nosync(touch.irq);
-	ret = spi_async(touch.spi_device, &spi_message);
+	disable_irq_nosync(touch->irq);
+	ret = spi_async(touch->spi_device, &spi_message);
 	if (ret) {
 		debug_message();
+		enable_irq(touch->irq);
 		return ret;
 	}
 	wait_for_completion(&done);
-	enable_irq(touch.irq);
+	enable_irq(touch->irq);
 	return 0;
 }
 
-static int touch_write(struct file *file, unsigned long arg, int op) 
+static int touch_write(struct file *file, unsigned long arg, int op)
 {
 	int ret;
+	struct touch *touch = file->private_data;
 	struct touch_transfer touch_transfer;
 	struct spi_transfer spi_transfer;
 	int data_cmd;
@@ -236,12 +269,12 @@ static int touch_write(struct file *file, unsigned long arg, int op)
 		debug_message();
 		goto err;
 	}
-	ret = touch_init_spi_transfer(&touch_transfer, &spi_transfer, op);
+	ret = touch_init_spi_transfer(touch, &touch_transfer, &spi_transfer, op);
 	if (ret) {
 		debug_message();
 		goto err;
 	}
-	ret = touch_message_send(&spi_transfer, data_cmd);
+	ret = touch_message_send(touch, &spi_transfer, data_cmd);
 	if (ret) {
 		debug_message();
 		goto err;
@@ -250,30 +283,34 @@ static int touch_write(struct file *file, unsigned long arg, int op)
 		           spi_transfer.len);
 	if (ret) {
 		debug_message();
-		goto err;	
+		goto err;
 	}
 	return 1;
 err:
 	debug_message();
 	return ret;
 }
-	
+
 static long touch_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
-{	
-	return touch_write(file, arg, cmd);
+{
+	struct touch *touch = file->private_data;
+	long ret;
+	mutex_lock(&touch->io_lock);
+	if (touch->removed)
+		ret = -ENODEV;
+	else
+		ret = touch_write(file, arg, cmd);
+	mutex_unlock(&touch->io_lock);
+	return ret;
 }
 
-static struct touch touch = {
-	.cdev = NULL,
-	.devt = 0,
-	.class = NULL,
-	.fops = {.owner = THIS_MODULE,
-		.open = touch_open,
-		.release = touch_release,
-		.unlocked_ioctl = touch_ioctl,
-		.compat_ioctl = touch_ioctl
-	},
-	.device = NULL };
+static const struct file_operations touch_fops = {
+	.owner = THIS_MODULE,
+	.open = touch_open,
+	.release = touch_release,
+	.unlocked_ioctl = touch_ioctl,
+	.compat_ioctl = touch_ioctl
+};
 
 static const struct of_device_id touch_spi_dt_ids[] = {
 	{.compatible = DRIVER_NAME },
@@ -287,36 +324,138 @@ static int touch_spi_device_set(struct spi_device *spi)
 	spi->max_speed_hz = SPI_SPEED;
 	spi->bits_per_word = 8;
 	spi->mode = 0;
-	return spi_setup(spi);	
+	return spi_setup(spi);
+}
+
+/*
+ * the first touchpad keeps the historical /dev/touchpad_spi name, the
+ * others get their minor appended
+ */
+static struct device *touch_device_create(struct touch *touch, int minor)
+{
+	struct device *parent = &touch->spi_device->dev;
+	if (!minor)
+		return device_create(touch_class, parent, touch->devt, touch,
+				     DRIVER_NAME);
+	return device_create(touch_class, parent, touch->devt, touch,
+			     DRIVER_NAME "%d", minor);
 }
 
 static int touch_probe(struct spi_device *spi)
 {
 	int ret;
+	int minor;
+	struct touch *touch;
 	if (spi->dev.of_node && !of_match_device(touch_spi_dt_ids, &spi->dev)) {
 		debug_message();
 		dev_err(&spi->dev, "buggy DT: touchpad_spi listed directly in DT\n");
 		WARN_ON(spi->dev.of_node &&
 			!of_match_device(touch_spi_dt_ids, &spi->dev));
 	}
-	touch.device = device_create(touch.class, &spi->dev, touch.devt, &touch, 
-				    DRIVER_NAME);
+	touch = kzalloc(sizeof(struct touch), GFP_KERNEL);
+	if (!touch)
+		return -ENOMEM;
+	kref_init(&touch->kref);
+	/*
+	 * separate allocations, so they are safe for DMA
+	 */
+	touch->tx = kzalloc(3, GFP_KERNEL);
+	touch->rx = kzalloc(3, GFP_KERNEL);
+	if (!touch->tx || !touch->rx) {
+		ret = -ENOMEM;
+		goto err_free;
+	}
+	ret = touch_set_irq(touch, spi);
+	if (ret) {
+		dev_err(&spi->dev, "buggy DT: missing interrupt or irq gpio\n");
+		goto err_free;
+	}
+	minor = ida_simple_get(&touch_minors, 0, TOUCH_MINORS, GFP_KERNEL);
+	if (minor < 0) {
+		ret = minor;
+		goto err_free;
+	}
+	touch->devt = MKDEV(MAJOR(touch_devt), minor);
+	touch->spi_device = spi;
+	spin_lock_init(&touch->lock);
+	mutex_init(&touch->io_lock);
+	spi_set_drvdata(spi, touch);
+	ret = touch_spi_device_set(spi);
+	if (ret)
+		debug_message();
 
-	if (IS_ERR(touch.device)) {
+	/*
+	 * the cdev is freed by its own refcount, open files may still hold
+	 * it after the instance is gone
+	 */
+	touch->cdev = cdev_alloc();
+	if (!touch->cdev) {
+		ret = -ENOMEM;
+		goto err_minor;
+	}
+	touch->cdev->ops = &touch_fops;
+	touch->cdev->owner = THIS_MODULE;
+	mutex_lock(&touch_list_lock);
+	touch_devices[minor] = touch;
+	mutex_unlock(&touch_list_lock);
+	ret = cdev_add(touch->cdev, touch->devt, 1);
+	if (ret) {
+		kobject_put(&touch->cdev->kobj);
+		goto err_list;
+	}
+	touch->device = touch_device_create(touch, minor);
+	if (IS_ERR(touch->device)) {
 		debug_message();
 		dev_err(&spi->dev, "buggy DT: device already exists in system\n");
-		return PTR_ERR(touch.device);		
+		ret = PTR_ERR(touch->device);
+		goto err_cdev;
 	}
-	touch.spi_device = spi;
-	ret = touch_spi_device_set(spi);
-	if (ret)
+
+	setup_timer(&touch->timer, touchpad_turn_on_interrupt,
+		    (unsigned long)touch);
+	mod_timer(&touch->timer, jiffies + TIMER_DELAY);
+	ret = request_irq(touch->irq, touchpad_interrupt, IRQF_TRIGGER_FALLING,
+			  dev_name(&spi->dev), touch);
+	if (ret) {
 		debug_message();
-	return 0;	
+		goto err_timer;
+	}
+	return 0;
+err_timer:
+	del_timer_sync(&touch->timer);
+	device_destroy(touch_class, touch->devt);
+err_cdev:
+	cdev_del(touch->cdev);
+err_list:
+	mutex_lock(&touch_list_lock);
+	touch_devices[minor] = NULL;
+	mutex_unlock(&touch_list_lock);
+err_minor:
+	ida_simple_remove(&touch_minors, minor);
+err_free:
+	kref_put(&touch->kref, touch_free);
+	return ret;
 }
 
+/*
+ * Files still open keep the instance, their ioctls fail with -ENODEV as
+ * the irq and the spi_device are gone.
+ */
 static int touch_remove(struct spi_device *spi)
 {
-	device_destroy(touch.class, touch.devt);
+	struct touch *touch = spi_get_drvdata(spi);
+	mutex_lock(&touch_list_lock);
+	touch_devices[MINOR(touch->devt)] = NULL;
+	mutex_unlock(&touch_list_lock);
+	mutex_lock(&touch->io_lock);
+	touch->removed = true;
+	mutex_unlock(&touch->io_lock);
+	free_irq(touch->irq, touch);
+	del_timer_sync(&touch->timer);
+	device_destroy(touch_class, touch->devt);
+	cdev_del(touch->cdev);
+	ida_simple_remove(&touch_minors, MINOR(touch->devt));
+	kref_put(&touch->kref, touch_free);
 	return 0;
 }
 
@@ -333,68 +472,31 @@ static struct spi_driver touch_spi_driver = {
 static int __init touch_init(void)
 {
 	int rt;
-	rt = alloc_chrdev_region(&touch.devt, 0, 1, DRIVER_NAME);
+	rt = alloc_chrdev_region(&touch_devt, 0, TOUCH_MINORS, DRIVER_NAME);
 	if (rt)
 		return rt;
-	touch.class = class_create(THIS_MODULE, DRIVER_NAME);
-	if (IS_ERR(touch.class)) {
-		rt = PTR_ERR(touch.class);
-		goto err;
-	}
-	touch.cdev = cdev_alloc();
-	if (!touch.cdev) {
-		rt = -ENOMEM;
-		goto err;
-	}
-	cdev_init(touch.cdev, &touch.fops);
-	rt = cdev_add(touch.cdev, touch.devt, 1);
-	if (rt) {
-		cdev_del(touch.cdev);
+	touch_class = class_create(THIS_MODULE, DRIVER_NAME);
+	if (IS_ERR(touch_class)) {
+		rt = PTR_ERR(touch_class);
 		goto err;
 	}
 	rt = spi_register_driver(&touch_spi_driver);
 	if (rt < 0) {
-		cdev_del(touch.cdev);
-		goto err;
-	}
-	spin_lock_init(&touch.lock);
-	touch_set_gpio();
-	rt = request_irq(touch.irq, (irq_handler_t)touchpad_interrupt, 
-			 IRQF_TRIGGER_FALLING, "touchpad_interrupt",
-			 NULL);
-	if (rt) {
-		cdev_del(touch.cdev);
-		touch_unset_gpio();
-		goto err;
-	}
-	setup_timer(&touchpad_timer, touchpad_turn_on_interrupt, 0);
-	rt = mod_timer(&touchpad_timer, jiffies + TIMER_DELAY);
-	if (rt) {
-		debug_message();
-		del_timer(&touchpad_timer);
-		cdev_del(touch.cdev);
-		touch_unset_gpio();
-		free_irq(touch.irq, NULL);
+		class_destroy(touch_class);
 		goto err;
 	}
 	return 0;
 err:
-	if (touch.class)
-		class_destroy(touch.class);
-	unregister_chrdev_region(touch.devt, 1);
+	unregister_chrdev_region(touch_devt, TOUCH_MINORS);
 	return rt;
 }
 
 static void __exit touch_exit(void)
 {
-	del_timer(&touchpad_timer);
-	free_irq(touch.irq, NULL);
-	touch_unset_gpio();
 	spi_unregister_driver(&touch_spi_driver);
-	device_destroy(touch.class, touch.devt);
-	cdev_del(touch.cdev);
-	class_destroy(touch.class);
-	unregister_chrdev_region(touch.devt, 1);
+	class_destroy(touch_class);
+	unregister_chrdev_region(touch_devt, TOUCH_MINORS);
+	ida_destroy(&touch_minors);
 }
 
 module_init(touch_init);
@@ -1,12 +1,43 @@
 #include "ipc_client.h"
+#include "qoi_encoder.h"
 
-static int ipc_send(struct ipc_buffer *buf, int mem_size) 
+/* display and viewport addressed by following commands */
+static uint8_t ipc_display;
+static uint8_t ipc_viewport;
+
+void ipc_select_display(uint8_t display)
+{
+	ipc_display = display;
+}
+
+/*
+ * Viewport goes in 8 bits of the command.
+ */
+int ipc_select_viewport(uint16_t viewport)
+{
+	if (viewport > UINT8_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	ipc_viewport = viewport;
+	return 0;
+}
+
+/*
+ * Sends command header, optional head of payload and payload itself, then
+ * waits for errno returned by daemon and reply data if command succeeded.
+ */
+static int ipc_send_ext(struct ipc_buffer *buf, const void *head, 
+			int head_size, int mem_size, void *reply, 
+			int reply_size) 
 {
 	struct sockaddr_un server;	
 	socklen_t len;
 	int sckt;
 	int ret;
 	int data; 
+	int cmd = IPC_IN_VIEWPORT(IPC_ON_DISPLAY(buf->cmd, ipc_display), 
+				  ipc_viewport);
 
 	server.sun_family = AF_UNIX;
 	strcpy(server.sun_path, "/tmp/lcd_spi_socket\0");
@@ -19,7 +50,7 @@ static int ipc_send(struct ipc_buffer *buf, int mem_size)
 		close(sckt);
 		return -1;
 	}
-	ret = send(sckt, &buf->cmd, sizeof(buf->cmd), 0);
+	ret = send(sckt, &cmd, sizeof(cmd), 0);
 	if (ret < 0) {
 		close(sckt);
 		return -1;
@@ -29,10 +60,19 @@ static int ipc_send(struct ipc_buffer *buf, int mem_size)
 		close(sckt);
 		return -1;
 	}
-	ret = send(sckt, buf->mem, mem_size, 0);
-	if (ret < 0) {
-		close(sckt);
-		return ret;
+	if (head_size) {
+		ret = send(sckt, head, head_size, 0);
+		if (ret < 0) {
+			close(sckt);
+			return ret;
+		}
+	}
+	if (mem_size) {
+		ret = send(sckt, buf->mem, mem_size, 0);
+		if (ret < 0) {
+			close(sckt);
+			return ret;
+		}
 	}
 	ret = recv(sckt, &data, sizeof(errno), MSG_WAITALL);
 	if (ret < 0) {
@@ -40,11 +80,24 @@ static int ipc_send(struct ipc_buffer *buf, int mem_size)
 		return ret;
 	}
 	if (data) {
+		close(sckt);
 		errno = data;
 		return -1;
-	} else {
-		return 0;
 	}
+	if (reply_size) {
+		ret = recv(sckt, reply, reply_size, MSG_WAITALL);
+		if (ret != reply_size) {
+			close(sckt);
+			return -1;
+		}
+	}
+	close(sckt);
+	return 0;
+}
+
+static inline int ipc_send(struct ipc_buffer *buf, int mem_size)
+{
+	return ipc_send_ext(buf, NULL, 0, mem_size, NULL, 0);
 }
 
 static int ipc_read(uint8_t *data, uint8_t size, int cmd)
@@ -64,6 +117,7 @@ static int ipc_read(uint8_t *data, uint8_t size, int cmd)
 		close(sckt);
 		return ret;
 	}
+	cmd = IPC_ON_DISPLAY(cmd, ipc_display);
 	ret = send(sckt, &cmd, sizeof(cmd), 0);
 	if (ret < 0) {
 		close(sckt);
@@ -94,21 +148,148 @@ int ipc_send_bitmap(uint16_t x, uint16_t y, uint16_t dx, uint16_t dy,
 	return ret;
 }
 
+int ipc_send_rgba(uint16_t x, uint16_t y, uint16_t dx, uint16_t dy,
+		  uint8_t *mem)
+{
+	struct ipc_buffer buf;
+	buf.cmd = WRITE_RGBA;
+	buf.x = x;
+	buf.y = y;
+	buf.dx = dx;
+	buf.dy = dy;
+	buf.mem = mem;
+	return ipc_send(&buf, RGBA_SIZE(dx, dy));
+}
+
+int ipc_send_palette(uint8_t id, uint16_t cnt, uint8_t *colours)
+{
+	struct ipc_buffer buf;
+	buf.cmd = UPLOAD_PALETTE;
+	buf.x = id;
+	buf.y = 0;
+	buf.dx = cnt;
+	buf.dy = 0;
+	buf.mem = colours;
+	return ipc_send(&buf, cnt * BY_PER_PIX);
+}
+
+int ipc_send_bitmap_indexed(uint16_t x, uint16_t y, uint16_t dx, uint16_t dy,
+			    uint8_t bpp, uint8_t palette, uint8_t *mem)
+{
+	struct ipc_buffer buf;
+	struct ipc_indexed idx = {
+		.bpp = bpp,
+		.palette = palette
+	};
+	if (bpp != 1 && bpp != 2 && bpp != 4 && bpp != 8) {
+		errno = EINVAL;
+		return -1;
+	}
+	buf.cmd = WRITE_BITMAP_INDEXED;
+	buf.x = x;
+	buf.y = y;
+	buf.dx = dx;
+	buf.dy = dy;
+	buf.mem = mem;
+	return ipc_send_ext(&buf, &idx, sizeof(idx), 
+			    INDEXED_ROW_SIZE(dx, bpp) * dy, NULL, 0);
+}
+
+int ipc_send_qoi(uint16_t x, uint16_t y, uint16_t dx, uint16_t dy,
+		 uint8_t *qoi, uint32_t size)
+{
+	struct ipc_buffer buf;
+	buf.cmd = WRITE_QOI;
+	buf.x = x;
+	buf.y = y;
+	buf.dx = dx;
+	buf.dy = dy;
+	buf.mem = qoi;
+	return ipc_send_ext(&buf, &size, sizeof(size), size, NULL, 0);
+}
+
+int ipc_send_bitmap_qoi(uint16_t x, uint16_t y, uint16_t dx, uint16_t dy,
+			uint8_t *mem)
+{
+	uint32_t size;
+	int ret;
+	uint8_t *qoi = qoi_encode_rgb565(mem, dx, dy, &size);
+	if (!qoi)
+		return -1;
+	ret = ipc_send_qoi(x, y, dx, dy, qoi, size);
+	free(qoi);
+	return ret;
+}
+
+int ipc_upload_asset(uint16_t dx, uint16_t dy, uint8_t *mem, 
+		     uint64_t *handle)
+{
+	struct ipc_buffer buf;
+	buf.cmd = UPLOAD_ASSET;
+	buf.x = 0;
+	buf.y = 0;
+	buf.dx = dx;
+	buf.dy = dy;
+	buf.mem = mem;
+	return ipc_send_ext(&buf, NULL, 0, BY_PER_PIX * dx * dy, handle, 
+			    sizeof(*handle));
+}
+
+int ipc_draw_asset(uint64_t handle, uint16_t x, uint16_t y)
+{
+	struct ipc_buffer buf;
+	buf.cmd = DRAW_ASSET;
+	buf.x = x;
+	buf.y = y;
+	buf.dx = 0;
+	buf.dy = 0;
+	buf.mem = (uint8_t *)&handle;
+	return ipc_send(&buf, sizeof(handle));
+}
+
+/*
+ * Draws bitmap through daemon asset cache, pixels are sent only when
+ * daemon does not have them yet.
+ */
+int ipc_send_bitmap_cached(uint16_t x, uint16_t y, uint16_t dx, uint16_t dy,
+			   uint8_t *mem)
+{
+	uint64_t handle = ipc_asset_hash(mem, dx, dy);
+	int ret = ipc_draw_asset(handle, x, y);
+	if (!ret || errno != ENOENT)
+		return ret;
+	ret = ipc_upload_asset(dx, dy, mem, &handle);
+	if (ret)
+		return ret;
+	return ipc_draw_asset(handle, x, y);
+}
+
 int ipc_send_text(char *text, enum colors font, enum colors background,
 		  uint16_t x, uint16_t y)
+{
+	return ipc_send_text_scaled(text, font, background, x, y, 1);
+}
+
+int ipc_send_text_scaled(char *text, enum colors font, enum colors background,
+			 uint16_t x, uint16_t y, uint8_t scale)
 {
 	int ret;
 	struct ipc_buffer buf;
+	if (scale < 1 || scale > TEXT_SCALE_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
 	buf.x = x;
 	buf.y = y;
 	buf.dx = strlen(text);
-	buf.dy = (font << 8) | background;
+	buf.dy = (scale << TEXT_SCALE_SHIFT) | (font << 8) | background;
 	buf.cmd = WRITE_TEXT;
 	buf.mem = malloc(buf.dx + 1);
 	if (!buf.mem)
 		return -1;
 	strcpy((char *)buf.mem, text);
 	ret = ipc_send(&buf, buf.dx);
+	free(buf.mem);
 	return ret;
 }
 
@@ -131,13 +312,220 @@ int ipc_send_rectangle(uint16_t x, uint16_t y, uint16_t dx, uint16_t dy,
 	return ret;
 }
 
+int ipc_copy_rect(uint16_t src_x, uint16_t src_y, uint16_t dx, uint16_t dy,
+		  uint16_t dst_x, uint16_t dst_y)
+{
+	struct ipc_buffer buf;
+	struct ipc_copy copy = {
+		.dst_x = dst_x,
+		.dst_y = dst_y
+	};
+	buf.cmd = COPY_RECT;
+	buf.x = src_x;
+	buf.y = src_y;
+	buf.dx = dx;
+	buf.dy = dy;
+	buf.mem = (uint8_t *)&copy;
+	return ipc_send(&buf, sizeof(copy));
+}
+
+static int ipc_send_shape(int cmd, uint16_t x, uint16_t y, uint16_t dx, 
+			  uint16_t dy, void *mem, int size)
+{
+	struct ipc_buffer buf;
+	buf.cmd = cmd;
+	buf.x = x;
+	buf.y = y;
+	buf.dx = dx;
+	buf.dy = dy;
+	buf.mem = mem;
+	return ipc_send(&buf, size);
+}
+
+int ipc_draw_line(uint16_t x0, uint16_t y0, uint16_t x1, uint16_t y1, 
+		  uint16_t colour)
+{
+	return ipc_send_shape(DRAW_LINE, x0, y0, x1, y1, &colour, 
+			      sizeof(colour));
+}
+
+int ipc_draw_circle(uint16_t x, uint16_t y, uint16_t r, uint16_t flags,
+		    uint16_t colour)
+{
+	return ipc_send_shape(DRAW_CIRCLE, x, y, r, flags, &colour, 
+			      sizeof(colour));
+}
+
+int ipc_draw_arc(uint16_t x, uint16_t y, uint16_t r, uint16_t thickness,
+		 uint16_t start, uint16_t sweep, uint16_t colour)
+{
+	struct ipc_arc arc = {
+		.colour = colour,
+		.start = start,
+		.sweep = sweep
+	};
+	return ipc_send_shape(DRAW_ARC, x, y, r, thickness, &arc, sizeof(arc));
+}
+
+int ipc_draw_round_rect(uint16_t x, uint16_t y, uint16_t dx, uint16_t dy,
+			uint16_t radius, uint16_t flags, uint16_t colour)
+{
+	struct ipc_round_rect round_rect = {
+		.colour = colour,
+		.radius = radius,
+		.flags = flags
+	};
+	return ipc_send_shape(DRAW_ROUND_RECT, x, y, dx, dy, &round_rect,
+			      sizeof(round_rect));
+}
+
+int ipc_draw_polygon(struct ipc_point *points, uint16_t cnt, uint16_t flags,
+		     uint16_t colour)
+{
+	struct ipc_buffer buf;
+	if (!cnt || cnt > POLYGON_POINTS_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	buf.cmd = DRAW_POLYGON;
+	buf.x = cnt;
+	buf.y = flags;
+	buf.dx = 0;
+	buf.dy = 0;
+	buf.mem = (uint8_t *)points;
+	return ipc_send_ext(&buf, &colour, sizeof(colour), 
+			    cnt * sizeof(*points), NULL, 0);
+}
+
+int ipc_sprite_define(uint8_t id, uint16_t dx, uint16_t dy, uint8_t *image,
+		      uint8_t *mask)
+{
+	struct ipc_buffer buf;
+	buf.cmd = SPRITE_DEFINE;
+	buf.x = id;
+	buf.y = 0;
+	buf.dx = dx;
+	buf.dy = dy;
+	buf.mem = mask;
+	return ipc_send_ext(&buf, image, BY_PER_PIX * dx * dy, 
+			    SPRITE_MASK_SIZE(dx, dy), NULL, 0);
+}
+
+int ipc_sprite_move(uint8_t id, int16_t x, int16_t y, uint16_t flags)
+{
+	struct ipc_buffer buf;
+	buf.cmd = SPRITE_MOVE;
+	buf.x = x;
+	buf.y = y;
+	buf.dx = id;
+	buf.dy = flags;
+	buf.mem = NULL;
+	return ipc_send(&buf, 0);
+}
+
+int ipc_anim_start(uint16_t x, uint16_t y, uint16_t dx, uint16_t dy,
+		   struct ipc_anim *anim, struct ipc_point *keys)
+{
+	struct ipc_buffer buf;
+	uint16_t cnt = anim->type == ANIM_SPRITE ? anim->cnt : 0;
+	buf.cmd = ANIM_START;
+	buf.x = x;
+	buf.y = y;
+	buf.dx = dx;
+	buf.dy = dy;
+	buf.mem = (uint8_t *)keys;
+	return ipc_send_ext(&buf, anim, sizeof(*anim), 
+			    cnt * sizeof(*keys), NULL, 0);
+}
+
+int ipc_anim_stop(uint8_t slot)
+{
+	struct ipc_buffer buf;
+	buf.cmd = ANIM_STOP;
+	buf.x = slot;
+	buf.y = 0;
+	buf.dx = 0;
+	buf.dy = 0;
+	buf.mem = NULL;
+	return ipc_send(&buf, 0);
+}
+
+int ipc_set_orientation(uint16_t rotation)
+{
+	struct ipc_buffer buf;
+	buf.cmd = SET_ORIENTATION;
+	buf.x = rotation;
+	buf.y = 0;
+	buf.dx = 0;
+	buf.dy = 0;
+	buf.mem = NULL;
+	return ipc_send(&buf, 0);
+}
+
+int ipc_viewport_open(uint16_t x, uint16_t y, uint16_t dx, uint16_t dy,
+		      uint16_t *viewport)
+{
+	struct ipc_buffer buf;
+	buf.cmd = VIEWPORT_OPEN;
+	buf.x = x;
+	buf.y = y;
+	buf.dx = dx;
+	buf.dy = dy;
+	buf.mem = NULL;
+	return ipc_send_ext(&buf, NULL, 0, 0, viewport, sizeof(*viewport));
+}
+
+int ipc_viewport_close(uint16_t viewport)
+{
+	struct ipc_buffer buf;
+	buf.cmd = VIEWPORT_CLOSE;
+	buf.x = viewport;
+	buf.y = 0;
+	buf.dx = 0;
+	buf.dy = 0;
+	buf.mem = NULL;
+	return ipc_send(&buf, 0);
+}
+
+static int ipc_frame(int cmd)
+{
+	struct ipc_buffer buf;
+	buf.cmd = cmd;
+	buf.x = 0;
+	buf.y = 0;
+	buf.dx = 0;
+	buf.dy = 0;
+	buf.mem = NULL;
+	return ipc_send(&buf, 0);
+}
+
+int ipc_begin_frame(void)
+{
+	return ipc_frame(BEGIN_FRAME);
+}
+
+int ipc_end_frame(void)
+{
+	return ipc_frame(END_FRAME);
+}
+
+int ipc_read_touch(struct ipc_touch *touch)
+{
+	return ipc_read((uint8_t *)touch, sizeof(*touch), READ_TOUCHSCREEN);
+}
+
 int ipc_read_touchscreen(uint16_t *x, uint16_t *y, uint16_t *z) {
-	uint16_t data[3];
-	int ret = ipc_read((uint8_t *)data, sizeof(data), READ_TOUCHSCREEN);
+	struct ipc_touch touch;
+	int ret = ipc_read_touch(&touch);
 	if (ret)
 		return ret;
-	*x = data[0];
-	*y = data[1];
-	*z = data[2];
+	*x = touch.x;
+	*y = touch.y;
+	*z = touch.z;
 	return 0;
 }
+
+int ipc_read_stats(struct ipc_stats *stats)
+{
+	return ipc_read((uint8_t *)stats, sizeof(*stats), READ_STATS);
+}
@@ -2,12 +2,68 @@
 #define _IPC_CLIENT_H_
 #include "ipc.h"
  
+/*
+ * Commands go to display 0 unless another one is selected.
+ */
+void ipc_select_display(uint8_t display);
+/*
+ * Drawing commands go to the whole screen unless a viewport opened by
+ * this process is selected, 0 selects the screen again. Sprites and
+ * animations are used with the screen selected. IDs above 255 are
+ * refused with EINVAL.
+ */
+int ipc_select_viewport(uint16_t viewport);
+int ipc_viewport_open(uint16_t x, uint16_t y, uint16_t dx, uint16_t dy,
+		      uint16_t *viewport);
+int ipc_viewport_close(uint16_t viewport);
+/*
+ * Drawing between the two is shown at once by ipc_end_frame.
+ */
+int ipc_begin_frame(void);
+int ipc_end_frame(void);
 int ipc_send_bitmap(uint16_t x, uint16_t y, uint16_t dx, uint16_t dy,
 		    uint8_t *mem);
+int ipc_send_rgba(uint16_t x, uint16_t y, uint16_t dx, uint16_t dy,
+		  uint8_t *mem);
+int ipc_send_palette(uint8_t id, uint16_t cnt, uint8_t *colours);
+int ipc_send_bitmap_indexed(uint16_t x, uint16_t y, uint16_t dx, uint16_t dy,
+			    uint8_t bpp, uint8_t palette, uint8_t *mem);
+int ipc_send_qoi(uint16_t x, uint16_t y, uint16_t dx, uint16_t dy,
+		 uint8_t *qoi, uint32_t size);
+int ipc_send_bitmap_qoi(uint16_t x, uint16_t y, uint16_t dx, uint16_t dy,
+			uint8_t *mem);
+int ipc_upload_asset(uint16_t dx, uint16_t dy, uint8_t *mem, 
+		     uint64_t *handle);
+int ipc_draw_asset(uint64_t handle, uint16_t x, uint16_t y);
+int ipc_send_bitmap_cached(uint16_t x, uint16_t y, uint16_t dx, uint16_t dy,
+			   uint8_t *mem);
 int ipc_send_text(char *text, enum colors font, enum colors background,
 		  uint16_t x, uint16_t y);
+int ipc_send_text_scaled(char *text, enum colors font, enum colors background,
+			 uint16_t x, uint16_t y, uint8_t scale);
 int ipc_send_rectangle(uint16_t x, uint16_t y, uint16_t dx, uint16_t dy,
 		       enum colors color);
+int ipc_copy_rect(uint16_t src_x, uint16_t src_y, uint16_t dx, uint16_t dy,
+		  uint16_t dst_x, uint16_t dst_y);
+int ipc_draw_line(uint16_t x0, uint16_t y0, uint16_t x1, uint16_t y1, 
+		  uint16_t colour);
+int ipc_draw_circle(uint16_t x, uint16_t y, uint16_t r, uint16_t flags,
+		    uint16_t colour);
+int ipc_draw_arc(uint16_t x, uint16_t y, uint16_t r, uint16_t thickness,
+		 uint16_t start, uint16_t sweep, uint16_t colour);
+int ipc_draw_round_rect(uint16_t x, uint16_t y, uint16_t dx, uint16_t dy,
+			uint16_t radius, uint16_t flags, uint16_t colour);
+int ipc_draw_polygon(struct ipc_point *points, uint16_t cnt, uint16_t flags,
+		     uint16_t colour);
+int ipc_sprite_define(uint8_t id, uint16_t dx, uint16_t dy, uint8_t *image,
+		      uint8_t *mask);
+int ipc_sprite_move(uint8_t id, int16_t x, int16_t y, uint16_t flags);
+int ipc_anim_start(uint16_t x, uint16_t y, uint16_t dx, uint16_t dy,
+		   struct ipc_anim *anim, struct ipc_point *keys);
+int ipc_anim_stop(uint8_t slot);
+int ipc_set_orientation(uint16_t rotation);
 int ipc_read_touchscreen(uint16_t *x, uint16_t *y, uint16_t *z);
+int ipc_read_touch(struct ipc_touch *touch);
+int ipc_read_stats(struct ipc_stats *stats);
 
 #endif
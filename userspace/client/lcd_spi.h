@@ -43,7 +43,19 @@
 #define HEIGHT_MAX 320
 #define BY_PER_PIX 2
 #define TOT_MEM_SIZE BY_PER_PIX * HEIGHT_MAX * LENGTH_MAX
+/* largest chunk, the one in use is spi_queue_chunk() */
+#define LCD_CHUNK_SIZE 16384
+/* SPI time of setting new window, in pixels */
+#define LCD_WINDOW_COST 64
+/* long writes may be preempted after this many bytes */
+#define LCD_BULK_SIZE 8192
 	
+/* RDDST bits of its second and third byte, RDDCOLMOD interface format */
+#define LCD_STATUS_SLEEP_OUT 0x02
+#define LCD_STATUS_DISPLAY_ON 0x04
+#define LCD_COLMOD_MASK 0x07
+#define LCD_COLMOD_16BIT 0x05
+
 #define SPI_IOC_MAGIC			'k'
 #define SPI_IO_WR_DATA		_IOW(SPI_IOC_MAGIC, 6, struct lcdd_transfer)
 #define SPI_IO_WR_CMD		_IOW(SPI_IOC_MAGIC, 7, struct lcdd_transfer)
@@ -53,6 +65,134 @@ enum colors {
 	black, white, red, blue, yellow, green, brown, background 
 };
 
+/*
+ * Logical geometry of the panel, width and height are swapped for 90 and
+ * 270 degrees rotation. fb records what is on screen, row by row in
+ * logical orientation and panel byte order.
+ */
+struct lcd_window {
+	uint16_t x0;
+	uint16_t x1;
+	uint16_t y0;
+	uint16_t y1;
+	uint8_t valid;
+};
+
+/*
+ * Rectangle with exclusive ends, empty when x1 <= x0. Panel damage is the
+ * bounding box of all windows written since lcd_damage_reset.
+ */
+struct lcd_rect {
+	uint16_t x0;
+	uint16_t y0;
+	uint16_t x1;
+	uint16_t y1;
+};
+
+struct lcd_panel {
+	uint16_t width;
+	uint16_t height;
+	uint16_t rotation;
+	uint8_t *fb;
+	struct lcd_window window;
+	struct lcd_rect damage;
+	struct lcd_rect view;
+	uint8_t clip;
+	/* area drawn while a frame is composed, see lcd_frame.h */
+	struct lcd_rect frame;
+	uint8_t compose;
+};
+
+/*
+ * Every panel is driven by its own thread, so the record and the rest of
+ * rendering state (spans, streams, palettes, sprites, animations) are
+ * thread-local; only the asset cache is shared between panels.
+ */
+extern __thread struct lcd_panel lcd_panel;
+
+static inline uint8_t *lcd_fb_pos(uint16_t x, uint16_t y)
+{
+	return lcd_panel.fb + (y * lcd_panel.width + x) * BY_PER_PIX;
+}
+
+/* plain RGB565 value to panel byte order */
+static inline uint16_t lcd_panel_colour(uint16_t rgb)
+{
+	uint8_t mem[BY_PER_PIX] = {rgb >> 8, rgb & 0xff};
+	uint16_t colour;
+	memcpy(&colour, mem, sizeof(colour));
+	return colour;
+}
+
+static inline int lcd_rect_empty(const struct lcd_rect *rect)
+{
+	return rect->x1 <= rect->x0 || rect->y1 <= rect->y0;
+}
+
+static inline uint32_t lcd_rect_area(const struct lcd_rect *rect)
+{
+	return lcd_rect_empty(rect) ? 0 : 
+	       (uint32_t)(rect->x1 - rect->x0) * (rect->y1 - rect->y0);
+}
+
+static inline void lcd_rect_union(struct lcd_rect *rect, 
+				  const struct lcd_rect *other)
+{
+	if (lcd_rect_empty(other))
+		return;
+	if (lcd_rect_empty(rect)) {
+		*rect = *other;
+		return;
+	}
+	if (other->x0 < rect->x0)
+		rect->x0 = other->x0;
+	if (other->y0 < rect->y0)
+		rect->y0 = other->y0;
+	if (other->x1 > rect->x1)
+		rect->x1 = other->x1;
+	if (other->y1 > rect->y1)
+		rect->y1 = other->y1;
+}
+
+static inline int lcd_rect_overlap(const struct lcd_rect *a, 
+				   const struct lcd_rect *b)
+{
+	return !lcd_rect_empty(a) && !lcd_rect_empty(b) && a->x0 < b->x1 &&
+	       b->x0 < a->x1 && a->y0 < b->y1 && b->y0 < a->y1;
+}
+
+static inline void lcd_damage_reset(void)
+{
+	memset(&lcd_panel.damage, 0, sizeof(lcd_panel.damage));
+}
+
+/*
+ * Draws are placed in the view, their coordinates are relative to its top
+ * left corner. The view is the whole screen unless a viewport is set;
+ * pixels outside a viewport are clipped, while draws reaching past the
+ * screen are rejected.
+ */
+void lcd_set_view(const struct lcd_rect *view);
+int lcd_view_rect(uint16_t x, uint16_t y, uint16_t dx, uint16_t dy, 
+		  struct lcd_rect *rect);
+
+static inline uint16_t lcd_view_width(void)
+{
+	return lcd_panel.view.x1 - lcd_panel.view.x0;
+}
+
+static inline uint16_t lcd_view_height(void)
+{
+	return lcd_panel.view.y1 - lcd_panel.view.y0;
+}
+
+/*
+ * Called by long writes of the panel thread between their pieces, keep is
+ * the area the writer is still going to send pixels to (NULL when it
+ * sends from screen record). Returns 1 when it drew anything.
+ */
+typedef int (*lcd_preempt_fn)(const struct lcd_rect *keep);
+
 struct lcdd_transfer {
 	uint32_t byte_cnt;
 	const uint8_t *tx_buf;
@@ -61,10 +201,33 @@ struct lcdd_transfer {
 
 int lcd_draw_bitmap(int fd, struct ipc_buffer *buf);
 int lcd_draw_text(int fd, struct ipc_buffer *buf);
+int lcd_text_rect(struct ipc_buffer *buf, struct lcd_rect *rect);
+void lcd_set_preempt(lcd_preempt_fn fn);
 int lcd_return_colors(enum colors color, uint8_t *red, uint8_t *green,
 		      uint8_t *blue);
 int lcd_draw_rectangle(int fd, uint16_t x, uint16_t y, uint16_t length,
 		       uint16_t height, uint8_t red, uint8_t green, 
 		       uint8_t blue);
+int lcd_upload_palette(struct ipc_buffer *buf);
+int lcd_draw_bitmap_indexed(int fd, struct ipc_buffer *buf, 
+			    struct ipc_indexed *idx);
+int lcd_stream_begin(int fd, uint16_t x, uint16_t y, uint16_t dx, 
+		     uint16_t dy);
+void lcd_stream_write(int fd, uint8_t *mem, uint32_t size);
+int lcd_rgba_begin(uint16_t x, uint16_t y, uint16_t dx, uint16_t dy);
+void lcd_rgba_write(const uint8_t *mem, uint16_t rows);
+void lcd_rgba_end(int fd);
+void lcd_fill_rect(uint16_t x, uint16_t y, uint16_t dx, uint16_t dy,
+		   uint16_t colour);
+void lcd_flush_rect(int fd, uint16_t x, uint16_t y, uint16_t dx, 
+		    uint16_t dy);
+void lcd_span(int fd, int x0, int x1, int y, uint16_t colour);
+void lcd_span_add(int fd, int x0, int x1, int y);
+void lcd_span_flush(int fd);
+int lcd_copy_rect(int fd, uint16_t src_x, uint16_t src_y, uint16_t dx, 
+		  uint16_t dy, uint16_t dst_x, uint16_t dst_y);
+int lcd_set_orientation(int fd, uint16_t rotation);
 int lcd_read_touchscreen(int fd, uint16_t *x, uint16_t *y, uint16_t *z);
+int lcd_read_scanline(int fd, uint16_t *line);
+int lcd_panel_start(int fd, int fd_touch, uint16_t rotation, uint8_t display);
 #endif /* _LCD_SPI_H_ */
@@ -0,0 +1,59 @@
+#include "ipc_client.h"
+
+#define MARKER_SIZE 8
+
+/*
+ * Starts blinking indicator and marker circling the screen centre, both
+ * keep running in the daemon after this program exits.
+ */
+static int start_animations(void)
+{
+	uint8_t image[MARKER_SIZE * MARKER_SIZE * BY_PER_PIX];
+	uint8_t mask[SPRITE_MASK_SIZE(MARKER_SIZE, MARKER_SIZE)];
+	struct ipc_point keys[9] = {
+		{.x = 116, .y = 96}, {.x = 161, .y = 115}, {.x = 180, .y = 156},
+		{.x = 161, .y = 197}, {.x = 116, .y = 216}, {.x = 71, .y = 197},
+		{.x = 52, .y = 156}, {.x = 71, .y = 115}, {.x = 116, .y = 96}
+	};
+	struct ipc_anim blink = {
+		.slot = 0,
+		.type = ANIM_RAMP,
+		.flags = ANIM_LOOP | ANIM_REVERSE,
+		.duration = 500,
+		.cnt = 1,
+		.colour = {RGB565(0, 0, 0), RGB565(255, 0, 0)}
+	};
+	struct ipc_anim orbit = {
+		.slot = 1,
+		.type = ANIM_SPRITE,
+		.flags = ANIM_LOOP,
+		.sprite = 0,
+		.duration = 2000,
+		.cnt = 9
+	};
+	int ret;
+	memset(image, 0xff, sizeof(image));
+	memset(mask, 0xff, sizeof(mask));
+	ret = ipc_sprite_define(0, MARKER_SIZE, MARKER_SIZE, image, mask);
+	if (ret)
+		return ret;
+	ret = ipc_anim_start(200, 10, 30, 30, &blink, NULL);
+	if (ret)
+		return ret;
+	return ipc_anim_start(0, 0, 0, 0, &orbit, keys);
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+	if (argc > 1 && !strcmp(argv[1], "stop")) {
+		ret = ipc_anim_stop(0) || ipc_anim_stop(1);
+		if (ret)
+			perror("ipc_anim_stop");
+		return ret;
+	}
+	ret = start_animations();
+	if (ret)
+		perror("start_animations");
+	return ret;	
+}
@@ -0,0 +1,41 @@
+#include "ipc_client.h"
+
+/*
+ * Draws a small gauge: rounded frame, arc scale, needle and a triangle
+ * marker.
+ */
+static int draw_shapes(void)
+{
+	struct ipc_point marker[3] = {
+		{.x = 110, .y = 40},
+		{.x = 130, .y = 40},
+		{.x = 120, .y = 60}
+	};
+	int ret;
+	ret = ipc_send_rectangle(0, 0, 240, 320, black);
+	if (ret)
+		return ret;
+	ret = ipc_draw_round_rect(10, 10, 220, 300, 16, 0, 
+				  RGB565(255, 255, 255));
+	if (ret)
+		return ret;
+	ret = ipc_draw_arc(120, 160, 90, 12, 135, 270, RGB565(0, 255, 0));
+	if (ret)
+		return ret;
+	ret = ipc_draw_circle(120, 160, 8, SHAPE_FILL, RGB565(255, 0, 0));
+	if (ret)
+		return ret;
+	ret = ipc_draw_line(120, 160, 180, 100, RGB565(255, 0, 0));
+	if (ret)
+		return ret;
+	return ipc_draw_polygon(marker, 3, SHAPE_FILL, RGB565(0, 0, 255));
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+	ret = draw_shapes();
+	if (ret)
+		perror("draw_shapes");
+	return ret;	
+}
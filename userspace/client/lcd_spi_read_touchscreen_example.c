@@ -1,23 +1,29 @@
 #include "ipc_client.h"
 
-static void convert_to_string(char *buf, uint16_t x, uint16_t y, uint16_t z)
+static void convert_to_string(char *buf, struct ipc_touch *touch)
 {
 	memset(buf, 0, 160);
-	sprintf(buf, "x = %03hu, y = %03hu, z = %03hu", x, y, z);	
+	sprintf(buf, "%hu: x = %03hu, y = %03hu, z = %03hu", touch->display,
+		touch->x, touch->y, touch->z);	
 }
 
+/*
+ * Optional argument selects display.
+ */
 int main(int argc, char *argv[])
 {
-	uint16_t x, y, z;
+	struct ipc_touch touch;
 	char buf[160];
 	int ret;
+	if (argc > 1)
+		ipc_select_display(atoi(argv[1]));
 	while(1) {
-		ret = ipc_read_touchscreen(&x, &y, &z);
+		ret = ipc_read_touch(&touch);
 		if (ret) {
-			perror("ipc_read_touchscreen");
+			perror("ipc_read_touch");
 			return ret;
 		}
-		convert_to_string(buf, x, y, z);
+		convert_to_string(buf, &touch);
 		ipc_send_text(buf, white, black, (48 - strlen(buf)), 0);
 	}
 	return 0;
@@ -0,0 +1,43 @@
+#include "ipc_client.h"
+
+/*
+ * Draws checkerboard as 1 bit per pixel bitmap with two colour palette.
+ */
+static int send_checkerboard(uint16_t x, uint16_t y, uint16_t dx, uint16_t dy)
+{
+	uint8_t palette[2 * BY_PER_PIX] = {0x00, 0x00, 0xff, 0xff};
+	uint16_t row_size = INDEXED_ROW_SIZE(dx, 1);
+	uint8_t *mem;
+	int ret;
+	ret = ipc_send_palette(0, 2, palette);
+	if (ret)
+		return ret;
+	mem = malloc(row_size * dy);
+	if (!mem)
+		return -1;
+	for (uint16_t i = 0; i < dy; i++)
+		memset(&mem[i * row_size], (i / 8) % 2 ? 0xf0 : 0x0f, row_size);
+	ret = ipc_send_bitmap_indexed(x, y, dx, dy, 1, 0, mem);
+	free(mem);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+	uint16_t x = 0, y = 0, dx = LENGTH_MAX, dy = HEIGHT_MAX;
+	if (argc == 5) {
+		if (sscanf(argv[1], "%hu", &x) != 1)
+			exit(1);
+		else if (sscanf(argv[2], "%hu", &y) != 1)
+			exit(1);
+		else if (sscanf(argv[3], "%hu", &dx) != 1)
+			exit(1);
+		else if (sscanf(argv[4], "%hu", &dy) != 1)
+			exit(1);
+	}
+	ret = send_checkerboard(x, y, dx, dy);
+	if (ret)
+		perror("send_checkerboard");
+	return ret;
+}
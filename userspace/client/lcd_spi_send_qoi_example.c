@@ -0,0 +1,76 @@
+#include "ipc_client.h"
+#include "qoi_encoder.h"
+
+static int send_qoi_file(char *path, uint16_t x, uint16_t y, uint16_t dx,
+			 uint16_t dy)
+{
+	uint8_t *qoi;
+	long size;
+	int ret;
+	FILE *file = fopen(path, "rb");
+	if (!file)
+		return -1;
+	fseek(file, 0, SEEK_END);
+	size = ftell(file);
+	rewind(file);
+	qoi = malloc(size);
+	if (!qoi) {
+		fclose(file);
+		return -1;
+	}
+	if (fread(qoi, 1, size, file) != size) {
+		free(qoi);
+		fclose(file);
+		return -1;
+	}
+	fclose(file);
+	ret = ipc_send_qoi(x, y, dx, dy, qoi, size);
+	free(qoi);
+	return ret;
+}
+
+/*
+ * Encodes full screen gradient and sends it compressed.
+ */
+static int send_gradient(void)
+{
+	uint8_t *mem, *qoi;
+	uint32_t size;
+	int ret;
+	mem = malloc(TOT_MEM_SIZE);
+	if (!mem)
+		return -1;
+	for (int i = 0; i < HEIGHT_MAX; i++) {
+		for (int j = 0; j < LENGTH_MAX; j++) {
+			uint8_t red = j * 32 / LENGTH_MAX;
+			uint8_t blue = i * 32 / HEIGHT_MAX;
+			mem[BY_PER_PIX * (i * LENGTH_MAX + j)] = red << 3;
+			mem[BY_PER_PIX * (i * LENGTH_MAX + j) + 1] = blue;
+		}
+	}
+	qoi = qoi_encode_rgb565(mem, LENGTH_MAX, HEIGHT_MAX, &size);
+	free(mem);
+	if (!qoi)
+		return -1;
+	printf("%d bytes compressed to %u bytes.\n", TOT_MEM_SIZE, size);
+	ret = ipc_send_qoi(0, 0, LENGTH_MAX, HEIGHT_MAX, qoi, size);
+	free(qoi);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+	uint16_t arg[4];
+	if (argc == 6) {
+		for (int i = 0; i < 4; i++)
+			if (sscanf(argv[i + 2], "%hu", &arg[i]) != 1)
+				exit(1);
+		ret = send_qoi_file(argv[1], arg[0], arg[1], arg[2], arg[3]);
+	} else {
+		ret = send_gradient();
+	}
+	if (ret)
+		perror("send_qoi");
+	return ret;
+}
@@ -0,0 +1,53 @@
+#include <math.h>
+
+#include "ipc_client.h"
+
+/*
+ * Sends anti-aliased disc of given colour centred at (x, y), pixels
+ * around it are fully transparent.
+ */
+static int send_rgba(int argc, char *argv[])
+{
+	const uint16_t size = 64;
+	const float r = size / 2 - 1;
+	unsigned int red, green, blue;
+	uint16_t x, y;
+	uint8_t *mem, *pix;
+	int ret;
+	if (argc < 6 || sscanf(argv[1], "%u", &red) != 1 || 
+	    sscanf(argv[2], "%u", &green) != 1 || 
+	    sscanf(argv[3], "%u", &blue) != 1 ||
+	    sscanf(argv[4], "%hu", &x) != 1 || 
+	    sscanf(argv[5], "%hu", &y) != 1) {
+		printf("Wrong input arguments.\n");
+		exit(1);
+	}
+	mem = malloc(RGBA_SIZE(size, size));
+	if (!mem)
+		return -1;
+	pix = mem;
+	for (uint16_t j = 0; j < size; j++) {
+		for (uint16_t i = 0; i < size; i++) {
+			float dist = hypotf(i + 0.5f - size / 2, 
+					    j + 0.5f - size / 2);
+			float cover = r - dist + 0.5f;
+			cover = cover < 0 ? 0 : (cover > 1 ? 1 : cover);
+			*pix++ = red;
+			*pix++ = green;
+			*pix++ = blue;
+			*pix++ = cover * 255;
+		}
+	}
+	ret = ipc_send_rgba(x - size / 2, y - size / 2, size, size, mem);
+	free(mem);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+	ret = send_rgba(argc, argv);
+	if (ret)
+		perror("send_rgba");
+	return ret;	
+}
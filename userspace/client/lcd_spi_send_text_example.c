@@ -3,13 +3,16 @@
 int main(int argc, char *argv[])
 {
 	int ret;
-	uint16_t arg[2];
-	if (argc == 4) {
+	uint16_t arg[3] = {0, 0, 1};
+	if (argc == 4 || argc == 5) {
 		if (sscanf(argv[2], "%hu", &arg[0]) != 1)
 			exit(1);
 		if (sscanf(argv[3], "%hu", &arg[1]) != 1)
 			exit(1);
-		ret = ipc_send_text(argv[1], white, black, arg[0], arg[1]);
+		if (argc == 5 && sscanf(argv[4], "%hu", &arg[2]) != 1)
+			exit(1);
+		ret = ipc_send_text_scaled(argv[1], white, black, arg[0], arg[1],
+					   arg[2]);
 		if (ret) {
 			perror("ipc_send_text");
 			return ret;
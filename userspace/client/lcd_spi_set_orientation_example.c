@@ -0,0 +1,15 @@
+#include "ipc_client.h"
+
+int main(int argc, char *argv[])
+{
+	int ret;
+	uint16_t rotation;
+	if (argc != 2 || sscanf(argv[1], "%hu", &rotation) != 1) {
+		printf("Wrong input arguments.\n");
+		exit(1);
+	}
+	ret = ipc_set_orientation(rotation);
+	if (ret)
+		perror("ipc_set_orientation");
+	return ret;
+}
@@ -0,0 +1,48 @@
+#include "ipc_client.h"
+
+#define CURSOR_SIZE 16
+
+/*
+ * Crosshair cursor following touch, the daemon restores the screen under
+ * it on every move.
+ */
+static int define_cursor(void)
+{
+	uint8_t image[CURSOR_SIZE * CURSOR_SIZE * BY_PER_PIX];
+	uint8_t mask[SPRITE_MASK_SIZE(CURSOR_SIZE, CURSOR_SIZE)];
+	const uint8_t row_size = INDEXED_ROW_SIZE(CURSOR_SIZE, 1);
+	memset(image, 0xff, sizeof(image));
+	memset(mask, 0, sizeof(mask));
+	for (uint8_t i = 0; i < CURSOR_SIZE; i++) {
+		uint8_t half = CURSOR_SIZE / 2;
+		mask[i * row_size + half / 8] |= 0x80 >> (half % 8);
+		mask[half * row_size + i / 8] |= 0x80 >> (i % 8);
+	}
+	return ipc_sprite_define(0, CURSOR_SIZE, CURSOR_SIZE, image, mask);
+}
+
+int main(int argc, char *argv[])
+{
+	uint16_t x, y, z;
+	int ret = define_cursor();
+	if (ret) {
+		perror("ipc_sprite_define");
+		return ret;
+	}
+	while(1) {
+		ret = ipc_read_touchscreen(&x, &y, &z);
+		if (ret) {
+			perror("ipc_read_touchscreen");
+			return ret;
+		}
+		if (!z)
+			continue;
+		ret = ipc_sprite_move(0, x - CURSOR_SIZE / 2, 
+				      y - CURSOR_SIZE / 2, SPRITE_VISIBLE);
+		if (ret) {
+			perror("ipc_sprite_move");
+			return ret;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,105 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "qoi_encoder.h"
+
+#define QOI_OP_INDEX	0x00
+#define QOI_OP_DIFF	0x40
+#define QOI_OP_LUMA	0x80
+#define QOI_OP_RUN	0xc0
+#define QOI_OP_RGB	0xfe
+
+#define QOI_HEADER_SIZE 14
+#define QOI_END_SIZE 8
+
+struct qoi_rgba {
+	uint8_t r, g, b, a;
+};
+
+#define QOI_HASH(p) (((p).r * 3 + (p).g * 5 + (p).b * 7 + (p).a * 11) % 64)
+
+static inline void qoi_write_32(uint8_t *out, uint32_t value)
+{
+	out[0] = value >> 24;
+	out[1] = value >> 16;
+	out[2] = value >> 8;
+	out[3] = value;
+}
+
+/*
+ * Components are widened with their top bits replicated, so decoder
+ * truncation gives back exactly the same RGB565 value.
+ */
+static inline void qoi_get_pixel(const uint8_t *in, struct qoi_rgba *px)
+{
+	uint8_t r = in[0] >> 3;
+	uint8_t g = ((in[0] & 0x07) << 3) | (in[1] >> 5);
+	uint8_t b = in[1] & 0x1f;
+	px->r = (r << 3) | (r >> 2);
+	px->g = (g << 2) | (g >> 4);
+	px->b = (b << 3) | (b >> 2);
+	px->a = 255;
+}
+
+uint8_t *qoi_encode_rgb565(const uint8_t *mem, uint16_t dx, uint16_t dy,
+			   uint32_t *size)
+{
+	static const uint8_t end[QOI_END_SIZE] = {0, 0, 0, 0, 0, 0, 0, 1};
+	struct qoi_rgba index[64], px, prev = {0, 0, 0, 255};
+	uint32_t px_cnt = dx * dy, pos = 0;
+	uint8_t run = 0;
+	uint8_t *out = malloc(QOI_HEADER_SIZE + px_cnt * 4 + QOI_END_SIZE);
+	if (!out)
+		return NULL;
+	memset(index, 0, sizeof(index));
+	memcpy(out, "qoif", 4);
+	qoi_write_32(&out[4], dx);
+	qoi_write_32(&out[8], dy);
+	out[12] = 3;
+	out[13] = 0;
+	pos = QOI_HEADER_SIZE;
+	for (uint32_t i = 0; i < px_cnt; i++) {
+		qoi_get_pixel(&mem[2 * i], &px);
+		if (!memcmp(&px, &prev, sizeof(px))) {
+			run++;
+			if (run == 62 || i == px_cnt - 1) {
+				out[pos++] = QOI_OP_RUN | (run - 1);
+				run = 0;
+			}
+			continue;
+		}
+		if (run) {
+			out[pos++] = QOI_OP_RUN | (run - 1);
+			run = 0;
+		}
+		uint8_t hash = QOI_HASH(px);
+		if (!memcmp(&index[hash], &px, sizeof(px))) {
+			out[pos++] = QOI_OP_INDEX | hash;
+		} else {
+			int8_t vr = px.r - prev.r;
+			int8_t vg = px.g - prev.g;
+			int8_t vb = px.b - prev.b;
+			int8_t vg_r = vr - vg;
+			int8_t vg_b = vb - vg;
+			index[hash] = px;
+			if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && 
+			    vb > -3 && vb < 2) {
+				out[pos++] = QOI_OP_DIFF | (vr + 2) << 4 | 
+					     (vg + 2) << 2 | (vb + 2);
+			} else if (vg_r > -9 && vg_r < 8 && vg > -33 && 
+				   vg < 32 && vg_b > -9 && vg_b < 8) {
+				out[pos++] = QOI_OP_LUMA | (vg + 32);
+				out[pos++] = (vg_r + 8) << 4 | (vg_b + 8);
+			} else {
+				out[pos++] = QOI_OP_RGB;
+				out[pos++] = px.r;
+				out[pos++] = px.g;
+				out[pos++] = px.b;
+			}
+		}
+		prev = px;
+	}
+	memcpy(&out[pos], end, QOI_END_SIZE);
+	*size = pos + QOI_END_SIZE;
+	return out;
+}
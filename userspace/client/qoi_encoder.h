@@ -0,0 +1,13 @@
+#ifndef _QOI_ENCODER_H_
+#define _QOI_ENCODER_H_
+
+#include <stdint.h>
+
+/*
+ * Encodes RGB565 bitmap (panel byte order) as 3 channel QOI image
+ * (qoiformat.org). Returns malloc'ed stream, its length is stored in size.
+ */
+uint8_t *qoi_encode_rgb565(const uint8_t *mem, uint16_t dx, uint16_t dy,
+			   uint32_t *size);
+
+#endif
@@ -0,0 +1,186 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "asset_cache.h"
+
+struct asset_cache {
+	struct asset *buckets[ASSET_BUCKETS];
+	struct asset *head;
+	struct asset *tail;
+	uint32_t bytes;
+	uint32_t count;
+	uint32_t hits;
+	uint32_t misses;
+	uint32_t evictions;
+};
+
+static struct asset_cache cache;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void asset_lock(void)
+{
+	pthread_mutex_lock(&cache_lock);
+}
+
+void asset_unlock(void)
+{
+	pthread_mutex_unlock(&cache_lock);
+}
+
+static inline uint32_t asset_size(uint16_t dx, uint16_t dy)
+{
+	return sizeof(struct asset) + BY_PER_PIX * dx * dy;
+}
+
+static inline struct asset **asset_bucket(uint64_t hash)
+{
+	return &cache.buckets[(hash ^ (hash >> 32)) % ASSET_BUCKETS];
+}
+
+static void asset_unlink(struct asset *asset)
+{
+	if (asset->prev)
+		asset->prev->next = asset->next;
+	else
+		cache.head = asset->next;
+	if (asset->next)
+		asset->next->prev = asset->prev;
+	else
+		cache.tail = asset->prev;
+	asset->prev = NULL;
+	asset->next = NULL;
+}
+
+static void asset_push_front(struct asset *asset)
+{
+	asset->prev = NULL;
+	asset->next = cache.head;
+	if (cache.head)
+		cache.head->prev = asset;
+	cache.head = asset;
+	if (!cache.tail)
+		cache.tail = asset;
+}
+
+static void asset_evict(struct asset *asset)
+{
+	struct asset **it = asset_bucket(asset->hash);
+	while (*it != asset)
+		it = &(*it)->bucket_next;
+	*it = asset->bucket_next;
+	asset_unlink(asset);
+	cache.bytes -= asset_size(asset->dx, asset->dy);
+	cache.count--;
+	cache.evictions++;
+	free(asset->mem);
+	free(asset);
+}
+
+/*
+ * Least recently used asset nobody holds, NULL when all are held.
+ */
+static struct asset *asset_victim(void)
+{
+	struct asset *asset = cache.tail;
+	while (asset && asset->refs)
+		asset = asset->prev;
+	return asset;
+}
+
+static struct asset *asset_lookup(uint64_t hash)
+{
+	struct asset *asset = *asset_bucket(hash);
+	while (asset && asset->hash != hash)
+		asset = asset->bucket_next;
+	return asset;
+}
+
+/*
+ * Returns asset and marks it as most recently used, hits and misses are
+ * counted here.
+ */
+struct asset *asset_find(uint64_t hash)
+{
+	struct asset *asset = asset_lookup(hash);
+	if (!asset) {
+		cache.misses++;
+		return NULL;
+	}
+	cache.hits++;
+	asset_unlink(asset);
+	asset_push_front(asset);
+	return asset;
+}
+
+struct asset *asset_insert(uint16_t dx, uint16_t dy, const uint8_t *mem)
+{
+	uint64_t hash = ipc_asset_hash(mem, dx, dy);
+	uint32_t size = asset_size(dx, dy);
+	struct asset *victim, *asset = asset_lookup(hash);
+	if (asset) {
+		/* handle would name two images */
+		if (asset->dx != dx || asset->dy != dy ||
+		    memcmp(asset->mem, mem, (uint32_t)dx * dy * BY_PER_PIX)) {
+			errno = EEXIST;
+			return NULL;
+		}
+		asset_unlink(asset);
+		asset_push_front(asset);
+		return asset;
+	}
+	if (size > ASSET_CACHE_SIZE) {
+		errno = ENOSPC;
+		return NULL;
+	}
+	while (cache.bytes + size > ASSET_CACHE_SIZE) {
+		victim = asset_victim();
+		if (!victim) {
+			errno = ENOSPC;
+			return NULL;
+		}
+		asset_evict(victim);
+	}
+	asset = malloc(sizeof(*asset));
+	if (!asset) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	asset->mem = malloc(BY_PER_PIX * dx * dy);
+	if (!asset->mem) {
+		free(asset);
+		errno = ENOMEM;
+		return NULL;
+	}
+	memcpy(asset->mem, mem, BY_PER_PIX * dx * dy);
+	asset->hash = hash;
+	asset->dx = dx;
+	asset->dy = dy;
+	asset->refs = 0;
+	asset->bucket_next = *asset_bucket(hash);
+	*asset_bucket(hash) = asset;
+	asset_push_front(asset);
+	cache.bytes += size;
+	cache.count++;
+	return asset;
+}
+
+void asset_get(struct asset *asset)
+{
+	asset->refs++;
+}
+
+void asset_put(struct asset *asset)
+{
+	asset->refs--;
+}
+
+void asset_stats(struct ipc_stats *stats)
+{
+	stats->asset_hits = cache.hits;
+	stats->asset_misses = cache.misses;
+	stats->asset_evictions = cache.evictions;
+	stats->asset_count = cache.count;
+	stats->asset_bytes = cache.bytes;
+}
@@ -0,0 +1,44 @@
+#ifndef _ASSET_CACHE_H_
+#define _ASSET_CACHE_H_
+
+#include <stdint.h>
+
+#include "ipc.h"
+
+/*
+ * Bounded LRU cache of RGB565 images (panel byte order) addressed by
+ * content hash. Memory used by image data and bookkeeping is limited by
+ * ASSET_CACHE_SIZE, least recently drawn assets are evicted first. An
+ * image is inserted only if its hash is free or names the same image.
+ */
+
+#define ASSET_CACHE_SIZE (2 * 1024 * 1024)
+#define ASSET_BUCKETS 256
+
+struct asset {
+	uint64_t hash;
+	uint16_t dx;
+	uint16_t dy;
+	uint8_t *mem;
+	uint32_t refs;
+	struct asset *prev;
+	struct asset *next;
+	struct asset *bucket_next;
+};
+
+/*
+ * Cache is shared by all panel threads. Calls below must be made with
+ * asset_lock held, and a found asset may only be used until asset_unlock
+ * unless a reference is taken with asset_get: assets referenced are not
+ * evicted, so they can be drawn without holding the lock. The reference
+ * is dropped by asset_put, again with the lock held.
+ */
+void asset_lock(void);
+void asset_unlock(void);
+struct asset *asset_find(uint64_t hash);
+void asset_get(struct asset *asset);
+void asset_put(struct asset *asset);
+struct asset *asset_insert(uint16_t dx, uint16_t dy, const uint8_t *mem);
+void asset_stats(struct ipc_stats *stats);
+
+#endif
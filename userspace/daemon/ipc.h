@@ -7,6 +7,264 @@
 #define WRITE_BITMAP	2
 #define WRITE_RECTANGLE 3
 #define READ_TOUCHSCREEN 4
+#define UPLOAD_PALETTE	5
+#define WRITE_BITMAP_INDEXED 6
+#define WRITE_QOI	7
+#define UPLOAD_ASSET	8
+#define DRAW_ASSET	9
+#define READ_STATS	10
+#define SET_ORIENTATION	11
+#define COPY_RECT	12
+#define DRAW_LINE	13
+#define DRAW_CIRCLE	14
+#define DRAW_ARC	15
+#define DRAW_ROUND_RECT	16
+#define DRAW_POLYGON	17
+#define WRITE_RGBA	18
+#define SPRITE_DEFINE	19
+#define SPRITE_MOVE	20
+#define ANIM_START	21
+#define ANIM_STOP	22
+#define VIEWPORT_OPEN	23
+#define VIEWPORT_CLOSE	24
+#define BEGIN_FRAME	25
+#define END_FRAME	26
+#define HANDOVER	27
+
+/*
+ * Daemon may drive several panels, bits 8-15 of command select the one
+ * addressed (display ID, order of panels in daemon config). Display 0 is
+ * the default, so plain command codes keep working with a single panel.
+ * ENODEV is returned for displays which are not configured.
+ */
+#define DISPLAY_CNT 4
+#define IPC_CMD(cmd) ((cmd) & 0xff)
+#define IPC_DISPLAY(cmd) (((cmd) >> 8) & 0xff)
+#define IPC_ON_DISPLAY(cmd, display) ((cmd) | (display) << 8)
+
+/*
+ * Viewport is a rectangle of the screen owned by one client process, bits
+ * 16-23 of a drawing command select the one it is drawn in (0 is the whole
+ * screen). Coordinates are then relative to top left corner of the
+ * viewport, text cells to its bottom left one, and pixels outside it are
+ * clipped; a draw may still be at most the size of the screen. Sprites and
+ * animations belong to the whole screen: SPRITE_DEFINE, SPRITE_MOVE,
+ * ANIM_START and ANIM_STOP in a viewport fail with ENOTSUP.
+ * VIEWPORT_OPEN: x, y, dx, dy - rectangle on screen; daemon replies with
+ * errno and, on success, uint16_t viewport ID. EBUSY is returned when the
+ * rectangle overlaps a viewport of another running process.
+ * VIEWPORT_CLOSE: x - viewport ID.
+ * Drawing in or closing a viewport of another process fails with EPERM,
+ * ENOENT means it is not open. Orientation change closes all viewports.
+ */
+#define VIEWPORT_CNT 8
+#define IPC_VIEWPORT(cmd) (((cmd) >> 16) & 0xff)
+#define IPC_IN_VIEWPORT(cmd, viewport) ((cmd) | (viewport) << 16)
+
+/*
+ * Drawing between BEGIN_FRAME and END_FRAME of one client process is not
+ * shown until END_FRAME, which sends only pixels that changed, at once.
+ * A panel composes one frame at a time. Draws of other clients made
+ * meanwhile are shown right away, unless they touch the area the frame
+ * has drawn so far; those appear with it. BEGIN_FRAME returns EBUSY
+ * while another frame is open, END_FRAME EPERM for a frame of another
+ * process and ENOENT when none is open. Frame left open for
+ * FRAME_TIMEOUT_MS is ended by the daemon. Orientation may not change
+ * during a frame (EBUSY).
+ */
+#define FRAME_TIMEOUT_MS 1000
+
+/*
+ * HANDOVER is sent by a daemon being started while another one runs. The
+ * running daemon replies with errno and, on success, its listening socket
+ * (SCM_RIGHTS), then serves what it has queued, leaves the panels showing
+ * their screen records and closes the connection before it exits. Only
+ * processes of the same user or root may take over (EPERM).
+ */
+
+/*
+ * WRITE_TEXT carries colours in dy: font colour in bits 8-11, background
+ * colour in bits 0-7. Bits 12-15 hold integer scale of the font (0 or 1
+ * means normal 5x8 glyphs).
+ */
+#define TEXT_COLOR_MASK 0x0f
+#define TEXT_SCALE_SHIFT 12
+#define TEXT_SCALE_MAX 8
+
+/*
+ * UPLOAD_PALETTE: x - palette id, dx - colour count, payload - dx RGB565
+ * colours in panel byte order.
+ * WRITE_BITMAP_INDEXED: payload starts with struct ipc_indexed, followed
+ * by dy rows of packed indices, MSB first, each row padded to full byte.
+ */
+#define PALETTE_CNT 16
+#define PALETTE_SIZE 256
+
+struct ipc_indexed {
+	uint8_t bpp;
+	uint8_t palette;
+};
+
+#define INDEXED_ROW_SIZE(dx, bpp) (((dx) * (bpp) + 7) / 8)
+
+/*
+ * WRITE_QOI: dx and dy must match size stored in the image, payload is
+ * uint32_t stream size followed by the QOI stream.
+ */
+#define QOI_MAX_SIZE(dx, dy) ((dx) * (dy) * 5 + 14 + 8)
+
+/*
+ * UPLOAD_ASSET: dx, dy - size, payload - RGB565 image; daemon replies
+ * with errno and, on success, uint64_t handle.
+ * DRAW_ASSET: x, y - position, payload - uint64_t handle; ENOENT is
+ * returned when asset is not in cache and has to be uploaded again.
+ * Handle is ipc_asset_hash of the image, so clients may compute it
+ * themselves and skip uploads. An upload whose hash is taken by another
+ * cached image fails with EEXIST.
+ */
+static inline uint64_t ipc_asset_hash(const uint8_t *mem, uint16_t dx, 
+				      uint16_t dy)
+{
+	/* FNV-1a */
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	uint32_t size = sizeof(uint16_t) * dx * dy;
+	hash = (hash ^ dx) * 0x100000001b3ULL;
+	hash = (hash ^ dy) * 0x100000001b3ULL;
+	for (uint32_t i = 0; i < size; i++)
+		hash = (hash ^ mem[i]) * 0x100000001b3ULL;
+	return hash;
+}
+
+/*
+ * SET_ORIENTATION: x - clockwise rotation in degrees (0, 90, 180, 270),
+ * screen is cleared and width and height are swapped for 90 and 270.
+ */
+
+/*
+ * COPY_RECT: x, y, dx, dy - source rectangle, payload - struct ipc_copy.
+ */
+struct ipc_copy {
+	uint16_t dst_x;
+	uint16_t dst_y;
+};
+
+/*
+ * Vector primitives take plain RGB565 colour value (see RGB565 macro),
+ * shapes partially outside the screen are clipped.
+ * DRAW_LINE: (x, y) and (dx, dy) - end points, payload - uint16_t colour.
+ * DRAW_CIRCLE: x, y - centre, dx - radius, dy - SHAPE_FILL or 0,
+ * payload - uint16_t colour.
+ * DRAW_ARC: x, y - centre, dx - outer radius, dy - thickness, payload -
+ * struct ipc_arc. Angles are in degrees, clockwise from positive x axis.
+ * DRAW_ROUND_RECT: x, y, dx, dy - rectangle, payload -
+ * struct ipc_round_rect.
+ * DRAW_POLYGON: x - point count, y - flags, payload - uint16_t colour and
+ * x points (struct ipc_point). Filled polygons use even-odd rule, outline
+ * is closed unless SHAPE_OPEN is given.
+ */
+#define SHAPE_FILL 1
+#define SHAPE_OPEN 2
+#define SHAPE_RADIUS_MAX 1024
+#define POLYGON_POINTS_MAX 1024
+
+#define RGB565(r, g, b) ((((r) & 0xf8) << 8) | (((g) & 0xfc) << 3) | \
+			 ((b) >> 3))
+
+/*
+ * WRITE_RGBA: x, y, dx, dy - window, payload - dx * dy pixels of red,
+ * green, blue and alpha bytes, blended over current screen content.
+ */
+#define RGBA_SIZE(dx, dy) ((uint32_t)(dx) * (dy) * 4)
+
+/*
+ * Sprites are kept on top of everything else drawn, pixels under them are
+ * saved and restored by the daemon.
+ * SPRITE_DEFINE: x - sprite id, dx, dy - size, payload - dx * dy RGB565
+ * pixels followed by 1 bpp mask rows (INDEXED_ROW_SIZE(dx, 1) bytes, most
+ * significant bit first, set bit is opaque).
+ * SPRITE_MOVE: x, y - top left corner as int16_t, may be off screen,
+ * dx - sprite id, dy - SPRITE_VISIBLE or 0 to hide.
+ */
+#define SPRITE_CNT 8
+#define SPRITE_SIZE_MAX 32
+#define SPRITE_VISIBLE 1
+#define SPRITE_MASK_SIZE(dx, dy) (INDEXED_ROW_SIZE(dx, 1) * (dy))
+
+/*
+ * Animations run in the daemon on a fixed tick, duration is one cycle in
+ * ms. ANIM_START: x, y, dx, dy - rectangle of colour ramp or position of
+ * frames, payload - struct ipc_anim, for ANIM_SPRITE followed by cnt
+ * keyframes (struct ipc_point) spread evenly over the cycle.
+ * ANIM_FRAMES shows cnt frames stacked vertically in one cached asset.
+ * ANIM_STOP: x - slot, current state stays on screen.
+ */
+#define ANIM_CNT 8
+#define ANIM_KEYS_MAX 32
+#define ANIM_TICK_MS 33
+
+enum anim_type {
+	ANIM_SPRITE = 1, ANIM_RAMP, ANIM_FRAMES
+};
+
+#define ANIM_LOOP 1
+/* ramps and keyframes go back and forth */
+#define ANIM_REVERSE 2
+
+struct ipc_anim {
+	uint8_t slot;
+	uint8_t type;
+	uint8_t flags;
+	uint8_t sprite;
+	uint16_t duration;
+	uint16_t cnt;
+	uint16_t colour[2];
+	uint64_t asset;
+};
+
+struct ipc_arc {
+	uint16_t colour;
+	uint16_t start;
+	uint16_t sweep;
+};
+
+struct ipc_round_rect {
+	uint16_t colour;
+	uint16_t radius;
+	uint16_t flags;
+};
+
+struct ipc_point {
+	int16_t x;
+	int16_t y;
+};
+
+/*
+ * READ_TOUCHSCREEN reply, display is the panel the touchpad belongs to.
+ */
+struct ipc_touch {
+	uint16_t x;
+	uint16_t y;
+	uint16_t z;
+	uint16_t display;
+};
+
+/*
+ * Asset counters are shared by all panels, the rest belong to the display
+ * READ_STATS is addressed to. Draws skipped as already on screen and
+ * queued pixels dropped as covered by a later window are counted with
+ * bytes they would have taken on SPI.
+ */
+struct ipc_stats {
+	uint32_t asset_hits;
+	uint32_t asset_misses;
+	uint32_t asset_evictions;
+	uint32_t asset_count;
+	uint32_t asset_bytes;
+	uint32_t dedup_hits;
+	uint32_t dedup_bytes;
+	uint32_t superseded;
+	uint32_t superseded_bytes;
+};
 
 struct ipc_buffer {
 	int cmd;
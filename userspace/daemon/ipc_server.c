@@ -1,4 +1,101 @@
+/* struct ucred */
+#define _GNU_SOURCE
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/timerfd.h>
+
 #include "ipc_server.h"
+#include "qoi_decoder.h"
+#include "asset_cache.h"
+#include "lcd_raster.h"
+#include "lcd_sprite.h"
+#include "lcd_anim.h"
+#include "lcd_dedup.h"
+#include "lcd_frame.h"
+#include "lcd_beam.h"
+#include "lcd_state.h"
+#include "spi_queue.h"
+
+#define IPC_QOI_CHUNK 4096
+/* largest draw allowed to run in the middle of another one, in pixels */
+#define IPC_PREEMPT_AREA (64 * 64)
+#define IPC_DEFERRED_MAX 8
+/* payload of a preempting draw, longest single line of text */
+#define IPC_NESTED_MEM 256
+/* running daemon answers HANDOVER right away unless it hangs */
+#define IPC_HANDOVER_TIMEOUT_MS 1000
+
+/*
+ * Requests are queued by priority. Interactive ones are served first and
+ * may also run between pieces of a long write of another command, bulk
+ * ones are served when nothing else waits.
+ */
+enum ipc_lane {
+	IPC_LANE_INTERACTIVE, IPC_LANE_NORMAL, IPC_LANE_BULK, IPC_LANES
+};
+
+static inline enum ipc_lane ipc_lane(int cmd)
+{
+	switch (cmd) {
+	case READ_TOUCHSCREEN:
+	case WRITE_TEXT:
+	case WRITE_RECTANGLE:
+		return IPC_LANE_INTERACTIVE;
+	case WRITE_BITMAP:
+	case WRITE_BITMAP_INDEXED:
+	case WRITE_QOI:
+	case WRITE_RGBA:
+	case UPLOAD_ASSET:
+	case DRAW_ASSET:
+		return IPC_LANE_BULK;
+	default:
+		return IPC_LANE_NORMAL;
+	}
+}
+
+/*
+ * Connection handed over by accepting thread to worker of addressed panel,
+ * command was already read from the socket.
+ */
+struct ipc_request {
+	int socket;
+	int cmd;
+	struct sockaddr_un client;
+};
+
+/*
+ * Viewport is free when it has no owner.
+ */
+struct ipc_viewport {
+	struct lcd_rect rect;
+	pid_t owner;
+};
+
+/*
+ * Every panel has a worker thread owning its rendering state, requests
+ * are queued to it through a pipe per lane. Interactive requests which
+ * could not preempt a write are deferred until it is done, with areas
+ * they draw to. Frame being composed belongs to frame_owner until
+ * frame_deadline (monotonic ms); damage of nested draws of other clients
+ * waits in passing until the write they preempted is done.
+ */
+struct ipc_worker {
+	struct ipc_panel panel;
+	uint8_t display;
+	int queue[IPC_LANES][2];
+	struct ipc_request deferred[IPC_DEFERRED_MAX];
+	struct lcd_rect deferred_rect[IPC_DEFERRED_MAX];
+	uint8_t deferred_cnt;
+	struct ipc_viewport viewports[VIEWPORT_CNT];
+	pid_t frame_owner;
+	uint64_t frame_deadline;
+	struct lcd_rect passing[IPC_DEFERRED_MAX];
+	uint8_t passing_cnt;
+	pthread_t thread;
+};
+
+static __thread struct ipc_worker *ipc_worker_self;
 
 static inline int ipc_make_socket(void)
 {
@@ -47,26 +144,84 @@ static inline void ipc_prepare_struct(struct sockaddr_un *local)
 {
 	local->sun_family = AF_UNIX;
 	strcpy(local->sun_path, "/tmp/lcd_spi_socket\0");
-	unlink(local->sun_path);
+}
+
+/*
+ * Daemon still running hands its listening socket over, see HANDOVER in
+ * ipc.h, and closes the connection once it is done with the panels.
+ * Returns -1 when there is none to take over from.
+ */
+static int ipc_take_over(struct sockaddr_un *local)
+{
+	struct timeval timeout = {IPC_HANDOVER_TIMEOUT_MS / 1000, 
+				  IPC_HANDOVER_TIMEOUT_MS % 1000 * 1000};
+	socklen_t len = strlen(local->sun_path) + sizeof(local->sun_family);
+	char control[CMSG_SPACE(sizeof(int))];
+	int cmd = HANDOVER, ret = -1, fd = -1;
+	struct iovec iov = {&ret, sizeof(ret)};
+	struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, 
+			     .msg_control = control, 
+			     .msg_controllen = sizeof(control)};
+	struct cmsghdr *cmsg;
+	int socket = ipc_make_socket();
+	if (socket < 0)
+		return -1;
+	setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	if (connect(socket, (struct sockaddr *)local, len) ||
+	    send(socket, &cmd, sizeof(cmd), MSG_NOSIGNAL) != sizeof(cmd) ||
+	    recvmsg(socket, &msg, MSG_WAITALL) != sizeof(ret) || ret)
+		goto out;
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || 
+	    cmsg->cmsg_type != SCM_RIGHTS)
+		goto out;
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+	/* serving what is queued there may take longer */
+	memset(&timeout, 0, sizeof(timeout));
+	setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	recv(socket, &ret, sizeof(ret), MSG_WAITALL);
+out:
+	close(socket);
+	return fd;
 }
 
 static inline int ipc_make(int *socket, struct sockaddr_un *local) {
 	int ret;
 	ipc_prepare_struct(local);
+	*socket = ipc_take_over(local);
+	if (*socket >= 0)
+		return 0;
+	unlink(local->sun_path);
 	*socket = ipc_make_socket();
 	if (*socket < 0)
 		return *socket;
 	ret = ipc_bind_socket(local, *socket);
-	return ret;
+	if (ret)
+		return ret;
+	return listen(*socket, 2);
+}
+
+/*
+ * Animation tick runs only while some animation is active.
+ */
+static void ipc_arm_timer(int timer, uint8_t *armed)
+{
+	struct itimerspec spec;
+	uint8_t active = lcd_anim_active() > 0;
+	if (active == *armed)
+		return;
+	memset(&spec, 0, sizeof(spec));
+	if (active) {
+		spec.it_value.tv_nsec = ANIM_TICK_MS * 1000000L;
+		spec.it_interval.tv_nsec = ANIM_TICK_MS * 1000000L;
+	}
+	timerfd_settime(timer, 0, &spec, NULL);
+	*armed = active;
 }
 
 static inline int ipc_accept(int socket, struct sockaddr_un *local, 
 			     struct sockaddr_un *connected) {
-	int ret;
 	socklen_t len = sizeof(struct sockaddr_un);
-	ret = listen(socket, 2);
-	if (ret)
-		return ret;
 	return accept(socket, (struct sockaddr *)connected, &len);
 }
 
@@ -74,6 +229,7 @@ static inline int ipc_write_text(int fd, int socket,
 				 struct sockaddr_un *connected, 
 				 struct ipc_buffer *buf)
 {
+	struct lcd_rect rect;
 	int ret;
 	uint16_t cnt = 4 * sizeof(uint16_t);
 	ret = recv(socket, &buf->x, cnt, MSG_WAITALL | MSG_NOSIGNAL);
@@ -87,6 +243,9 @@ static inline int ipc_write_text(int fd, int socket,
 		IPC_WRITE_LOG("recv failed\0");
 		return -2;
 	}
+	if (!lcd_text_rect(buf, &rect) &&
+	    lcd_dedup_seen(lcd_dedup_hash(buf, buf->mem, cnt), &rect))
+		return 0;
 	return lcd_draw_text(fd, buf);
 }
 
@@ -94,6 +253,7 @@ static inline int ipc_draw_bitmap(int fd, int socket,
 				  struct sockaddr_un *connected, 
 				  struct ipc_buffer *buf)
 {
+	struct lcd_rect rect;
 	int cnt = 4 * sizeof(uint16_t);
 	int ret = recv(socket, &buf->x, cnt, MSG_WAITALL | MSG_NOSIGNAL);
 	if (ret != cnt) {
@@ -101,18 +261,197 @@ static inline int ipc_draw_bitmap(int fd, int socket,
 		return -2;
 	}
 	cnt = BY_PER_PIX*buf->dx*buf->dy;
+	if (cnt > TOT_MEM_SIZE) {
+		errno = EINVAL;
+		return -1;
+	}
 	ret = recv(socket, buf->mem, cnt, MSG_WAITALL | MSG_NOSIGNAL);
 	if (ret != cnt) {
 		IPC_WRITE_LOG("recv failed\0");
 		return -2;
 	}
+	if (!lcd_view_rect(buf->x, buf->y, buf->dx, buf->dy, &rect) &&
+	    lcd_dedup_seen(lcd_dedup_hash(buf, buf->mem, cnt), &rect))
+		return 0;
 	return lcd_draw_bitmap(fd, buf);
 }
 
+static inline int ipc_draw_rgba(int fd, int socket, 
+				struct sockaddr_un *connected,
+				struct ipc_buffer *buf)
+{
+	uint32_t row_size;
+	uint16_t rows, row = 0;
+	int cnt = 4 * sizeof(uint16_t);
+	int ret = recv(socket, &buf->x, cnt, MSG_WAITALL | MSG_NOSIGNAL);
+	if (ret != cnt) {
+		IPC_WRITE_LOG("recv failed\0");
+		return -2;
+	}
+	if (lcd_rgba_begin(buf->x, buf->y, buf->dx, buf->dy))
+		return -1;
+	row_size = RGBA_SIZE(buf->dx, 1);
+	rows = TOT_MEM_SIZE / row_size;
+	while (row < buf->dy) {
+		uint16_t left = buf->dy - row < rows ? buf->dy - row : rows;
+		cnt = left * row_size;
+		ret = recv(socket, buf->mem, cnt, MSG_WAITALL | MSG_NOSIGNAL);
+		if (ret != cnt) {
+			IPC_WRITE_LOG("recv failed\0");
+			lcd_rgba_end(fd);
+			return -2;
+		}
+		lcd_rgba_write(buf->mem, left);
+		row += left;
+	}
+	lcd_rgba_end(fd);
+	return 0;
+}
+
+static inline int ipc_upload_palette(int socket, struct sockaddr_un *connected,
+				     struct ipc_buffer *buf)
+{
+	int cnt = 4 * sizeof(uint16_t);
+	int ret = recv(socket, &buf->x, cnt, MSG_WAITALL | MSG_NOSIGNAL);
+	if (ret != cnt) {
+		IPC_WRITE_LOG("recv failed\0");
+		return -2;
+	}
+	if (buf->dx > PALETTE_SIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+	cnt = BY_PER_PIX * buf->dx;
+	ret = recv(socket, buf->mem, cnt, MSG_WAITALL | MSG_NOSIGNAL);
+	if (ret != cnt) {
+		IPC_WRITE_LOG("recv failed\0");
+		return -2;
+	}
+	return lcd_upload_palette(buf);
+}
+
+static inline int ipc_draw_bitmap_indexed(int fd, int socket, 
+					  struct sockaddr_un *connected, 
+					  struct ipc_buffer *buf)
+{
+	struct ipc_indexed idx;
+	int cnt = 4 * sizeof(uint16_t);
+	int ret = recv(socket, &buf->x, cnt, MSG_WAITALL | MSG_NOSIGNAL);
+	if (ret != cnt) {
+		IPC_WRITE_LOG("recv failed\0");	
+		return -2;
+	}
+	cnt = sizeof(idx);
+	ret = recv(socket, &idx, cnt, MSG_WAITALL | MSG_NOSIGNAL);
+	if (ret != cnt) {
+		IPC_WRITE_LOG("recv failed\0");	
+		return -2;
+	}
+	if (idx.bpp == 0 || idx.bpp > 8) {
+		errno = EINVAL;
+		return -1;
+	}
+	cnt = INDEXED_ROW_SIZE(buf->dx, idx.bpp) * buf->dy;
+	if (cnt > TOT_MEM_SIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+	ret = recv(socket, buf->mem, cnt, MSG_WAITALL | MSG_NOSIGNAL);
+	if (ret != cnt) {
+		IPC_WRITE_LOG("recv failed\0");
+		return -2;
+	}
+	return lcd_draw_bitmap_indexed(fd, buf, &idx);
+}
+
+static inline int ipc_draw_qoi(int fd, int socket, 
+			       struct sockaddr_un *connected, 
+			       struct ipc_buffer *buf)
+{
+	static __thread uint8_t out[LCD_CHUNK_SIZE];
+	const uint32_t chunk = spi_queue_chunk();
+	struct qoi_decoder dec;
+	uint8_t *in = buf->mem;
+	uint32_t size, left, have, consumed, produced, out_used = 0;
+	int cnt = 4 * sizeof(uint16_t);
+	int ret = recv(socket, &buf->x, cnt, MSG_WAITALL | MSG_NOSIGNAL);
+	if (ret != cnt) {
+		IPC_WRITE_LOG("recv failed\0");
+		return -2;
+	}
+	cnt = sizeof(size);
+	ret = recv(socket, &size, cnt, MSG_WAITALL | MSG_NOSIGNAL);
+	if (ret != cnt) {
+		IPC_WRITE_LOG("recv failed\0");
+		return -2;
+	}
+	if (size < QOI_HEADER_SIZE + QOI_END_SIZE || 
+	    size > QOI_MAX_SIZE(buf->dx, buf->dy)) {
+		errno = EINVAL;
+		return -1;
+	}
+	cnt = QOI_HEADER_SIZE;
+	ret = recv(socket, in, cnt, MSG_WAITALL | MSG_NOSIGNAL);
+	if (ret != cnt) {
+		IPC_WRITE_LOG("recv failed\0");
+		return -2;
+	}
+	if (qoi_decode_header(&dec, in) || dec.width != buf->dx || 
+	    dec.height != buf->dy) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (lcd_stream_begin(fd, buf->x, buf->y, buf->dx, buf->dy))
+		return -1;
+	left = size - QOI_HEADER_SIZE;
+	have = 0;
+	/*
+	 * Input is decoded as it arrives and every full output chunk goes to
+	 * SPI at once, rest of the stream keeps queueing in the socket.
+	 */
+	do {
+		cnt = left < IPC_QOI_CHUNK - have ? left : IPC_QOI_CHUNK - have;
+		if (cnt) {
+			ret = recv(socket, in + have, cnt, MSG_WAITALL | 
+				   MSG_NOSIGNAL);
+			if (ret != cnt) {
+				IPC_WRITE_LOG("recv failed\0");
+				return -2;
+			}
+			have += cnt;
+			left -= cnt;
+		}
+		ret = qoi_decode(&dec, in, have, &consumed, out + out_used,
+				 chunk - out_used, &produced);
+		out_used += produced;
+		have -= consumed;
+		memmove(in, in + consumed, have);
+		if (ret == QOI_OUTPUT_FULL || ret == QOI_DONE) {
+			lcd_stream_write(fd, out, out_used);
+			out_used = 0;
+		} else if (!left) {
+			errno = EINVAL;
+			return -1;
+		}
+	} while (ret != QOI_DONE);
+	/* end marker and padding */
+	while (left) {
+		cnt = left < IPC_QOI_CHUNK ? left : IPC_QOI_CHUNK;
+		ret = recv(socket, in, cnt, MSG_WAITALL | MSG_NOSIGNAL);
+		if (ret != cnt) {
+			IPC_WRITE_LOG("recv failed\0");
+			return -2;
+		}
+		left -= cnt;
+	}
+	return 0;
+}
+
 static inline int ipc_draw_rectangle(int fd, int socket, 
 				     struct sockaddr_un *connected,
 				     struct ipc_buffer *buf)
 {
+	struct lcd_rect rect;
 	uint8_t red, green, blue;
 	int cnt = 4 * sizeof(uint16_t);
 	int ret = recv(socket, &buf->x, cnt, MSG_WAITALL | MSG_NOSIGNAL);
@@ -131,6 +470,9 @@ static inline int ipc_draw_rectangle(int fd, int socket,
 		errno = EINVAL;
 		return -1;
 	}
+	if (!lcd_view_rect(buf->x, buf->y, buf->dx, buf->dy, &rect) &&
+	    lcd_dedup_seen(lcd_dedup_hash(buf, buf->mem, cnt), &rect))
+		return 0;
 	ret = lcd_draw_rectangle(fd, buf->x, buf->y, buf->dx, buf->dy, red,
 				 green, blue);
 	if (ret)
@@ -138,30 +480,608 @@ static inline int ipc_draw_rectangle(int fd, int socket,
 	return ret;
 }
 
-static inline int ipc_read_touchscreen(int fd, int socket, 
+static inline int ipc_upload_asset(int socket, struct sockaddr_un *connected,
+				   struct ipc_buffer *buf)
+{
+	struct asset *asset = NULL;
+	uint64_t handle;
+	int cnt = 4 * sizeof(uint16_t);
+	int ret = recv(socket, &buf->x, cnt, MSG_WAITALL | MSG_NOSIGNAL);
+	if (ret != cnt) {
+		IPC_WRITE_LOG("recv failed\0");
+		return -2;
+	}
+	if (!buf->dx || !buf->dy || buf->dx * buf->dy > LENGTH_MAX * HEIGHT_MAX) {
+		errno = EINVAL;
+		goto reply;
+	}
+	cnt = BY_PER_PIX * buf->dx * buf->dy;
+	ret = recv(socket, buf->mem, cnt, MSG_WAITALL | MSG_NOSIGNAL);
+	if (ret != cnt) {
+		IPC_WRITE_LOG("recv failed\0");
+		return -2;
+	}
+	asset_lock();
+	asset = asset_insert(buf->dx, buf->dy, buf->mem);
+	if (asset)
+		handle = asset->hash;
+	asset_unlock();
+reply:
+	ret = asset ? 0 : errno;
+	send(socket, &ret, sizeof(ret), MSG_NOSIGNAL);
+	if (!asset)
+		return -1;
+	send(socket, &handle, sizeof(handle), MSG_NOSIGNAL);
+	return 0;
+}
+
+static inline int ipc_draw_asset(int fd, int socket, 
+				 struct sockaddr_un *connected,
+				 struct ipc_buffer *buf)
+{
+	struct ipc_buffer asset_buf;
+	struct asset *asset;
+	struct lcd_rect rect;
+	uint64_t handle;
+	int cnt = 4 * sizeof(uint16_t);
+	int ret = recv(socket, &buf->x, cnt, MSG_WAITALL | MSG_NOSIGNAL);
+	if (ret != cnt) {
+		IPC_WRITE_LOG("recv failed\0");
+		return -2;
+	}
+	cnt = sizeof(handle);
+	ret = recv(socket, &handle, cnt, MSG_WAITALL | MSG_NOSIGNAL);
+	if (ret != cnt) {
+		IPC_WRITE_LOG("recv failed\0");
+		return -2;
+	}
+	asset_lock();
+	asset = asset_find(handle);
+	if (!asset) {
+		asset_unlock();
+		errno = ENOENT;
+		return -1;
+	}
+	/* other panels use the cache while this one streams the asset */
+	asset_get(asset);
+	asset_unlock();
+	if (!lcd_view_rect(buf->x, buf->y, asset->dx, asset->dy, &rect) &&
+	    lcd_dedup_seen(lcd_dedup_hash(buf, (uint8_t *)&handle, cnt), 
+			   &rect)) {
+		ret = 0;
+		goto put;
+	}
+	asset_buf.mem = asset->mem;
+	asset_buf.x = buf->x;
+	asset_buf.y = buf->y;
+	asset_buf.dx = asset->dx;
+	asset_buf.dy = asset->dy;
+	ret = lcd_draw_bitmap(fd, &asset_buf);
+put:
+	asset_lock();
+	asset_put(asset);
+	asset_unlock();
+	return ret;
+}
+
+static inline int ipc_set_orientation(struct ipc_worker *worker, 
+				      int socket, 
+				      struct sockaddr_un *connected,
+				      struct ipc_buffer *buf)
+{
+	int cnt = 4 * sizeof(uint16_t);
+	int ret = recv(socket, &buf->x, cnt, MSG_WAITALL | MSG_NOSIGNAL);
+	if (ret != cnt) {
+		IPC_WRITE_LOG("recv failed\0");
+		return -2;
+	}
+	ret = lcd_set_orientation(worker->panel.fd_lcd, buf->x);
+	if (!ret)
+		memset(worker->viewports, 0, sizeof(worker->viewports));
+	return ret;
+}
+
+static pid_t ipc_peer(int socket)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	if (getsockopt(socket, SOL_SOCKET, SO_PEERCRED, &cred, &len))
+		return 0;
+	return cred.pid;
+}
+
+/*
+ * Viewports of processes which exited are freed when another one is
+ * opened.
+ */
+static inline int ipc_viewport_open(struct ipc_worker *worker, int socket,
+				    struct sockaddr_un *connected,
+				    struct ipc_buffer *buf)
+{
+	struct ipc_viewport *viewport;
+	struct lcd_rect rect;
+	pid_t owner = ipc_peer(socket);
+	uint16_t id = 0;
+	int cnt = 4 * sizeof(uint16_t);
+	int ret = recv(socket, &buf->x, cnt, MSG_WAITALL | MSG_NOSIGNAL);
+	if (ret != cnt) {
+		IPC_WRITE_LOG("recv failed\0");
+		return -2;
+	}
+	errno = 0;
+	if (!owner) {
+		errno = EPERM;
+		goto reply;
+	}
+	if (!buf->dx || !buf->dy || buf->x + buf->dx > lcd_panel.width || 
+	    buf->y + buf->dy > lcd_panel.height) {
+		errno = EINVAL;
+		goto reply;
+	}
+	rect.x0 = buf->x;
+	rect.y0 = buf->y;
+	rect.x1 = buf->x + buf->dx;
+	rect.y1 = buf->y + buf->dy;
+	for (uint8_t i = 0; i < VIEWPORT_CNT; i++) {
+		viewport = &worker->viewports[i];
+		if (viewport->owner && kill(viewport->owner, 0) && 
+		    errno == ESRCH)
+			viewport->owner = 0;
+		errno = 0;
+		if (!viewport->owner) {
+			if (!id)
+				id = i + 1;
+			continue;
+		}
+		if (lcd_rect_overlap(&viewport->rect, &rect)) {
+			errno = EBUSY;
+			goto reply;
+		}
+	}
+	if (!id) {
+		errno = ENOSPC;
+		goto reply;
+	}
+	viewport = &worker->viewports[id - 1];
+	viewport->rect = rect;
+	viewport->owner = owner;
+reply:
+	ret = errno;
+	send(socket, &ret, sizeof(ret), MSG_NOSIGNAL);
+	if (ret)
+		return -1;
+	send(socket, &id, sizeof(id), MSG_NOSIGNAL);
+	return 0;
+}
+
+static inline struct ipc_viewport *ipc_viewport(struct ipc_worker *worker,
+						int socket, uint16_t id)
+{
+	struct ipc_viewport *viewport;
+	if (!id || id > VIEWPORT_CNT || !worker->viewports[id - 1].owner) {
+		errno = ENOENT;
+		return NULL;
+	}
+	viewport = &worker->viewports[id - 1];
+	if (ipc_peer(socket) != viewport->owner) {
+		errno = EPERM;
+		return NULL;
+	}
+	return viewport;
+}
+
+static inline int ipc_viewport_close(struct ipc_worker *worker, int socket,
+				     struct sockaddr_un *connected,
+				     struct ipc_buffer *buf)
+{
+	struct ipc_viewport *viewport;
+	int cnt = 4 * sizeof(uint16_t);
+	int ret = recv(socket, &buf->x, cnt, MSG_WAITALL | MSG_NOSIGNAL);
+	if (ret != cnt) {
+		IPC_WRITE_LOG("recv failed\0");
+		return -2;
+	}
+	viewport = ipc_viewport(worker, socket, buf->x);
+	if (!viewport)
+		return -1;
+	viewport->owner = 0;
+	return 0;
+}
+
+static uint64_t ipc_now_ms(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void ipc_frame_commit(struct ipc_worker *worker)
+{
+	for (uint8_t i = 0; i < worker->passing_cnt; i++)
+		lcd_rect_union(&lcd_panel.frame, &worker->passing[i]);
+	worker->passing_cnt = 0;
+	lcd_frame_end(worker->panel.fd_lcd);
+	worker->frame_owner = 0;
+}
+
+/*
+ * Frame of a process which exited is committed when another one begins.
+ */
+static inline int ipc_begin_frame(struct ipc_worker *worker, int socket,
+				  struct sockaddr_un *connected,
+				  struct ipc_buffer *buf)
+{
+	pid_t owner = ipc_peer(socket);
+	int cnt = 4 * sizeof(uint16_t);
+	int ret = recv(socket, &buf->x, cnt, MSG_WAITALL | MSG_NOSIGNAL);
+	if (ret != cnt) {
+		IPC_WRITE_LOG("recv failed\0");
+		return -2;
+	}
+	if (!owner) {
+		errno = EPERM;
+		return -1;
+	}
+	if (worker->frame_owner && kill(worker->frame_owner, 0) && 
+	    errno == ESRCH)
+		ipc_frame_commit(worker);
+	errno = 0;
+	if (lcd_frame_begin())
+		return -1;
+	worker->frame_owner = owner;
+	worker->frame_deadline = ipc_now_ms() + FRAME_TIMEOUT_MS;
+	return 0;
+}
+
+static inline int ipc_end_frame(struct ipc_worker *worker, int socket,
+				struct sockaddr_un *connected,
+				struct ipc_buffer *buf)
+{
+	int cnt = 4 * sizeof(uint16_t);
+	int ret = recv(socket, &buf->x, cnt, MSG_WAITALL | MSG_NOSIGNAL);
+	if (ret != cnt) {
+		IPC_WRITE_LOG("recv failed\0");
+		return -2;
+	}
+	if (!worker->frame_owner) {
+		errno = ENOENT;
+		return -1;
+	}
+	if (ipc_peer(socket) != worker->frame_owner) {
+		errno = EPERM;
+		return -1;
+	}
+	ipc_frame_commit(worker);
+	return 0;
+}
+
+/*
+ * How long worker may wait for requests, -1 is no limit. Frame open for
+ * too long is committed here.
+ */
+static int ipc_frame_wait(struct ipc_worker *worker)
+{
+	uint64_t now;
+	if (!worker->frame_owner)
+		return -1;
+	now = ipc_now_ms();
+	if (now < worker->frame_deadline)
+		return worker->frame_deadline - now;
+	ipc_frame_commit(worker);
+	return -1;
+}
+
+/*
+ * Commands drawn in viewports, the rest always works on whole screen.
+ */
+static inline int ipc_in_view(int cmd)
+{
+	switch (cmd) {
+	case WRITE_TEXT:
+	case WRITE_BITMAP:
+	case WRITE_RECTANGLE:
+	case WRITE_BITMAP_INDEXED:
+	case WRITE_QOI:
+	case DRAW_ASSET:
+	case COPY_RECT:
+	case DRAW_LINE:
+	case DRAW_CIRCLE:
+	case DRAW_ARC:
+	case DRAW_ROUND_RECT:
+	case DRAW_POLYGON:
+	case WRITE_RGBA:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Sprites and animations are shared by all clients of the panel and drawn
+ * on the whole screen, so requests in a viewport may not use them.
+ */
+static inline int ipc_screen_only(int cmd)
+{
+	switch (cmd) {
+	case SPRITE_DEFINE:
+	case SPRITE_MOVE:
+	case ANIM_START:
+	case ANIM_STOP:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Sets view of request, the screen unless it addresses a viewport. When
+ * the viewport may not be used the view is empty, so the command is still
+ * read whole but draws nothing. Commands of the whole screen get the
+ * empty view in any viewport and refuse it (ENOTSUP).
+ */
+static int ipc_view(struct ipc_worker *worker, struct ipc_request *req)
+{
+	static const struct lcd_rect none;
+	struct ipc_viewport *viewport;
+	const uint8_t id = IPC_VIEWPORT(req->cmd);
+	if (id && ipc_screen_only(IPC_CMD(req->cmd))) {
+		lcd_set_view(&none);
+		errno = ENOTSUP;
+		return -1;
+	}
+	if (!id || !ipc_in_view(IPC_CMD(req->cmd))) {
+		lcd_set_view(NULL);
+		return 0;
+	}
+	viewport = ipc_viewport(worker, req->socket, id);
+	lcd_set_view(viewport ? &viewport->rect : &none);
+	return viewport ? 0 : -1;
+}
+
+static inline int ipc_copy_rect(int fd, int socket, 
+				struct sockaddr_un *connected,
+				struct ipc_buffer *buf)
+{
+	struct ipc_copy copy;
+	int cnt = 4 * sizeof(uint16_t);
+	int ret = recv(socket, &buf->x, cnt, MSG_WAITALL | MSG_NOSIGNAL);
+	if (ret != cnt) {
+		IPC_WRITE_LOG("recv failed\0");
+		return -2;
+	}
+	cnt = sizeof(copy);
+	ret = recv(socket, &copy, cnt, MSG_WAITALL | MSG_NOSIGNAL);
+	if (ret != cnt) {
+		IPC_WRITE_LOG("recv failed\0");
+		return -2;
+	}
+	return lcd_copy_rect(fd, buf->x, buf->y, buf->dx, buf->dy, copy.dst_x,
+			     copy.dst_y);
+}
+
+static inline int ipc_draw_shape(int fd, int socket, 
+				 struct sockaddr_un *connected,
+				 struct ipc_buffer *buf, int cmd)
+{
+	struct ipc_round_rect round_rect;
+	struct ipc_arc arc;
+	uint16_t colour;
+	int cnt = 4 * sizeof(uint16_t);
+	int ret = recv(socket, &buf->x, cnt, MSG_WAITALL | MSG_NOSIGNAL);
+	if (ret != cnt) {
+		IPC_WRITE_LOG("recv failed\0");
+		return -2;
+	}
+	switch (cmd) {
+	case DRAW_ARC:
+		cnt = sizeof(arc);
+		ret = recv(socket, &arc, cnt, MSG_WAITALL | MSG_NOSIGNAL);
+		break;
+	case DRAW_ROUND_RECT:
+		cnt = sizeof(round_rect);
+		ret = recv(socket, &round_rect, cnt, 
+			   MSG_WAITALL | MSG_NOSIGNAL);
+		break;
+	default:
+		cnt = sizeof(colour);
+		ret = recv(socket, &colour, cnt, MSG_WAITALL | MSG_NOSIGNAL);
+		break;
+	}
+	if (ret != cnt) {
+		IPC_WRITE_LOG("recv failed\0");
+		return -2;
+	}
+	switch (cmd) {
+	case DRAW_LINE:
+		return lcd_raster_line(fd, buf->x, buf->y, buf->dx, buf->dy,
+				       colour);
+	case DRAW_CIRCLE:
+		return lcd_raster_circle(fd, buf->x, buf->y, buf->dx, buf->dy,
+					 colour);
+	case DRAW_ARC:
+		return lcd_raster_arc(fd, buf->x, buf->y, buf->dx, buf->dy,
+				      arc.start, arc.sweep, arc.colour);
+	case DRAW_ROUND_RECT:
+		return lcd_raster_round_rect(fd, buf->x, buf->y, buf->dx, 
+					     buf->dy, round_rect.radius, 
+					     round_rect.flags, 
+					     round_rect.colour);
+	}
+	errno = EINVAL;
+	return -1;
+}
+
+static inline int ipc_draw_polygon(int fd, int socket, 
+				   struct sockaddr_un *connected,
+				   struct ipc_buffer *buf)
+{
+	uint16_t colour;
+	int cnt = 4 * sizeof(uint16_t);
+	int ret = recv(socket, &buf->x, cnt, MSG_WAITALL | MSG_NOSIGNAL);
+	if (ret != cnt) {
+		IPC_WRITE_LOG("recv failed\0");
+		return -2;
+	}
+	if (!buf->x || buf->x > POLYGON_POINTS_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	cnt = sizeof(colour);
+	ret = recv(socket, &colour, cnt, MSG_WAITALL | MSG_NOSIGNAL);
+	if (ret != cnt) {
+		IPC_WRITE_LOG("recv failed\0");
+		return -2;
+	}
+	cnt = buf->x * sizeof(struct ipc_point);
+	ret = recv(socket, buf->mem, cnt, MSG_WAITALL | MSG_NOSIGNAL);
+	if (ret != cnt) {
+		IPC_WRITE_LOG("recv failed\0");
+		return -2;
+	}
+	return lcd_raster_polygon(fd, (struct ipc_point *)buf->mem, buf->x,
+				  buf->y, colour);
+}
+
+static inline int ipc_sprite_define(int fd, int socket, 
+				    struct sockaddr_un *connected,
+				    struct ipc_buffer *buf)
+{
+	int cnt = 4 * sizeof(uint16_t);
+	int ret = recv(socket, &buf->x, cnt, MSG_WAITALL | MSG_NOSIGNAL);
+	if (ret != cnt) {
+		IPC_WRITE_LOG("recv failed\0");
+		return -2;
+	}
+	if (buf->dx > SPRITE_SIZE_MAX || buf->dy > SPRITE_SIZE_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	cnt = BY_PER_PIX * buf->dx * buf->dy + 
+	      SPRITE_MASK_SIZE(buf->dx, buf->dy);
+	ret = recv(socket, buf->mem, cnt, MSG_WAITALL | MSG_NOSIGNAL);
+	if (ret != cnt) {
+		IPC_WRITE_LOG("recv failed\0");
+		return -2;
+	}
+	if (lcd_panel.clip) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	return lcd_sprite_define(fd, buf->x, buf->dx, buf->dy, buf->mem);
+}
+
+static inline int ipc_sprite_move(int fd, int socket, 
+				  struct sockaddr_un *connected,
+				  struct ipc_buffer *buf)
+{
+	int cnt = 4 * sizeof(uint16_t);
+	int ret = recv(socket, &buf->x, cnt, MSG_WAITALL | MSG_NOSIGNAL);
+	if (ret != cnt) {
+		IPC_WRITE_LOG("recv failed\0");
+		return -2;
+	}
+	if (lcd_panel.clip) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	return lcd_sprite_move(fd, buf->dx, (int16_t)buf->x, (int16_t)buf->y,
+			       buf->dy);
+}
+
+static inline int ipc_anim_start(int socket, struct sockaddr_un *connected,
+				 struct ipc_buffer *buf)
+{
+	struct ipc_anim desc;
+	int cnt = 4 * sizeof(uint16_t);
+	int ret = recv(socket, &buf->x, cnt, MSG_WAITALL | MSG_NOSIGNAL);
+	if (ret != cnt) {
+		IPC_WRITE_LOG("recv failed\0");
+		return -2;
+	}
+	cnt = sizeof(desc);
+	ret = recv(socket, &desc, cnt, MSG_WAITALL | MSG_NOSIGNAL);
+	if (ret != cnt) {
+		IPC_WRITE_LOG("recv failed\0");
+		return -2;
+	}
+	if (desc.type == ANIM_SPRITE) {
+		if (desc.cnt > ANIM_KEYS_MAX) {
+			errno = EINVAL;
+			return -1;
+		}
+		cnt = desc.cnt * sizeof(struct ipc_point);
+		ret = recv(socket, buf->mem, cnt, MSG_WAITALL | MSG_NOSIGNAL);
+		if (ret != cnt) {
+			IPC_WRITE_LOG("recv failed\0");
+			return -2;
+		}
+	}
+	if (lcd_panel.clip) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	return lcd_anim_start(buf, &desc, (struct ipc_point *)buf->mem);
+}
+
+static inline int ipc_anim_stop(int socket, struct sockaddr_un *connected,
+				struct ipc_buffer *buf)
+{
+	int cnt = 4 * sizeof(uint16_t);
+	int ret = recv(socket, &buf->x, cnt, MSG_WAITALL | MSG_NOSIGNAL);
+	if (ret != cnt) {
+		IPC_WRITE_LOG("recv failed\0");
+		return -2;
+	}
+	if (lcd_panel.clip) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	return lcd_anim_stop(buf->x);
+}
+
+static inline int ipc_read_stats(int socket, struct sockaddr_un *connected)
+{
+	struct ipc_stats stats;
+	memset(&stats, 0, sizeof(stats));
+	asset_lock();
+	asset_stats(&stats);
+	asset_unlock();
+	lcd_dedup_stats(&stats);
+	spi_queue_stats(&stats);
+	send(socket, &stats, sizeof(stats), MSG_NOSIGNAL);
+	return 0;
+}
+
+static inline int ipc_read_touchscreen(int fd, uint8_t display, int socket, 
 				       struct sockaddr_un *connected)
 {
 	int ret;
-	uint16_t x, y, z;
-	ret = lcd_read_touchscreen(fd, &x, &y, &z);
+	struct ipc_touch touch;
+	if (fd < 0)
+		return 1;
+	ret = lcd_read_touchscreen(fd, &touch.x, &touch.y, &touch.z);
 	if (ret)
 		return 1;
-	send(socket, &x, 2, MSG_NOSIGNAL);
-	send(socket, &y, 2, MSG_NOSIGNAL);
-	send(socket, &z, 2, MSG_NOSIGNAL);
+	touch.display = display;
+	send(socket, &touch, sizeof(touch), MSG_NOSIGNAL);
 	return 0;
 }
 
-static inline int ipc_action(int fd_lcd, int fd_touch, int socket, 
-			     struct sockaddr_un *connected, 
-			     struct ipc_buffer *buf) 
+/*
+ * Commands which send their whole reply on their own.
+ */
+static inline int ipc_own_reply(int cmd)
 {
-	int ret;
-	ret = recv(socket, &(buf->cmd), sizeof(buf->cmd), MSG_WAITALL 
-		   | MSG_NOSIGNAL);
-	if (ret != sizeof(buf->cmd)) {
-		return -2;
-	}
+	return cmd == READ_TOUCHSCREEN || cmd == UPLOAD_ASSET || 
+	       cmd == READ_STATS || cmd == VIEWPORT_OPEN;
+}
+
+static inline int ipc_dispatch(struct ipc_worker *worker, int socket, 
+			       struct sockaddr_un *connected, 
+			       struct ipc_buffer *buf) 
+{
+	int fd_lcd = worker->panel.fd_lcd;
+	int fd_touch = worker->panel.fd_touch;
 	switch(buf->cmd) {
 	case WRITE_TEXT:
 		return ipc_write_text(fd_lcd, socket, connected, buf);
@@ -170,7 +1090,50 @@ static inline int ipc_action(int fd_lcd, int fd_touch, int socket,
 	case WRITE_RECTANGLE:
 		return ipc_draw_rectangle(fd_lcd, socket, connected, buf);
 	case READ_TOUCHSCREEN:
-		return ipc_read_touchscreen(fd_touch, socket, connected);
+		return ipc_read_touchscreen(fd_touch, worker->display, socket,
+					    connected);
+	case UPLOAD_PALETTE:
+		return ipc_upload_palette(socket, connected, buf);
+	case WRITE_BITMAP_INDEXED:
+		return ipc_draw_bitmap_indexed(fd_lcd, socket, connected, buf);
+	case WRITE_QOI:
+		return ipc_draw_qoi(fd_lcd, socket, connected, buf);
+	case UPLOAD_ASSET:
+		return ipc_upload_asset(socket, connected, buf);
+	case DRAW_ASSET:
+		return ipc_draw_asset(fd_lcd, socket, connected, buf);
+	case READ_STATS:
+		return ipc_read_stats(socket, connected);
+	case SET_ORIENTATION:
+		return ipc_set_orientation(worker, socket, connected, buf);
+	case COPY_RECT:
+		return ipc_copy_rect(fd_lcd, socket, connected, buf);
+	case DRAW_LINE:
+	case DRAW_CIRCLE:
+	case DRAW_ARC:
+	case DRAW_ROUND_RECT:
+		return ipc_draw_shape(fd_lcd, socket, connected, buf, 
+				      buf->cmd);
+	case DRAW_POLYGON:
+		return ipc_draw_polygon(fd_lcd, socket, connected, buf);
+	case WRITE_RGBA:
+		return ipc_draw_rgba(fd_lcd, socket, connected, buf);
+	case SPRITE_DEFINE:
+		return ipc_sprite_define(fd_lcd, socket, connected, buf);
+	case SPRITE_MOVE:
+		return ipc_sprite_move(fd_lcd, socket, connected, buf);
+	case ANIM_START:
+		return ipc_anim_start(socket, connected, buf);
+	case ANIM_STOP:
+		return ipc_anim_stop(socket, connected, buf);
+	case VIEWPORT_OPEN:
+		return ipc_viewport_open(worker, socket, connected, buf);
+	case VIEWPORT_CLOSE:
+		return ipc_viewport_close(worker, socket, connected, buf);
+	case BEGIN_FRAME:
+		return ipc_begin_frame(worker, socket, connected, buf);
+	case END_FRAME:
+		return ipc_end_frame(worker, socket, connected, buf);
 	default:
 		errno = EINVAL;
 		return -2;
@@ -178,35 +1141,414 @@ static inline int ipc_action(int fd_lcd, int fd_touch, int socket,
 	return -2;
 }
 
-int ipc_main(int fd_lcd, int fd_touch)
+/*
+ * Area an interactive request is going to draw on screen, read ahead
+ * from its socket. Returns -1 when it is not known yet.
+ */
+static int ipc_preempt_rect(struct ipc_worker *worker, 
+			    struct ipc_request *req, struct lcd_rect *rect)
 {
-	struct sockaddr_un server, client;
-	int ret, server_socket, client_socket;
+	const struct lcd_rect view = lcd_panel.view;
+	const uint8_t clip = lcd_panel.clip;
+	const int cnt = 4 * sizeof(uint16_t);
 	struct ipc_buffer buf;
-	ipc_clean_log_message();
+	int ret;
+	buf.cmd = IPC_CMD(req->cmd);
+	if (recv(req->socket, &buf.x, cnt, MSG_PEEK | MSG_DONTWAIT) != cnt ||
+	    ipc_view(worker, req))
+		ret = -1;
+	else if (buf.cmd == WRITE_TEXT)
+		ret = buf.dx > IPC_NESTED_MEM ? -1 : lcd_text_rect(&buf, rect);
+	else
+		ret = lcd_view_rect(buf.x, buf.y, buf.dx, buf.dy, rect);
+	lcd_set_view(clip ? &view : NULL);
+	return ret;
+}
+
+static int ipc_deferred_overlap(struct ipc_worker *worker, 
+				const struct lcd_rect *rect)
+{
+	for (uint8_t i = 0; i < worker->deferred_cnt; i++)
+		if (lcd_rect_overlap(&worker->deferred_rect[i], rect))
+			return 1;
+	return 0;
+}
+
+/*
+ * Serves request inside another command. Damage of both is kept for the
+ * sprites, neither is remembered as being on screen.
+ */
+static inline int ipc_frame_foreign(struct ipc_worker *worker,
+				    struct ipc_request *req)
+{
+	return worker->frame_owner && ipc_peer(req->socket) != worker->frame_owner;
+}
+
+/*
+ * Nested draw of another client than the frame owner. The write it
+ * preempted may have put pixels in the record it has not added to the
+ * frame yet, so sending the damage waits until that write is done;
+ * damage over the frame, or with no room left, stays in the frame.
+ */
+static void ipc_frame_nested(struct ipc_worker *worker,
+			     const struct lcd_rect *frame)
+{
+	if (!lcd_panel.compose || lcd_rect_empty(&lcd_panel.damage) ||
+	    lcd_rect_overlap(frame, &lcd_panel.damage) ||
+	    worker->passing_cnt == IPC_DEFERRED_MAX)
+		return;
+	worker->passing[worker->passing_cnt++] = lcd_panel.damage;
+	lcd_panel.frame = *frame;
+}
+
+static void ipc_serve_nested(struct ipc_worker *worker, 
+			     struct ipc_request *req)
+{
+	static __thread uint8_t mem[IPC_NESTED_MEM];
+	const struct lcd_rect view = lcd_panel.view;
+	const struct lcd_rect frame = lcd_panel.frame;
+	const uint8_t clip = lcd_panel.clip;
+	struct lcd_rect damage = lcd_panel.damage;
+	struct ipc_buffer buf;
+	int ret, err;
+	errno = 0;
+	buf.mem = mem;
+	buf.cmd = IPC_CMD(req->cmd);
+	lcd_damage_reset();
+	err = ipc_view(worker, req) ? errno : 0;
+	ret = ipc_dispatch(worker, req->socket, &req->client, &buf);
+	if (err) {
+		ret = -1;
+		errno = err;
+	}
+	if (!ret && !ipc_own_reply(buf.cmd) && spi_queue_error())
+		ret = -1;
+	if (ret)
+		IPC_WRITE_LOG("ipc_dispatch failed\0");
+	lcd_set_view(clip ? &view : NULL);
+	lcd_dedup_update(ret == 0);
+	if (ipc_frame_foreign(worker, req))
+		ipc_frame_nested(worker, &frame);
+	lcd_rect_union(&lcd_panel.damage, &damage);
+	if (!ipc_own_reply(buf.cmd))
+		send(req->socket, &errno, sizeof(errno), MSG_NOSIGNAL);  
+	close(req->socket);
+}
+
+/*
+ * Preemption point of a long write. Touch reads are always served, small
+ * draws only when they stay off area the write has not sent yet. The
+ * rest is deferred, and so are draws overlapping anything deferred, to
+ * keep their order; draws in disjoint viewports pass each other.
+ */
+static int ipc_preempt(const struct lcd_rect *keep)
+{
+	struct ipc_worker *worker = ipc_worker_self;
+	struct pollfd fds = {worker->queue[IPC_LANE_INTERACTIVE][0], POLLIN};
+	struct ipc_request req;
+	struct lcd_rect rect;
+	int served = 0, err = errno;
+	while (worker->deferred_cnt < IPC_DEFERRED_MAX && 
+	       poll(&fds, 1, 0) > 0 && 
+	       read(fds.fd, &req, sizeof(req)) == sizeof(req)) {
+		if (IPC_CMD(req.cmd) == READ_TOUCHSCREEN) {
+			ipc_serve_nested(worker, &req);
+			continue;
+		}
+		if (ipc_preempt_rect(worker, &req, &rect)) {
+			rect.x0 = 0;
+			rect.y0 = 0;
+			rect.x1 = lcd_panel.width;
+			rect.y1 = lcd_panel.height;
+		}
+		if (lcd_rect_area(&rect) > IPC_PREEMPT_AREA || 
+		    (keep && lcd_rect_overlap(&rect, keep)) ||
+		    ipc_deferred_overlap(worker, &rect)) {
+			worker->deferred_rect[worker->deferred_cnt] = rect;
+			worker->deferred[worker->deferred_cnt++] = req;
+			continue;
+		}
+		ipc_serve_nested(worker, &req);
+		served = 1;
+	}
+	errno = err;
+	return served;
+}
+
+/*
+ * Sprites are lifted from screen record around every other command, so
+ * drawing and reading the record never sees them. Damage of the command
+ * is what it changed in the record. Only commands outside interactive
+ * lane may be preempted. The view is the screen again afterwards. Frames
+ * are compared with sprites in place, so they are not lifted for them.
+ * Draws of other processes than the frame owner are not held by the
+ * frame unless they touch it.
+ */
+static inline int ipc_action(struct ipc_worker *worker, 
+			     struct ipc_request *req, 
+			     struct ipc_buffer *buf) 
+{
+	const struct lcd_rect frame = lcd_panel.frame;
+	int ret, err;
+	if (buf->cmd == SPRITE_DEFINE || buf->cmd == SPRITE_MOVE) {
+		ipc_view(worker, req);
+		ret = ipc_dispatch(worker, req->socket, &req->client, buf);
+		lcd_set_view(NULL);
+		return ret;
+	}
+	if (buf->cmd == BEGIN_FRAME || buf->cmd == END_FRAME)
+		return ipc_dispatch(worker, req->socket, &req->client, buf);
+	lcd_sprites_lift();
+	err = ipc_view(worker, req) ? errno : 0;
+	if (ipc_lane(buf->cmd) != IPC_LANE_INTERACTIVE)
+		lcd_set_preempt(ipc_preempt);
+	ret = ipc_dispatch(worker, req->socket, &req->client, buf);
+	if (err) {
+		ret = -1;
+		errno = err;
+	}
+	lcd_set_preempt(NULL);
+	lcd_set_view(NULL);
+	lcd_dedup_update(ret == 0);
+	lcd_sprites_drop(worker->panel.fd_lcd);
+	if (ipc_frame_foreign(worker, req))
+		lcd_frame_pass(worker->panel.fd_lcd, &frame, &lcd_panel.damage);
+	for (uint8_t i = 0; i < worker->passing_cnt; i++)
+		lcd_frame_pass(worker->panel.fd_lcd, &lcd_panel.frame,
+			       &worker->passing[i]);
+	worker->passing_cnt = 0;
+	return ret;
+}
+
+static void ipc_serve(struct ipc_worker *worker, struct ipc_request *req,
+		      struct ipc_buffer *buf)
+{
+	int ret;
+	errno = 0;
+	buf->cmd = IPC_CMD(req->cmd);
+	ret = ipc_action(worker, req, buf);
+	/* a write queued by this or an earlier command failed on the wire */
+	if (!ret && !ipc_own_reply(buf->cmd) && spi_queue_error())
+		ret = -1;
+	if (ret)
+		IPC_WRITE_LOG("ipc_action failed\0");
+	if (!ipc_own_reply(buf->cmd))
+		send(req->socket, &errno, sizeof(errno), MSG_NOSIGNAL);  
+	close(req->socket);
+}
+
+static void ipc_serve_deferred(struct ipc_worker *worker, 
+			       struct ipc_buffer *buf)
+{
+	for (uint8_t i = 0; i < worker->deferred_cnt; i++)
+		ipc_serve(worker, &worker->deferred[i], buf);
+	worker->deferred_cnt = 0;
+}
+
+/*
+ * Panel is left to the next daemon with everything drawn sent, open frame
+ * included, so its screen record is what it shows. If a write failed, the
+ * record is not marked clean and the next daemon sends it again.
+ */
+static void ipc_worker_stop(struct ipc_worker *worker)
+{
+	ipc_frame_commit(worker);
+	if (!spi_queue_drain())
+		lcd_state_close();
+}
+
+/*
+ * Worker sets its panel up and then serves requests for it, highest lane
+ * first. When that fails the queues are closed, so the panel is reported
+ * missing.
+ */
+static void *ipc_worker_main(void *arg)
+{
+	struct ipc_worker *worker = arg;
+	struct ipc_request req;
+	struct pollfd fds[IPC_LANES + 1];
+	struct ipc_buffer buf;
+	uint8_t armed = 0, lane;
+	uint64_t ticks;
+	int ret, timer, wait;
+	ipc_worker_self = worker;
 	buf.mem = malloc(TOT_MEM_SIZE);
-	if (!buf.mem) {	
-		IPC_WRITE_LOG("malloc failed\0");
-		return 1;
+	timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (!buf.mem || timer < 0 || 
+	    lcd_panel_start(worker->panel.fd_lcd, worker->panel.fd_touch,
+			    worker->panel.rotation, worker->display)) {
+		IPC_WRITE_LOG("panel start failed\0");
+		for (lane = 0; lane < IPC_LANES; lane++)
+			close(worker->queue[lane][0]);
+		return NULL;
+	}
+	for (lane = 0; lane < IPC_LANES; lane++) {
+		fds[lane].fd = worker->queue[lane][0];
+		fds[lane].events = POLLIN;
+	}
+	fds[IPC_LANES].fd = timer;
+	fds[IPC_LANES].events = POLLIN;
+	while(1) {
+		wait = ipc_frame_wait(worker);
+		spi_queue_kick();
+		ret = poll(fds, IPC_LANES + 1, lcd_beam_pending() ? 0 : wait);
+		if (ret < 0)
+			continue;
+		/* refresh is measured once nothing waits for the panel */
+		if (!ret && lcd_beam_pending()) {
+			lcd_beam_tune(worker->panel.fd_lcd);
+			continue;
+		}
+		if (fds[IPC_LANES].revents & POLLIN && 
+		    read(timer, &ticks, sizeof(ticks)) == sizeof(ticks)) {
+			lcd_anim_tick(worker->panel.fd_lcd);
+			ipc_arm_timer(timer, &armed);
+		}
+		for (lane = 0; lane < IPC_LANES; lane++)
+			if (fds[lane].revents & POLLIN)
+				break;
+		if (lane == IPC_LANES || 
+		    read(fds[lane].fd, &req, sizeof(req)) != sizeof(req))
+			continue;
+		if (IPC_CMD(req.cmd) == HANDOVER)
+			break;
+		ipc_serve(worker, &req, &buf);
+		ipc_serve_deferred(worker, &buf);
+		ipc_arm_timer(timer, &armed);
+	}
+	ipc_worker_stop(worker);
+	close(timer);
+	free(buf.mem);
+	return NULL;
+}
+
+static int ipc_start_workers(struct ipc_worker *workers, 
+			     struct ipc_panel *panels, uint8_t cnt)
+{
+	for (uint8_t i = 0; i < cnt; i++) {
+		workers[i].panel = panels[i];
+		workers[i].display = i;
+		workers[i].deferred_cnt = 0;
+		workers[i].frame_owner = 0;
+		workers[i].passing_cnt = 0;
+		memset(workers[i].viewports, 0, sizeof(workers[i].viewports));
+		for (uint8_t lane = 0; lane < IPC_LANES; lane++)
+			if (pipe(workers[i].queue[lane]))
+				return -1;
+		errno = pthread_create(&workers[i].thread, NULL, ipc_worker_main,
+				       &workers[i]);
+		if (errno)
+			return -1;
+	}
+	return 0;
+}
+
+static int ipc_peer_trusted(int socket)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	if (getsockopt(socket, SOL_SOCKET, SO_PEERCRED, &cred, &len))
+		return 0;
+	return !cred.uid || cred.uid == geteuid();
+}
+
+/*
+ * Reply of HANDOVER, errno 0 with the listening socket attached.
+ */
+static int ipc_send_socket(int socket, int fd)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	int ret = 0;
+	struct iovec iov = {&ret, sizeof(ret)};
+	struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, 
+			     .msg_control = control, 
+			     .msg_controllen = sizeof(control)};
+	struct cmsghdr *cmsg;
+	memset(control, 0, sizeof(control));
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fd));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+	return sendmsg(socket, &msg, MSG_NOSIGNAL) == sizeof(ret) ? 0 : -1;
+}
+
+/*
+ * Connections the new daemon does not accept yet wait in the backlog of
+ * the socket, so no client notices. Workers are told to stop behind
+ * everything already queued to them; returns 0 once they did.
+ */
+static int ipc_hand_over(int server_socket, int socket, 
+			 struct ipc_worker *workers, uint8_t cnt)
+{
+	struct ipc_request req = {.socket = -1, .cmd = HANDOVER};
+	errno = 0;
+	if (!ipc_peer_trusted(socket))
+		errno = EPERM;
+	if (errno || ipc_send_socket(socket, server_socket)) {
+		IPC_WRITE_LOG("handover refused\0");
+		send(socket, &errno, sizeof(errno), MSG_NOSIGNAL);
+		close(socket);
+		return -1;
 	}
+	for (uint8_t i = 0; i < cnt; i++)
+		write(workers[i].queue[IPC_LANE_BULK][1], &req, sizeof(req));
+	for (uint8_t i = 0; i < cnt; i++)
+		pthread_join(workers[i].thread, NULL);
+	close(socket);
+	return 0;
+}
+
+/*
+ * Main thread only accepts connections and routes them by display ID,
+ * panels are drawn in parallel by their workers.
+ */
+int ipc_main(struct ipc_panel *panels, uint8_t cnt)
+{
+	struct sockaddr_un server;
+	struct ipc_worker workers[DISPLAY_CNT];
+	struct ipc_request req;
+	uint8_t display, lane;
+	int ret, server_socket;
+	ipc_clean_log_message();
+	signal(SIGPIPE, SIG_IGN);
 	ret = ipc_make(&server_socket, &server);
 	if (ret) {
 		IPC_WRITE_LOG("ipc_make failed\0");
 		return 1;
 	}
+	if (ipc_start_workers(workers, panels, cnt)) {
+		IPC_WRITE_LOG("ipc_start_workers failed\0");
+		return 1;
+	}
 	while(1) {
-		errno = 0;
-		client_socket = ipc_accept(server_socket, &server, &client);
-		if (client_socket < 0) {
+		req.socket = ipc_accept(server_socket, &server, &req.client);
+		if (req.socket < 0) {
 		       IPC_WRITE_LOG("ipc_accept failed\0");	
 			continue;
 		}
-		ret = ipc_action(fd_lcd, fd_touch, client_socket, &client, &buf);
-		if (ret)
-			IPC_WRITE_LOG("ipc_action failed\0");
-		if (buf.cmd != READ_TOUCHSCREEN)
-			send(client_socket, &errno, sizeof(errno), MSG_NOSIGNAL);  
-		close(client_socket);
+		ret = recv(req.socket, &req.cmd, sizeof(req.cmd), MSG_WAITALL 
+			   | MSG_NOSIGNAL);
+		if (ret != sizeof(req.cmd)) {
+			close(req.socket);
+			continue;
+		}
+		if (IPC_CMD(req.cmd) == HANDOVER) {
+			if (!ipc_hand_over(server_socket, req.socket, workers,
+					   cnt))
+				break;
+			continue;
+		}
+		display = IPC_DISPLAY(req.cmd);
+		lane = ipc_lane(IPC_CMD(req.cmd));
+		if (display < cnt && write(workers[display].queue[lane][1], 
+					   &req, sizeof(req)) == sizeof(req))
+			continue;
+		IPC_WRITE_LOG("no such display\0");
+		errno = ENODEV;
+		if (!ipc_own_reply(IPC_CMD(req.cmd)))
+			send(req.socket, &errno, sizeof(errno), MSG_NOSIGNAL);
+		close(req.socket);
 	}
 	close(server_socket);
 	return 0;
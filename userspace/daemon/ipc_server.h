@@ -3,6 +3,15 @@
 
 #include "ipc.h"
 
-int ipc_main(int fd_lcd, int fd_touch);
+/*
+ * Panel opened by main, fd_touch is -1 when it has no touchpad.
+ */
+struct ipc_panel {
+	int fd_lcd;
+	int fd_touch;
+	uint16_t rotation;
+};
+
+int ipc_main(struct ipc_panel *panels, uint8_t cnt);
 
 #endif
@@ -0,0 +1,282 @@
+#include "lcd_anim.h"
+#include "lcd_sprite.h"
+#include "asset_cache.h"
+#include "lcd_dedup.h"
+
+/* phase of animation cycle in 16.16 fixed point */
+#define ANIM_ONE 0x10000
+#define ANIM_DAMAGE_MAX (2 * ANIM_CNT)
+
+struct lcd_anim {
+	struct ipc_anim desc;
+	uint16_t x;
+	uint16_t y;
+	uint16_t dx;
+	uint16_t dy;
+	struct ipc_point keys[ANIM_KEYS_MAX];
+	uint64_t start;
+	/* last drawn colour, frame or position, -1 before first tick */
+	int64_t last;
+	uint8_t active;
+};
+
+static __thread struct lcd_anim lcd_anims[ANIM_CNT];
+
+static uint64_t anim_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*
+ * Returns 1 when animation without ANIM_LOOP reached its end, phase is
+ * then the final one.
+ */
+static int anim_phase(struct lcd_anim *anim, uint64_t now, uint32_t *phase)
+{
+	const uint64_t duration = anim->desc.duration;
+	const uint8_t reverse = anim->desc.flags & ANIM_REVERSE;
+	const uint64_t cycle = reverse ? 2 * duration : duration;
+	uint64_t time = now - anim->start;
+	if (!(anim->desc.flags & ANIM_LOOP) && time >= cycle) {
+		*phase = reverse ? 0 : ANIM_ONE;
+		return 1;
+	}
+	time %= cycle;
+	if (time >= duration)
+		time = cycle - time;
+	*phase = time * ANIM_ONE / duration;
+	return 0;
+}
+
+static inline int anim_mix(int from, int to, uint32_t phase)
+{
+	return from + (int)(((int64_t)(to - from) * phase) >> 16);
+}
+
+static uint16_t anim_ramp_colour(struct lcd_anim *anim, uint32_t phase)
+{
+	const uint16_t from = anim->desc.colour[0], to = anim->desc.colour[1];
+	uint16_t red = anim_mix(from >> 11, to >> 11, phase);
+	uint16_t green = anim_mix((from >> 5) & 0x3f, (to >> 5) & 0x3f, phase);
+	uint16_t blue = anim_mix(from & 0x1f, to & 0x1f, phase);
+	return red << 11 | green << 5 | blue;
+}
+
+static void anim_damage_add(struct lcd_rect *damage, int *cnt, 
+			    const struct lcd_rect *rect)
+{
+	struct lcd_rect both;
+	if (lcd_rect_empty(rect))
+		return;
+	for (int i = 0; i < *cnt; i++) {
+		both = damage[i];
+		lcd_rect_union(&both, rect);
+		if (lcd_rect_area(&both) <= lcd_rect_area(&damage[i]) + 
+					    lcd_rect_area(rect) + 
+					    LCD_WINDOW_COST) {
+			damage[i] = both;
+			return;
+		}
+	}
+	damage[(*cnt)++] = *rect;
+}
+
+static int anim_fits(struct lcd_anim *anim)
+{
+	return anim->x + anim->dx <= lcd_panel.width && 
+	       anim->y + anim->dy <= lcd_panel.height;
+}
+
+/*
+ * Draws ramp or frame into screen record, returns 1 when it changed.
+ */
+static int anim_draw(struct lcd_anim *anim, uint32_t phase)
+{
+	const uint32_t row_size = anim->dx * BY_PER_PIX;
+	struct asset *asset;
+	int64_t state;
+	uint8_t *frame;
+	if (!anim_fits(anim)) {
+		anim->active = 0;
+		return 0;
+	}
+	if (anim->desc.type == ANIM_RAMP) {
+		state = anim_ramp_colour(anim, phase);
+		if (state == anim->last)
+			return 0;
+		lcd_fill_rect(anim->x, anim->y, anim->dx, anim->dy, 
+			      lcd_panel_colour(state));
+		anim->last = state;
+		return 1;
+	}
+	state = ((uint64_t)phase * anim->desc.cnt) >> 16;
+	if (state >= anim->desc.cnt)
+		state = anim->desc.cnt - 1;
+	if (state == anim->last)
+		return 0;
+	asset_lock();
+	asset = asset_find(anim->desc.asset);
+	if (!asset) {
+		asset_unlock();
+		anim->active = 0;
+		return 0;
+	}
+	frame = asset->mem + state * anim->dy * row_size;
+	for (uint16_t i = 0; i < anim->dy; i++)
+		memcpy(lcd_fb_pos(anim->x, anim->y + i), frame + i * row_size,
+		       row_size);
+	asset_unlock();
+	anim->last = state;
+	return 1;
+}
+
+static void anim_move(struct lcd_anim *anim, uint32_t phase, 
+		      struct lcd_rect *damage, int *cnt)
+{
+	struct ipc_point *from, *to;
+	struct lcd_rect old, new;
+	uint32_t pos = phase * (anim->desc.cnt - 1);
+	uint16_t key = pos >> 16;
+	int16_t x, y;
+	int64_t state;
+	if (key >= anim->desc.cnt - 1) {
+		from = to = &anim->keys[anim->desc.cnt - 1];
+	} else {
+		from = &anim->keys[key];
+		to = &anim->keys[key + 1];
+	}
+	x = anim_mix(from->x, to->x, pos & 0xffff);
+	y = anim_mix(from->y, to->y, pos & 0xffff);
+	state = (uint32_t)(uint16_t)x << 16 | (uint16_t)y;
+	if (state == anim->last)
+		return;
+	if (lcd_sprite_place(anim->desc.sprite, x, y, SPRITE_VISIBLE, &old, 
+			     &new)) {
+		anim->active = 0;
+		return;
+	}
+	anim->last = state;
+	anim_damage_add(damage, cnt, &old);
+	anim_damage_add(damage, cnt, &new);
+}
+
+/*
+ * All animations are advanced in screen record first, changed areas are
+ * merged and sent together once per tick.
+ */
+void lcd_anim_tick(int fd)
+{
+	struct lcd_rect damage[ANIM_DAMAGE_MAX];
+	struct lcd_rect rect;
+	uint64_t now = anim_now();
+	uint32_t phase;
+	int cnt = 0, done;
+	lcd_sprites_lift();
+	for (int i = 0; i < ANIM_CNT; i++) {
+		struct lcd_anim *anim = &lcd_anims[i];
+		if (!anim->active || anim->desc.type == ANIM_SPRITE)
+			continue;
+		done = anim_phase(anim, now, &phase);
+		if (anim_draw(anim, phase)) {
+			rect.x0 = anim->x;
+			rect.y0 = anim->y;
+			rect.x1 = anim->x + anim->dx;
+			rect.y1 = anim->y + anim->dy;
+			anim_damage_add(damage, &cnt, &rect);
+			lcd_dedup_forget(&rect);
+		}
+		if (done)
+			anim->active = 0;
+	}
+	lcd_sprites_drop(fd);
+	for (int i = 0; i < ANIM_CNT; i++) {
+		struct lcd_anim *anim = &lcd_anims[i];
+		if (!anim->active || anim->desc.type != ANIM_SPRITE)
+			continue;
+		done = anim_phase(anim, now, &phase);
+		anim_move(anim, phase, damage, &cnt);
+		if (done)
+			anim->active = 0;
+	}
+	for (int i = 0; i < cnt; i++)
+		lcd_flush_rect(fd, damage[i].x0, damage[i].y0, 
+			       damage[i].x1 - damage[i].x0,
+			       damage[i].y1 - damage[i].y0);
+}
+
+int lcd_anim_start(struct ipc_buffer *buf, struct ipc_anim *desc, 
+		   struct ipc_point *keys)
+{
+	static __thread struct lcd_anim next;
+	struct asset *asset;
+	int ret;
+	if (desc->slot >= ANIM_CNT || !desc->duration || !desc->cnt) {
+		errno = EINVAL;
+		return -1;
+	}
+	next.x = buf->x;
+	next.y = buf->y;
+	next.dx = buf->dx;
+	next.dy = buf->dy;
+	switch (desc->type) {
+	case ANIM_SPRITE:
+		if (desc->cnt > ANIM_KEYS_MAX || desc->sprite >= SPRITE_CNT) {
+			errno = EINVAL;
+			return -1;
+		}
+		memcpy(next.keys, keys, desc->cnt * sizeof(*keys));
+		break;
+	case ANIM_RAMP:
+		if (!buf->dx || !buf->dy || !anim_fits(&next)) {
+			errno = EINVAL;
+			return -1;
+		}
+		break;
+	case ANIM_FRAMES:
+		asset_lock();
+		asset = asset_find(desc->asset);
+		if (!asset) {
+			asset_unlock();
+			errno = ENOENT;
+			return -1;
+		}
+		next.dx = asset->dx;
+		next.dy = asset->dy / desc->cnt;
+		ret = asset->dy % desc->cnt;
+		asset_unlock();
+		if (ret || !next.dy || !anim_fits(&next)) {
+			errno = EINVAL;
+			return -1;
+		}
+		break;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+	next.desc = *desc;
+	next.start = anim_now();
+	next.last = -1;
+	next.active = 1;
+	lcd_anims[desc->slot] = next;
+	return 0;
+}
+
+int lcd_anim_stop(uint8_t slot)
+{
+	if (slot >= ANIM_CNT) {
+		errno = EINVAL;
+		return -1;
+	}
+	lcd_anims[slot].active = 0;
+	return 0;
+}
+
+int lcd_anim_active(void)
+{
+	int cnt = 0;
+	for (int i = 0; i < ANIM_CNT; i++)
+		cnt += lcd_anims[i].active;
+	return cnt;
+}
@@ -0,0 +1,16 @@
+#ifndef _LCD_ANIM_H_
+#define _LCD_ANIM_H_
+
+#include "lcd_spi.h"
+
+/*
+ * Declarative animations advanced by lcd_anim_tick, every ANIM_TICK_MS
+ * while any of them is active.
+ */
+int lcd_anim_start(struct ipc_buffer *buf, struct ipc_anim *desc, 
+		   struct ipc_point *keys);
+int lcd_anim_stop(uint8_t slot);
+int lcd_anim_active(void);
+void lcd_anim_tick(int fd);
+
+#endif
@@ -0,0 +1,179 @@
+#include "lcd_beam.h"
+#include "spi_queue.h"
+
+/*
+ * Refresh as measured, line_ns is 0 when beam racing is off. Beam is
+ * where it was last read plus the lines refreshed since then.
+ */
+struct lcd_beam {
+	uint64_t period_ns;
+	uint32_t line_ns;
+	uint16_t lines;
+	uint64_t read_ns;
+	uint16_t read_line;
+};
+
+static uint8_t lcd_beam_enabled;
+static __thread struct lcd_beam lcd_beam;
+static __thread uint8_t lcd_beam_tuned;
+
+static inline uint64_t lcd_beam_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void lcd_beam_enable(void)
+{
+	lcd_beam_enabled = 1;
+}
+
+int lcd_beam_pending(void)
+{
+	return lcd_beam_enabled && !lcd_beam_tuned;
+}
+
+/*
+ * Scanline is sampled for LCD_BEAM_TUNE_MS at most, period is the mean
+ * time between its wraps. Panels whose scanline cannot be read (no MISO, or
+ * a controller without 0x45) stay unpaced.
+ */
+int lcd_beam_tune(int fd)
+{
+	const uint64_t start = lcd_beam_now();
+	uint64_t now, first = 0, last = 0;
+	uint16_t line, prev = 0, max = 0;
+	uint32_t wraps = 0;
+	memset(&lcd_beam, 0, sizeof(lcd_beam));
+	lcd_beam_tuned = 1;
+	if (!lcd_beam_enabled)
+		return 0;
+	while ((now = lcd_beam_now()) - start < LCD_BEAM_TUNE_MS * 1000000ULL &&
+	       wraps < LCD_BEAM_TUNE_WRAPS) {
+		if (lcd_read_scanline(fd, &line))
+			return -1;
+		if (line > max)
+			max = line;
+		/* refresh started again from the top */
+		if (line + HEIGHT_MAX / 2 < prev) {
+			if (!wraps++)
+				first = now;
+			last = now;
+		}
+		prev = line;
+	}
+	if (wraps < 2 || max < HEIGHT_MAX - 1) {
+		errno = ENODEV;
+		return -1;
+	}
+	lcd_beam.lines = max + 1;
+	lcd_beam.period_ns = (last - first) / (wraps - 1);
+	lcd_beam.line_ns = lcd_beam.period_ns / lcd_beam.lines;
+	return 0;
+}
+
+/*
+ * Line the beam is at when everything queued is sent, *left from now.
+ * While the last read is recent, it is predicted from the cost of what is
+ * queued; the queue is drained only for a read. Reading it ends the
+ * memory write, so *read tells the writer to open its window again. A
+ * panel whose scanline cannot be read any more is no longer paced.
+ */
+static int lcd_beam_line(int fd, uint16_t *line, uint64_t *left, 
+			 uint8_t *read)
+{
+	struct lcd_beam *beam = &lcd_beam;
+	const uint64_t now = lcd_beam_now();
+	int err = errno;
+	if (now - beam->read_ns < LCD_BEAM_READ_MS * 1000000ULL) {
+		*left = spi_queue_left();
+		*line = (beam->read_line + (now + *left - beam->read_ns) / 
+			 beam->line_ns) % beam->lines;
+		return 0;
+	}
+	spi_queue_drain();
+	*left = 0;
+	*read = 1;
+	if (lcd_read_scanline(fd, line)) {
+		/* the write goes on unpaced, it has not failed */
+		memset(beam, 0, sizeof(*beam));
+		errno = err;
+		return -1;
+	}
+	beam->read_ns = lcd_beam_now();
+	beam->read_line = *line;
+	return 0;
+}
+
+/*
+ * Panel rows, in refresh order, a band of the screen is written to.
+ * Returns 1 when the band is written in refresh order too, row by row
+ * from the first one.
+ */
+static int lcd_beam_rows(uint16_t x, uint16_t y, uint16_t dx, uint16_t dy,
+			 uint16_t *first, uint16_t *end)
+{
+	switch (lcd_panel.rotation) {
+	case 90:
+		*first = x;
+		*end = x + dx;
+		return 0;
+	case 180:
+		*first = HEIGHT_MAX - y - dy;
+		*end = HEIGHT_MAX - y;
+		return 0;
+	case 270:
+		*first = HEIGHT_MAX - x - dx;
+		*end = HEIGHT_MAX - x;
+		return 0;
+	default:
+		*first = y;
+		*end = y + dy;
+		return 1;
+	}
+}
+
+/*
+ * Band is safe to start when the beam reaches its first row only after
+ * the band is sent, and the beam is not on its rows. A band written in
+ * refresh order may also start behind the beam on its rows, as long as
+ * the beam is the faster one. Otherwise the beam is let past the band;
+ * bands which cannot be sent within one refresh are not paced at all.
+ */
+int lcd_beam_race(int fd, uint16_t x, uint16_t y, uint16_t dx, uint16_t dy)
+{
+	const struct lcd_beam *beam = &lcd_beam;
+	struct timespec req;
+	uint64_t send_ns, wait_ns, left;
+	uint16_t first, end, line, ahead;
+	uint8_t chase, read = 0;
+	if (!beam->line_ns || !dx || !dy)
+		return 0;
+	chase = lcd_beam_rows(x, y, dx, dy, &first, &end);
+	send_ns = spi_queue_cost((uint32_t)dx * dy * BY_PER_PIX) + 
+		  LCD_BEAM_WINDOW_OPS * spi_queue_cost(0) + 
+		  (uint64_t)LCD_BEAM_MARGIN * beam->line_ns;
+	if (send_ns + (uint64_t)(end - first) * beam->line_ns >= 
+	    beam->period_ns)
+		return 0;
+	chase = chase && send_ns >= (uint64_t)(end - first) * beam->line_ns;
+	for (uint8_t i = 0; i < 2; i++) {
+		if (lcd_beam_line(fd, &line, &left, &read))
+			return read;
+		ahead = (first + beam->lines - line) % beam->lines;
+		if ((chase || line < first || line >= end) && 
+		    (uint64_t)ahead * beam->line_ns >= send_ns)
+			return read;
+		/* band starts only once the queue is through */
+		if (chase)
+			wait_ns = left + (uint64_t)(ahead + 1) * beam->line_ns;
+		else
+			wait_ns = left + (uint64_t)((end + beam->lines - line) % 
+						    beam->lines) * beam->line_ns;
+		req.tv_sec = wait_ns / 1000000000;
+		req.tv_nsec = wait_ns % 1000000000;
+		nanosleep(&req, NULL);
+	}
+	return read;
+}
@@ -0,0 +1,42 @@
+#ifndef _LCD_BEAM_H_
+#define _LCD_BEAM_H_
+
+#include "lcd_spi.h"
+
+/*
+ * Beam racing: panel refreshes its rows one after another, a band of a
+ * write is started only when refresh is off its rows and does not come
+ * back to them before the band is sent, so no refresh shows it half
+ * written. Refresh position is read with Get Scanline (0x45), period and
+ * line count are measured by lcd_beam_tune for every panel, once it is
+ * idle for the first time. Only writes of at least LCD_BEAM_MIN bytes are
+ * paced, and only with -b.
+ */
+#define LCD_BEAM_MIN LCD_BULK_SIZE
+#define LCD_BEAM_TUNE_MS 100
+#define LCD_BEAM_TUNE_WRAPS 4
+/* beam position is predicted from the last read for this long */
+#define LCD_BEAM_READ_MS 50
+/* refresh lines kept between the band and the beam */
+#define LCD_BEAM_MARGIN 8
+/* transfers opening the window of a band: CASET, PASET, their data, RAMWR */
+#define LCD_BEAM_WINDOW_OPS 5
+
+void lcd_beam_enable(void);
+int lcd_beam_pending(void);
+int lcd_beam_tune(int fd);
+
+static inline int lcd_beam_paced(uint16_t dx, uint16_t dy)
+{
+	return (uint32_t)dx * dy * BY_PER_PIX >= LCD_BEAM_MIN;
+}
+
+/*
+ * Waits until band may be written, after everything queued before it is
+ * sent. Returns 1 when the panel was read and the writer has to open its
+ * window again.
+ */
+int lcd_beam_race(int fd, uint16_t x, uint16_t y, uint16_t dx, 
+		  uint16_t dy);
+
+#endif
@@ -0,0 +1,75 @@
+#include "lcd_dedup.h"
+
+struct dedup_entry {
+	uint64_t hash;
+	struct lcd_rect rect;
+};
+
+/*
+ * Entries are kept oldest first, the oldest one is replaced when full.
+ */
+struct lcd_dedup {
+	struct dedup_entry entry[DEDUP_CNT];
+	uint8_t cnt;
+	uint8_t armed;
+	uint64_t hash;
+	struct lcd_rect rect;
+	uint32_t hits;
+	uint32_t bytes;
+};
+
+static __thread struct lcd_dedup lcd_dedup;
+
+int lcd_dedup_seen(uint64_t hash, const struct lcd_rect *rect)
+{
+	for (uint8_t i = 0; i < lcd_dedup.cnt; i++) {
+		if (lcd_dedup.entry[i].hash != hash)
+			continue;
+		lcd_dedup.hits++;
+		lcd_dedup.bytes += lcd_rect_area(&lcd_dedup.entry[i].rect) *
+				   BY_PER_PIX;
+		return 1;
+	}
+	lcd_dedup.hash = hash;
+	lcd_dedup.rect = *rect;
+	lcd_dedup.armed = 1;
+	return 0;
+}
+
+void lcd_dedup_forget(const struct lcd_rect *rect)
+{
+	uint8_t kept = 0;
+	for (uint8_t i = 0; i < lcd_dedup.cnt; i++)
+		if (!lcd_rect_overlap(&lcd_dedup.entry[i].rect, rect))
+			lcd_dedup.entry[kept++] = lcd_dedup.entry[i];
+	lcd_dedup.cnt = kept;
+}
+
+void lcd_dedup_reset(void)
+{
+	lcd_dedup.cnt = 0;
+}
+
+void lcd_dedup_update(int ok)
+{
+	struct dedup_entry *entry;
+	uint8_t armed = lcd_dedup.armed;
+	lcd_dedup.armed = 0;
+	lcd_dedup_forget(&lcd_panel.damage);
+	if (!armed || !ok || lcd_rect_empty(&lcd_dedup.rect))
+		return;
+	if (lcd_dedup.cnt == DEDUP_CNT) {
+		memmove(lcd_dedup.entry, lcd_dedup.entry + 1,
+			(DEDUP_CNT - 1) * sizeof(struct dedup_entry));
+		lcd_dedup.cnt--;
+	}
+	entry = &lcd_dedup.entry[lcd_dedup.cnt++];
+	entry->hash = lcd_dedup.hash;
+	entry->rect = lcd_dedup.rect;
+}
+
+void lcd_dedup_stats(struct ipc_stats *stats)
+{
+	stats->dedup_hits = lcd_dedup.hits;
+	stats->dedup_bytes = lcd_dedup.bytes;
+}
@@ -0,0 +1,45 @@
+#ifndef _LCD_DEDUP_H_
+#define _LCD_DEDUP_H_
+
+#include "lcd_spi.h"
+
+/*
+ * Recent draws are remembered by hash of the command and the area they
+ * wrote, until anything else is drawn over that area. A command equal to
+ * one still on screen is skipped.
+ */
+#define DEDUP_CNT 32
+
+static inline uint64_t lcd_dedup_hash(const struct ipc_buffer *buf,
+				      const uint8_t *mem, uint32_t size)
+{
+	/* FNV-1a, as ipc_asset_hash; coordinates are relative to the view */
+	const struct lcd_rect *view = &lcd_panel.view;
+	const uint16_t head[9] = {buf->cmd, buf->x, buf->y, buf->dx, buf->dy,
+				  view->x0, view->y0, view->x1, view->y1};
+	const uint8_t *bytes = (const uint8_t *)head;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (uint32_t i = 0; i < sizeof(head); i++)
+		hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+	for (uint32_t i = 0; i < size; i++)
+		hash = (hash ^ mem[i]) * 0x100000001b3ULL;
+	return hash;
+}
+
+/*
+ * Returns 1 when the draw is already on screen. Otherwise it is
+ * remembered by lcd_dedup_update once the command succeeds, with rect:
+ * the whole area the command addresses, as a draw may change only part
+ * of it (text sends only changed cells).
+ */
+int lcd_dedup_seen(uint64_t hash, const struct lcd_rect *rect);
+/*
+ * Called after every drawing command with panel damage of the command.
+ */
+void lcd_dedup_update(int ok);
+void lcd_dedup_forget(const struct lcd_rect *rect);
+/* coordinates change meaning with orientation */
+void lcd_dedup_reset(void);
+void lcd_dedup_stats(struct ipc_stats *stats);
+
+#endif
@@ -0,0 +1,112 @@
+#include "lcd_frame.h"
+
+/* what the panel shows while a frame is composed, allocated on first use */
+static __thread uint8_t *lcd_front;
+/* sent to the panel and not copied to front buffer yet */
+static __thread struct lcd_rect lcd_front_stale;
+
+static inline int lcd_frame_pixel_same(const uint8_t *back,
+				       const uint8_t *front, int x)
+{
+	return !memcmp(back + x * BY_PER_PIX, front + x * BY_PER_PIX,
+		       BY_PER_PIX);
+}
+
+/*
+ * Changed part of row y within composed area, returns 0 when there is
+ * none.
+ */
+static int lcd_frame_row(uint16_t y, int *x0, int *x1)
+{
+	const struct lcd_rect *frame = &lcd_panel.frame;
+	const uint32_t offset = (uint32_t)y * lcd_panel.width * BY_PER_PIX;
+	const uint8_t *back = lcd_panel.fb + offset;
+	const uint8_t *front = lcd_front + offset;
+	int first = frame->x0, last = frame->x1 - 1;
+	if (!memcmp(back + first * BY_PER_PIX, front + first * BY_PER_PIX,
+		    (last - first + 1) * BY_PER_PIX))
+		return 0;
+	while (lcd_frame_pixel_same(back, front, first))
+		first++;
+	while (lcd_frame_pixel_same(back, front, last))
+		last--;
+	*x0 = first;
+	*x1 = last;
+	return 1;
+}
+
+static void lcd_frame_copy(const struct lcd_rect *rect)
+{
+	const uint32_t row_size = (rect->x1 - rect->x0) * BY_PER_PIX;
+	uint32_t offset;
+	if (lcd_rect_empty(rect))
+		return;
+	for (uint16_t y = rect->y0; y < rect->y1; y++) {
+		offset = lcd_fb_pos(rect->x0, y) - lcd_panel.fb;
+		memcpy(lcd_front + offset, lcd_panel.fb + offset, row_size);
+	}
+}
+
+int lcd_frame_begin(void)
+{
+	if (lcd_panel.compose) {
+		errno = EBUSY;
+		return -1;
+	}
+	if (!lcd_front) {
+		lcd_front = malloc(TOT_MEM_SIZE);
+		if (!lcd_front)
+			return -1;
+		lcd_front_stale.x0 = 0;
+		lcd_front_stale.y0 = 0;
+		lcd_front_stale.x1 = lcd_panel.width;
+		lcd_front_stale.y1 = lcd_panel.height;
+	}
+	lcd_frame_copy(&lcd_front_stale);
+	memset(&lcd_front_stale, 0, sizeof(lcd_front_stale));
+	memset(&lcd_panel.frame, 0, sizeof(lcd_panel.frame));
+	lcd_panel.compose = 1;
+	return 0;
+}
+
+/*
+ * Changed spans of rows are joined into windows as spans of vector
+ * primitives are.
+ */
+void lcd_frame_end(int fd)
+{
+	const struct lcd_rect frame = lcd_panel.frame;
+	int x0, x1;
+	if (!lcd_panel.compose)
+		return;
+	lcd_panel.compose = 0;
+	if (lcd_rect_empty(&frame))
+		return;
+	for (uint16_t y = frame.y0; y < frame.y1; y++)
+		if (lcd_frame_row(y, &x0, &x1))
+			lcd_span_add(fd, x0, x1, y);
+	lcd_span_flush(fd);
+}
+
+void lcd_frame_sent(const struct lcd_rect *rect)
+{
+	lcd_rect_union(&lcd_front_stale, rect);
+}
+
+void lcd_frame_pass(int fd, const struct lcd_rect *frame,
+		    const struct lcd_rect *rect)
+{
+	const struct lcd_rect damage = *rect;
+	if (!lcd_panel.compose || lcd_rect_empty(&damage))
+		return;
+	lcd_panel.frame = *frame;
+	if (lcd_rect_overlap(frame, &damage)) {
+		lcd_rect_union(&lcd_panel.frame, &damage);
+		return;
+	}
+	lcd_panel.compose = 0;
+	lcd_flush_rect(fd, damage.x0, damage.y0, damage.x1 - damage.x0,
+		       damage.y1 - damage.y0);
+	lcd_panel.compose = 1;
+	lcd_frame_copy(&damage);
+}
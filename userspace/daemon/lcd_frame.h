@@ -0,0 +1,26 @@
+#ifndef _LCD_FRAME_H_
+#define _LCD_FRAME_H_
+
+#include "lcd_spi.h"
+
+/*
+ * While a frame is composed, drawing only changes screen record (back
+ * buffer) and nothing is sent to the panel. What the panel shows is kept
+ * as front buffer; on commit the rows of composed area are compared with
+ * it and only the changed pixels are sent, all windows back to back.
+ * Front buffer is brought up to date when a frame begins, from the part
+ * of the record sent since the previous one (lcd_frame_sent).
+ */
+int lcd_frame_begin(void);
+void lcd_frame_end(int fd);
+void lcd_frame_sent(const struct lcd_rect *rect);
+
+/*
+ * Draw of another client than the frame owner, made while composing: its
+ * damage is sent right away when it stays off the area composed before
+ * it (frame), otherwise it is added to the frame.
+ */
+void lcd_frame_pass(int fd, const struct lcd_rect *frame,
+		    const struct lcd_rect *damage);
+
+#endif
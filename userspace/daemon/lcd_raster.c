@@ -0,0 +1,266 @@
+#include <math.h>
+
+#include "lcd_raster.h"
+
+/*
+ * Pixels of one row are collected in a run, so every row costs one span.
+ */
+struct raster_run {
+	int x0;
+	int x1;
+	int y;
+	uint8_t valid;
+};
+
+static void raster_run_end(int fd, struct raster_run *run, uint16_t colour)
+{
+	if (run->valid)
+		lcd_span(fd, run->x0, run->x1, run->y, colour);
+	run->valid = 0;
+}
+
+static void raster_run_add(int fd, struct raster_run *run, int x, int y,
+			   uint16_t colour)
+{
+	if (run->valid && run->y == y && x >= run->x0 - 1 &&
+	    x <= run->x1 + 1) {
+		if (x < run->x0)
+			run->x0 = x;
+		if (x > run->x1)
+			run->x1 = x;
+		return;
+	}
+	raster_run_end(fd, run, colour);
+	run->x0 = x;
+	run->x1 = x;
+	run->y = y;
+	run->valid = 1;
+}
+
+/*
+ * Bresenham's line algorithm.
+ */
+static void raster_line(int fd, struct raster_run *run, int x0, int y0,
+			int x1, int y1, uint16_t colour)
+{
+	int dx = abs(x1 - x0), sx = x0 < x1 ? 1 : -1;
+	int dy = -abs(y1 - y0), sy = y0 < y1 ? 1 : -1;
+	int err = dx + dy, e2;
+	while (1) {
+		raster_run_add(fd, run, x0, y0, colour);
+		if (x0 == x1 && y0 == y1)
+			break;
+		e2 = 2 * err;
+		if (e2 >= dy) {
+			err += dy;
+			x0 += sx;
+		}
+		if (e2 <= dx) {
+			err += dx;
+			y0 += sy;
+		}
+	}
+}
+
+int lcd_raster_line(int fd, int x0, int y0, int x1, int y1, uint16_t rgb)
+{
+	struct raster_run run = {.valid = 0};
+	uint16_t colour = lcd_panel_colour(rgb);
+	raster_line(fd, &run, x0, y0, x1, y1, colour);
+	raster_run_end(fd, &run, colour);
+	lcd_span_flush(fd);
+	return 0;
+}
+
+static int raster_isqrt(int value)
+{
+	int root = sqrt(value);
+	while (root * root > value)
+		root--;
+	while ((root + 1) * (root + 1) <= value)
+		root++;
+	return root;
+}
+
+/*
+ * Half width of circle with radius r in row dy from its centre, -1 when
+ * row is outside. The +r term rounds the edge like midpoint algorithm.
+ */
+static inline int raster_half(int r, int dy)
+{
+	if (r < 0 || dy > r || dy < -r)
+		return -1;
+	return raster_isqrt(r * r + r - dy * dy);
+}
+
+static inline int raster_in_sweep(int dx, int dy, uint16_t start,
+				  uint16_t sweep)
+{
+	int angle = floor(atan2(dy, dx) * 180.0 / M_PI);
+	if (angle < 0)
+		angle += 360;
+	return (angle - start % 360 + 360) % 360 <= sweep;
+}
+
+/*
+ * Ring between radius r and r - thickness, limited to sweep degrees from
+ * start. Circles are rings with full sweep.
+ */
+int lcd_raster_arc(int fd, int cx, int cy, int r, int thickness,
+		   uint16_t start, uint16_t sweep, uint16_t rgb)
+{
+	struct raster_run run = {.valid = 0};
+	uint16_t colour = lcd_panel_colour(rgb);
+	int inner = r - thickness, outer_half, inner_half;
+	if (r < 0 || r > SHAPE_RADIUS_MAX || thickness < 1) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (int dy = -r; dy <= r; dy++) {
+		if (cy + dy < 0 || cy + dy >= lcd_view_height())
+			continue;
+		outer_half = raster_half(r, dy);
+		inner_half = raster_half(inner, dy);
+		if (sweep >= 360) {
+			if (inner_half < 0) {
+				lcd_span(fd, cx - outer_half, cx + outer_half,
+					 cy + dy, colour);
+			} else {
+				lcd_span(fd, cx - outer_half,
+					 cx - inner_half - 1, cy + dy, colour);
+				lcd_span(fd, cx + inner_half + 1,
+					 cx + outer_half, cy + dy, colour);
+			}
+			continue;
+		}
+		for (int dx = -outer_half; dx <= outer_half; dx++) {
+			if (dx >= -inner_half && dx <= inner_half) {
+				dx = inner_half;
+				continue;
+			}
+			if (raster_in_sweep(dx, dy, start, sweep))
+				raster_run_add(fd, &run, cx + dx, cy + dy,
+					       colour);
+		}
+	}
+	raster_run_end(fd, &run, colour);
+	lcd_span_flush(fd);
+	return 0;
+}
+
+int lcd_raster_circle(int fd, int cx, int cy, int r, uint16_t flags,
+		      uint16_t rgb)
+{
+	int thickness = flags & SHAPE_FILL ? r + 1 : 1;
+	return lcd_raster_arc(fd, cx, cy, r, thickness, 0, 360, rgb);
+}
+
+int lcd_raster_round_rect(int fd, int x, int y, int dx, int dy, int radius,
+			  uint16_t flags, uint16_t rgb)
+{
+	uint16_t colour = lcd_panel_colour(rgb);
+	int left, right, top, bottom, row, outer_half, inner_half;
+	if (!dx || !dy) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (radius > (dx - 1) / 2)
+		radius = (dx - 1) / 2;
+	if (radius > (dy - 1) / 2)
+		radius = (dy - 1) / 2;
+	left = x + radius;
+	right = x + dx - 1 - radius;
+	top = y + radius;
+	bottom = y + dy - 1 - radius;
+	for (int yy = y; yy < y + dy; yy++) {
+		if (yy < 0 || yy >= lcd_view_height())
+			continue;
+		row = yy < top ? yy - top : (yy > bottom ? yy - bottom : 0);
+		outer_half = raster_half(radius, row);
+		inner_half = raster_half(radius - 1, row);
+		if ((flags & SHAPE_FILL) || yy == y || yy == y + dy - 1 ||
+		    inner_half < 0) {
+			lcd_span(fd, left - outer_half, right + outer_half, yy,
+				 colour);
+		} else {
+			lcd_span(fd, left - outer_half, left - inner_half - 1,
+				 yy, colour);
+			lcd_span(fd, right + inner_half + 1, right + outer_half,
+				 yy, colour);
+		}
+	}
+	lcd_span_flush(fd);
+	return 0;
+}
+
+static void raster_sort(float *mem, int cnt)
+{
+	for (int i = 1; i < cnt; i++) {
+		float value = mem[i];
+		int j = i;
+		for (; j > 0 && mem[j - 1] > value; j--)
+			mem[j] = mem[j - 1];
+		mem[j] = value;
+	}
+}
+
+/*
+ * Scanline fill with even-odd rule, pixel is inside when its centre is.
+ */
+static void raster_fill_polygon(int fd, struct ipc_point *points,
+				uint16_t cnt, uint16_t colour)
+{
+	float cross[POLYGON_POINTS_MAX];
+	int y_min = points[0].y, y_max = points[0].y;
+	for (uint16_t i = 1; i < cnt; i++) {
+		if (points[i].y < y_min)
+			y_min = points[i].y;
+		if (points[i].y > y_max)
+			y_max = points[i].y;
+	}
+	if (y_min < 0)
+		y_min = 0;
+	if (y_max >= lcd_view_height())
+		y_max = lcd_view_height() - 1;
+	for (int y = y_min; y <= y_max; y++) {
+		float centre = y + 0.5f;
+		int cross_cnt = 0;
+		for (uint16_t i = 0; i < cnt; i++) {
+			struct ipc_point *a = &points[i];
+			struct ipc_point *b = &points[(i + 1) % cnt];
+			if ((a->y <= centre) == (b->y <= centre))
+				continue;
+			cross[cross_cnt++] = a->x + (centre - a->y) *
+					     (b->x - a->x) / (b->y - a->y);
+		}
+		raster_sort(cross, cross_cnt);
+		for (int i = 0; i + 1 < cross_cnt; i += 2)
+			lcd_span(fd, ceilf(cross[i] - 0.5f),
+				 ceilf(cross[i + 1] - 0.5f) - 1, y, colour);
+	}
+}
+
+int lcd_raster_polygon(int fd, struct ipc_point *points, uint16_t cnt,
+		       uint16_t flags, uint16_t rgb)
+{
+	struct raster_run run = {.valid = 0};
+	uint16_t colour = lcd_panel_colour(rgb);
+	if (!cnt || cnt > POLYGON_POINTS_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (flags & SHAPE_FILL) {
+		raster_fill_polygon(fd, points, cnt, colour);
+	} else {
+		for (uint16_t i = 0; i + 1 < cnt; i++)
+			raster_line(fd, &run, points[i].x, points[i].y,
+				    points[i + 1].x, points[i + 1].y, colour);
+		if (!(flags & SHAPE_OPEN) && cnt > 2)
+			raster_line(fd, &run, points[cnt - 1].x,
+				    points[cnt - 1].y, points[0].x,
+				    points[0].y, colour);
+		raster_run_end(fd, &run, colour);
+	}
+	lcd_span_flush(fd);
+	return 0;
+}
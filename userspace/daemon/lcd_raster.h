@@ -0,0 +1,21 @@
+#ifndef _LCD_RASTER_H_
+#define _LCD_RASTER_H_
+
+#include "lcd_spi.h"
+
+/*
+ * Rasterizers of vector primitives. Shapes are emitted as horizontal
+ * spans through lcd_span, colours are plain RGB565 values.
+ */
+
+int lcd_raster_line(int fd, int x0, int y0, int x1, int y1, uint16_t rgb);
+int lcd_raster_circle(int fd, int cx, int cy, int r, uint16_t flags,
+		      uint16_t rgb);
+int lcd_raster_arc(int fd, int cx, int cy, int r, int thickness,
+		   uint16_t start, uint16_t sweep, uint16_t rgb);
+int lcd_raster_round_rect(int fd, int x, int y, int dx, int dy, int radius,
+			  uint16_t flags, uint16_t rgb);
+int lcd_raster_polygon(int fd, struct ipc_point *points, uint16_t cnt,
+		       uint16_t flags, uint16_t rgb);
+
+#endif
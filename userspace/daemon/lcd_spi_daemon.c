@@ -17,12 +17,25 @@
 #include "lcd_spi.h"
 #include "ipc_server.h"
 #include "fonts.h"
+#include "rgba_blend.h"
+#include "spi_queue.h"
+#include "lcd_dedup.h"
+#include "lcd_beam.h"
+#include "lcd_virtual.h"
+#include "lcd_state.h"
+#include "lcd_frame.h"
 #include <math.h>
 
 
 static const char *device_lcd = "/dev/lcd_spi";
 static const char *device_touch = "/dev/touchpad_spi";
 
+__thread struct lcd_panel lcd_panel = {
+	.width = LENGTH_MAX,
+	.height = HEIGHT_MAX,
+	.rotation = 0
+};
+
 static int transfer(int fd, uint8_t *tx, uint8_t *rx, uint32_t n, 
 		    unsigned int cmd)
 {
@@ -32,6 +45,16 @@ static int transfer(int fd, uint8_t *tx, uint8_t *rx, uint32_t n,
 		.tx_buf = tx,
 		.rx_buf = rx
 	};
+	/* screen record is all there is to a composed frame */
+	if (lcd_panel.compose && cmd != SPI_IO_RD_CMD)
+		return 0;
+	if (spi_queue_owns(fd)) {
+		if (cmd != SPI_IO_RD_CMD)
+			return spi_queue_write(fd, cmd, tx, n);
+		spi_queue_drain();
+	}
+	if (cmd == SPI_IO_RD_CMD && lcd_virtual_owns(fd))
+		return lcd_virtual_read(fd, tx[0], rx, n - 2);
 	ret = ioctl(fd, cmd, &tr);
 	if (ret < 1)
 		return ret;
@@ -95,7 +118,18 @@ static int transfer_wr_cmd_data(int fd, int arg_cnt, ... )
 
 static int transfer_rd_d(int fd, int n, uint8_t cmd, uint8_t *rx)
 {
-	transfer(fd, &cmd, rx, n + 2, SPI_IO_RD_CMD);
+	return transfer(fd, &cmd, rx, n + 2, SPI_IO_RD_CMD);
+}
+
+/*
+ * Get Scanline, the line panel refresh is at (bits 9:8 come first).
+ */
+int lcd_read_scanline(int fd, uint16_t *line)
+{
+	uint8_t rx[2];
+	if (transfer_rd_d(fd, sizeof(rx), 0x45, rx))
+		return -1;
+	*line = (rx[0] & 0x03) << 8 | rx[1];
 	return 0;
 }
 
@@ -164,6 +198,30 @@ static void touch_calculate_pos(uint16_t input, uint16_t *val, uint16_t max)
 	*val = floor(temp + 0.5f); 
 }
 
+/*
+ * Maps position measured in panel native orientation to logical one, see
+ * lcd_madctl.
+ */
+static void touch_rotate_pos(uint16_t *x, uint16_t *y)
+{
+	uint16_t tx = *x < LENGTH_MAX ? *x : LENGTH_MAX - 1;
+	uint16_t ty = *y < HEIGHT_MAX ? *y : HEIGHT_MAX - 1;
+	switch (lcd_panel.rotation) {
+	case 90:
+		*x = ty;
+		*y = LENGTH_MAX - 1 - tx;
+		break;
+	case 180:
+		*x = LENGTH_MAX - 1 - tx;
+		*y = HEIGHT_MAX - 1 - ty;
+		break;
+	case 270:
+		*x = HEIGHT_MAX - 1 - ty;
+		*y = tx;
+		break;
+	}
+}
+
 static void lcd_init_touchscreen(int fd)
 {
 	struct cmd_input inp = {
@@ -220,37 +278,79 @@ int lcd_read_touchscreen(int fd, uint16_t *x, uint16_t *y, uint16_t *z)
 	value = 2050 - value;
 	*z = (*z + value)/2;
 	touch_calculate_pos(*z, z, LENGTH_MAX);
+	touch_rotate_pos(x, y);
 	return 0;
 }
 
-static void lcd_init(int fd, int fd_touch)
+/*
+ * MADCTL values for rotations 0, 90, 180 and 270: row/column exchange (MV)
+ * with mirroring (MX, MY), BGR order is kept in all of them.
+ */
+static uint8_t lcd_madctl(uint16_t rotation)
+{
+	switch (rotation) {
+	case 90:
+		return 0b01101000;
+	case 180:
+		return 0b11001000;
+	case 270:
+		return 0b10101000;
+	default:
+		return 0b00001000;
+	}
+}
+
+/*
+ * Display status (RDDST) and pixel format (RDDCOLMOD) tell whether the
+ * panel is awake and takes 16 bit pixels already, as it does when the
+ * daemon is restarted.
+ */
+static int lcd_ready(int fd)
+{
+	uint8_t status[4] = {0}, format[1] = {0};
+	if (transfer_rd_d(fd, sizeof(status), 0x09, status) ||
+	    transfer_rd_d(fd, sizeof(format), 0x0C, format))
+		return 0;
+	return status[1] & LCD_STATUS_SLEEP_OUT && 
+	       status[2] & LCD_STATUS_DISPLAY_ON && 
+	       (format[0] & LCD_COLMOD_MASK) == LCD_COLMOD_16BIT;
+}
+
+/*
+ * Only the waits the datasheet asks for are kept: 120 ms from reset to
+ * Sleep Out and 5 ms after Sleep Out. A panel which is ready is not reset
+ * at all, the rest of the setup takes no waiting.
+ */
+static int lcd_init(int fd, int fd_touch)
 {
 	struct timespec req;
-	/*Reset*/
-	transfer_wr_cmd(fd, 0x01);
+	int ready = lcd_ready(fd);
 	req.tv_sec = 0;
-	req.tv_nsec = 120000000; 
-	nanosleep(&req, NULL);
-	/*Display ON*/
-	transfer_wr_cmd(fd, 0x29);
-	/*Display sleep out*/
-	transfer_wr_cmd(fd, 0x11);
-	req.tv_nsec = 5000000; 
-	nanosleep(&req, NULL);
+	if (!ready) {
+		/*Reset*/
+		transfer_wr_cmd(fd, 0x01);
+		req.tv_nsec = 120000000; 
+		nanosleep(&req, NULL);
+		/*Display sleep out*/
+		transfer_wr_cmd(fd, 0x11);
+		req.tv_nsec = 5000000; 
+		nanosleep(&req, NULL);
+	}
 	/*Pixel format set - 16bits/pixel*/
 	transfer_wr_cmd_data(fd, 2, 0x3A, 0x55);
-	/*RGB-BGR Order*/
-	transfer_wr_cmd_data(fd, 2, 0x36, 0b00001000);
-	req.tv_nsec = 120000000;
-	nanosleep(&req, NULL);
+	/*RGB-BGR Order, orientation*/
+	transfer_wr_cmd_data(fd, 2, 0x36, lcd_madctl(lcd_panel.rotation));
+	lcd_panel.window.valid = 0;
 	/*Brightness control block on*/
 	transfer_wr_cmd_data(fd, 2, 0x53, 0x2C);
-	nanosleep(&req, NULL); 
 	/*Display brightness - 0xff*/
 	transfer_wr_cmd_data(fd, 2, 0x51, 0x12);
-	nanosleep(&req, NULL);
 	lcd_set_LUT(fd);	
-	lcd_init_touchscreen(fd_touch);
+	/*Display ON*/
+	transfer_wr_cmd(fd, 0x29);
+	if (fd_touch >= 0)
+		lcd_init_touchscreen(fd_touch);
+	return ready;
 }
 
 static inline void lcd_create_bytes(uint16_t value, uint8_t *older, uint8_t *younger)
@@ -262,9 +362,8 @@ static inline void lcd_create_bytes(uint16_t value, uint8_t *older, uint8_t *you
 
 static void lcd_draw(int fd, uint8_t *tx, uint8_t *rx, uint32_t mem_size)
 {
-	const uint32_t single_wr_max = TOT_MEM_SIZE;
+	const uint32_t single_wr_max = spi_queue_chunk();
 	uint32_t written = 0;
-	transfer_wr_cmd(fd, 0x2C);
 	while (mem_size >= single_wr_max) {
 		transfer_wr_data(fd, &tx[written], single_wr_max);
 		written += single_wr_max;
@@ -274,16 +373,42 @@ static void lcd_draw(int fd, uint8_t *tx, uint8_t *rx, uint32_t mem_size)
 	transfer_wr_data(fd, &tx[written], mem_size);
 }
 
+/*
+ * Column and page addresses stay in controller until changed, so only
+ * the ones differing from previous window are sent. Every window is added
+ * to panel damage, and its RAMWR and pixels are expected next by queue.
+ * While a frame is composed windows are only added to its area.
+ */
 static void lcd_set_rectangle(int fd, uint16_t x, uint16_t y, uint16_t length,
 			      uint16_t height)
 {
+	struct lcd_window *win = &lcd_panel.window;
+	struct lcd_rect rect = {x, y, x + length, y + height};
 	uint8_t byte[4];
-	lcd_create_bytes(x, &byte[0], &byte[1]);
-	lcd_create_bytes(x + length - 1, &byte[2], &byte[3]);
-	transfer_wr_cmd_data(fd, 5, 0x2A, byte[0], byte[1], byte[2], byte[3]);
-	lcd_create_bytes(y, &byte[0], &byte[1]);
-	lcd_create_bytes(y + height - 1, &byte[2], &byte[3]);
-	transfer_wr_cmd_data(fd, 5, 0x2B, byte[0], byte[1], byte[2], byte[3]);
+	lcd_rect_union(&lcd_panel.damage, &rect);
+	if (lcd_panel.compose) {
+		lcd_rect_union(&lcd_panel.frame, &rect);
+		return;
+	}
+	lcd_frame_sent(&rect);
+	if (!win->valid || win->x0 != x || win->x1 != x + length - 1) {
+		lcd_create_bytes(x, &byte[0], &byte[1]);
+		lcd_create_bytes(x + length - 1, &byte[2], &byte[3]);
+		transfer_wr_cmd_data(fd, 5, 0x2A, byte[0], byte[1], byte[2], 
+				     byte[3]);
+	}
+	if (!win->valid || win->y0 != y || win->y1 != y + height - 1) {
+		lcd_create_bytes(y, &byte[0], &byte[1]);
+		lcd_create_bytes(y + height - 1, &byte[2], &byte[3]);
+		transfer_wr_cmd_data(fd, 5, 0x2B, byte[0], byte[1], byte[2], 
+				     byte[3]);
+	}
+	win->x0 = x;
+	win->x1 = x + length - 1;
+	win->y0 = y;
+	win->y1 = y + height - 1;
+	win->valid = 1;
+	spi_queue_window(fd, x, y, length, height);
 }
 
 static int lcd_colour_test(const uint8_t red, const uint8_t green, const 
@@ -313,91 +438,259 @@ static inline void lcd_color_prepare(const uint8_t red, const uint8_t green,
 	*(tx + 1) = second;
 }
 
-static int lcd_fill_rect_with_colour(uint8_t *tx, const uint32_t mem_size, 
-				     const uint8_t red, const uint8_t green,
-				     const uint8_t blue)
+static inline void lcd_fill_pixels(uint8_t *mem, uint16_t colour, 
+				   uint16_t cnt)
 {
-	if (lcd_colour_test(red, green, blue))
-		return 1;
-	for (uint32_t i = 0; i < mem_size; i += BY_PER_PIX) 
-		lcd_color_prepare(red, green, blue, &tx[i]);
+	uint64_t wide = colour * 0x0001000100010001ULL;
+	while (cnt >= 4) {
+		memcpy(mem, &wide, sizeof(wide));
+		mem += sizeof(wide);
+		cnt -= 4;
+	}
+	while (cnt--) {
+		memcpy(mem, &colour, sizeof(colour));
+		mem += sizeof(colour);
+	}
+}
+
+static __thread lcd_preempt_fn lcd_preempt;
+
+void lcd_set_preempt(lcd_preempt_fn fn)
+{
+	lcd_preempt = fn;
+}
+
+/*
+ * Offers the panel to more urgent drawing in the middle of a long write.
+ * Returns 1 when anything was drawn, the writer has to open the rest of
+ * its window again then.
+ */
+static inline int lcd_preempt_point(const struct lcd_rect *keep)
+{
+	return lcd_preempt && lcd_preempt(keep);
+}
+
+/*
+ * Sends rows of screen record, the window is already open. Full width
+ * rows are contiguous in the record, other ones are gathered in chunks.
+ */
+static void lcd_flush_rows(int fd, uint16_t x, uint16_t y, uint16_t dx, 
+			   uint16_t dy)
+{
+	static __thread uint8_t chunk[LCD_CHUNK_SIZE];
+	const uint32_t row_size = dx * BY_PER_PIX;
+	uint16_t rows, row = 0;
+	if (dx == lcd_panel.width) {
+		lcd_draw(fd, lcd_fb_pos(0, y), NULL, row_size * dy);
+		return;
+	}
+	rows = spi_queue_chunk() / row_size;
+	while (row < dy) {
+		uint16_t cnt = dy - row < rows ? dy - row : rows;
+		for (uint16_t i = 0; i < cnt; i++)
+			memcpy(&chunk[i * row_size], lcd_fb_pos(x, y + row + i),
+			       row_size);
+		transfer_wr_data(fd, chunk, cnt * row_size);
+		row += cnt;
+	}
+}
+
+/*
+ * Streams open windows their payload is still to fill, it may end early;
+ * covered windows are dropped only once such a window is complete.
+ * Flushes of screen record always send the whole window, so they commit
+ * it at once.
+ */
+static inline void lcd_open_window(int fd, uint16_t x, uint16_t y, 
+				   uint16_t dx, uint16_t dy)
+{
+	lcd_set_rectangle(fd, x, y, dx, dy);
+	transfer_wr_cmd(fd, 0x2C);
+}
+
+static inline void lcd_flush_window(int fd, uint16_t x, uint16_t y, 
+				    uint16_t dx, uint16_t dy)
+{
+	lcd_set_rectangle(fd, x, y, dx, dy);
+	spi_queue_commit(fd);
+	transfer_wr_cmd(fd, 0x2C);
+}
+
+/*
+ * Sends window of screen record to panel, in bands of LCD_BULK_SIZE.
+ * Drawing done between bands updates the record first, so the rest of
+ * the window is sent as it is then. Bands of large windows wait for the
+ * refresh beam when racing it.
+ */
+void lcd_flush_rect(int fd, uint16_t x, uint16_t y, uint16_t dx, 
+		    uint16_t dy)
+{
+	const uint32_t row_size = dx * BY_PER_PIX;
+	uint16_t band, cnt, row = 0;
+	uint8_t paced, reopen;
+	if (!dx || !dy)
+		return;
+	band = LCD_BULK_SIZE / row_size;
+	paced = lcd_beam_paced(dx, dy);
+	if (paced)
+		lcd_beam_race(fd, x, y, dx, dy < band ? dy : band);
+	lcd_flush_window(fd, x, y, dx, dy);
+	while (row < dy) {
+		cnt = dy - row < band ? dy - row : band;
+		lcd_flush_rows(fd, x, y + row, dx, cnt);
+		row += cnt;
+		if (row == dy)
+			break;
+		reopen = lcd_preempt_point(NULL);
+		if (paced)
+			reopen |= lcd_beam_race(fd, x, y + row, dx, 
+						dy - row < band ? dy - row : band);
+		if (reopen)
+			lcd_flush_window(fd, x, y + row, dx, dy - row);
+	}
+}
+
+void lcd_set_view(const struct lcd_rect *view)
+{
+	lcd_panel.clip = view != NULL;
+	if (view) {
+		lcd_panel.view = *view;
+		return;
+	}
+	lcd_panel.view.x0 = 0;
+	lcd_panel.view.y0 = 0;
+	lcd_panel.view.x1 = lcd_panel.width;
+	lcd_panel.view.y1 = lcd_panel.height;
+}
+
+/*
+ * Part of the view covered by a draw, on screen. In a viewport the draw
+ * may be at most the size of the screen.
+ */
+int lcd_view_rect(uint16_t x, uint16_t y, uint16_t dx, uint16_t dy, 
+		  struct lcd_rect *rect)
+{
+	const struct lcd_rect *view = &lcd_panel.view;
+	uint32_t x0 = view->x0 + x, y0 = view->y0 + y;
+	if (lcd_panel.clip ? dx > lcd_panel.width || dy > lcd_panel.height :
+	    x + dx > lcd_panel.width || y + dy > lcd_panel.height) {
+		errno = EINVAL;
+		return -1;
+	}
+	rect->x0 = x0 < view->x1 ? x0 : view->x1;
+	rect->y0 = y0 < view->y1 ? y0 : view->y1;
+	rect->x1 = x0 + dx < view->x1 ? x0 + dx : view->x1;
+	rect->y1 = y0 + dy < view->y1 ? y0 + dy : view->y1;
 	return 0;
 }
 
+/*
+ * Fills rectangle in screen record only, caller sends it.
+ */
+void lcd_fill_rect(uint16_t x, uint16_t y, uint16_t dx, uint16_t dy,
+		   uint16_t colour)
+{
+	for (uint16_t i = 0; i < dy; i++)
+		lcd_fill_pixels(lcd_fb_pos(x, y + i), colour, dx);
+}
+
 int lcd_draw_rectangle(int fd, uint16_t x, uint16_t y, uint16_t length, 
 		       uint16_t height, uint8_t red, uint8_t green, 
 		       uint8_t blue)
 {
-	uint8_t *tx;
-	uint32_t mem_size;
-	if (x + length > LENGTH_MAX) {
-		errno = EINVAL;
+	struct lcd_rect rect;
+	uint16_t colour;
+	if (lcd_view_rect(x, y, length, height, &rect))
 		return -1;
-	} else if (y + height > HEIGHT_MAX) {
+	if (lcd_colour_test(red, green, blue)) {
 		errno = EINVAL;
 		return -1;
 	}
-	mem_size = BY_PER_PIX * height * length;
-	tx = malloc(mem_size);
-	if (check_clean_mem(tx, NULL, 0)) {
-		errno = ENOMEM;
-		return -1;
-	}
-	lcd_set_rectangle(fd, x, y, length, height);
-	if (lcd_fill_rect_with_colour(tx, mem_size, red, green, blue)) {
-		free(tx);
-		errno = EINVAL;
-		return -1;
-	}
-	lcd_draw(fd, tx, NULL, mem_size);
-	free(tx);
+	lcd_color_prepare(red, green, blue, (uint8_t *)&colour);
+	length = rect.x1 - rect.x0;
+	height = rect.y1 - rect.y0;
+	lcd_fill_rect(rect.x0, rect.y0, length, height, colour);
+	lcd_flush_rect(fd, rect.x0, rect.y0, length, height);
 	return 0;
 }
 
-static inline void lcd_set_pos(uint8_t **mem, struct ipc_buffer *buf, 
-			       uint8_t line_cnt, uint8_t mode)
+/*
+ * Spans are written to screen record at once, their bounding box is sent
+ * later. Next span joins the box as long as the extra pixels cost less
+ * than opening another window (LCD_WINDOW_COST pixels).
+ */
+struct lcd_span_area {
+	int x0;
+	int x1;
+	int y0;
+	int y1;
+	uint8_t pending;
+};
+
+static __thread struct lcd_span_area lcd_spans;
+
+void lcd_span_flush(int fd)
 {
-	if (!mode) {
-		*mem += buf->x * BY_PER_PIX * FONT_X_LEN;
-		if (line_cnt)
-			*mem += FONT_Y_LEN * BY_PER_PIX * LENGTH_MAX * (line_cnt - 1);
-		*mem += (FONT_Y_LEN - 1) * BY_PER_PIX * LENGTH_MAX;
-	} else {
-		*mem += buf->x * BY_PER_PIX * FONT_X_LEN;
-		*mem += (HEIGHT_MAX - 1 - buf->y * FONT_Y_LEN) * BY_PER_PIX * LENGTH_MAX;
+	if (!lcd_spans.pending)
+		return;
+	lcd_flush_rect(fd, lcd_spans.x0, lcd_spans.y0, 
+		       lcd_spans.x1 - lcd_spans.x0 + 1,
+		       lcd_spans.y1 - lcd_spans.y0 + 1);
+	lcd_spans.pending = 0;
+}
+
+/*
+ * Adds span already in screen record to the box being sent, coordinates
+ * are on screen.
+ */
+void lcd_span_add(int fd, int x0, int x1, int y)
+{
+	struct lcd_span_area *area = &lcd_spans;
+	int nx0, nx1, ny0, ny1;
+	uint32_t merged, separate;
+	if (area->pending) {
+		nx0 = x0 < area->x0 ? x0 : area->x0;
+		nx1 = x1 > area->x1 ? x1 : area->x1;
+		ny0 = y < area->y0 ? y : area->y0;
+		ny1 = y > area->y1 ? y : area->y1;
+		merged = (nx1 - nx0 + 1) * (ny1 - ny0 + 1);
+		separate = (area->x1 - area->x0 + 1) * 
+			   (area->y1 - area->y0 + 1) + x1 - x0 + 1 + 
+			   LCD_WINDOW_COST;
+		if (merged <= separate) {
+			area->x0 = nx0;
+			area->x1 = nx1;
+			area->y0 = ny0;
+			area->y1 = ny1;
+			return;
+		}
+		lcd_span_flush(fd);
 	}
+	area->x0 = x0;
+	area->x1 = x1;
+	area->y0 = y;
+	area->y1 = y;
+	area->pending = 1;
 }
 
-static int lcd_colorize_text(uint8_t *mem, enum colors color)
+/*
+ * Span coordinates are relative to the view, it is clipped to it.
+ */
+void lcd_span(int fd, int x0, int x1, int y, uint16_t colour)
 {
-	switch(color) {
-	case black:
-		lcd_color_prepare(0, 0, 0, mem);
-		return 0;
-	case white:
-		lcd_color_prepare(31, 63, 31, mem);
-		return 0;
-	case red:
-	       lcd_color_prepare(31, 0, 0, mem);
-		return 0;
-	case blue:
-		lcd_color_prepare(0, 0, 31, mem);
-		return 0;
-	case yellow:
-		lcd_color_prepare(31, 63, 0, mem);
-		return 0;
-	case green:
-		lcd_color_prepare(0, 63, 0, mem);
-		return 0;
-	case brown:
-		lcd_color_prepare(31, 31, 0, mem);
-		return 0;
-	case background:
-		return 0;
-	default:
-		return -1;
-	}		
-	return -1;	
+	if (y < 0 || y >= lcd_view_height())
+		return;
+	if (x0 < 0)
+		x0 = 0;
+	if (x1 >= lcd_view_width())
+		x1 = lcd_view_width() - 1;
+	x0 += lcd_panel.view.x0;
+	x1 += lcd_panel.view.x0;
+	y += lcd_panel.view.y0;
+	if (x0 > x1)
+		return;
+	lcd_fill_pixels(lcd_fb_pos(x0, y), colour, x1 - x0 + 1);
+	lcd_span_add(fd, x0, x1, y);
 }
 
 int lcd_return_colors(enum colors color, uint8_t *red_p, uint8_t *green_p,
@@ -448,157 +741,704 @@ int lcd_return_colors(enum colors color, uint8_t *red_p, uint8_t *green_p,
 	return -1;	
 }
 
-static int lcd_put_text(uint8_t const *mem, struct ipc_buffer *buf, 
-			uint8_t line_cnt, const uint8_t mode)
-{
-	unsigned char *temp;
-	char sign;
-	uint8_t *temp_mem = (uint8_t *)mem;
-	lcd_set_pos(&temp_mem, buf, line_cnt, mode);
-	for (uint16_t i = 0; i < buf->dx; i++) {
-		sign = buf->mem[i];
-		temp = &Font5x7[(sign - 32)*5];
-		for (uint8_t it = 0; it < 5; it++) {
-			if (*temp) {
-				for (uint8_t itt = 0; itt < 8; itt++) {
-					if (*temp & (1 << itt)) {
-						lcd_colorize_text(temp_mem, buf->dy >> 8);
-					} else {
-						lcd_colorize_text(temp_mem, buf->dy & 0xff);
+static inline uint8_t lcd_text_scale(struct ipc_buffer *buf)
+{
+	uint8_t scale = buf->dy >> TEXT_SCALE_SHIFT;
+	return scale ? scale : 1;
+}
+
+static int lcd_text_colour(enum colors color, uint16_t *colour, 
+			   uint8_t *transparent)
+{
+	uint8_t red = 0, green = 0, blue = 0;
+	*transparent = (color == background);
+	if (lcd_return_colors(color, &red, &green, &blue))
+		return -1;
+	lcd_color_prepare(red, green, blue, (uint8_t *)colour);
+	return 0;
+}
+
+static inline const unsigned char *lcd_glyph(char sign)
+{
+	const int glyph_cnt = sizeof(Font5x7) / FONT_X_LEN;
+	if (sign < 32 || sign - 32 >= glyph_cnt)
+		sign = ' ';
+	return &Font5x7[(sign - 32) * FONT_X_LEN];
+}
+
+/*
+ * Expands n glyphs of one text line into mem, pitch bytes per pixel row.
+ * Every glyph bit becomes scale x scale pixels; a row of the glyph is
+ * built once and copied to the remaining scale - 1 rows when both colours
+ * are opaque.
+ */
+static void lcd_put_text_scaled(uint8_t *mem, uint32_t pitch, const char *text,
+				uint16_t n, uint8_t scale, uint16_t fg, 
+				uint16_t bg, uint8_t fg_transparent, 
+				uint8_t bg_transparent)
+{
+	const uint32_t row_size = n * FONT_X_LEN * scale * BY_PER_PIX;
+	for (uint8_t gy = 0; gy < FONT_Y_LEN; gy++) {
+		const uint8_t bit = 1 << (FONT_Y_LEN - 1 - gy);
+		uint8_t *row = mem + gy * scale * pitch;
+		uint8_t rows = bg_transparent || fg_transparent ? scale : 1;
+		for (uint8_t r = 0; r < rows; r++) {
+			uint8_t *px = row + r * pitch;
+			for (uint16_t i = 0; i < n; i++) {
+				const unsigned char *glyph = lcd_glyph(text[i]);
+				for (uint8_t gx = 0; gx < FONT_X_LEN; gx++) {
+					if (glyph[gx] & bit) {
+						if (!fg_transparent)
+							lcd_fill_pixels(px, fg, scale);
+					} else if (!bg_transparent) {
+						lcd_fill_pixels(px, bg, scale);
 					}
-					temp_mem -= LENGTH_MAX * BY_PER_PIX;
-				}
-			} else {
-				for (uint8_t itt = 0; itt < 8; itt++) {
-					lcd_colorize_text(temp_mem, buf->dy & 0xff);
-					temp_mem -= LENGTH_MAX * BY_PER_PIX;
+					px += scale * BY_PER_PIX;
 				}
 			}
-			temp_mem += FONT_Y_LEN * LENGTH_MAX * BY_PER_PIX;
-			temp_mem += BY_PER_PIX;
-			temp++;
 		}
-		buf->x++;
-		if (buf->x >= LENGTH_MAX / FONT_X_LEN) {
-			temp_mem = (uint8_t *)mem;
-			buf->x = 0;
-			buf->y++;
-			if (buf->y == HEIGHT_MAX / FONT_Y_LEN)
-				buf->y = 0;
-			line_cnt--;
-			lcd_set_pos(&temp_mem, buf, line_cnt, mode);
+		for (uint8_t r = rows; r < scale; r++)
+			memcpy(row + r * pitch, row, row_size);
+	}
+}
+
+/* one cell of the largest text */
+#define LCD_TEXT_CELL_SIZE (FONT_X_LEN * FONT_Y_LEN * TEXT_SCALE_MAX * \
+			    TEXT_SCALE_MAX * BY_PER_PIX)
+
+/*
+ * Line of text is rendered in place, cell by cell, over screen record; a
+ * copy of each cell taken before tells whether it changed. Only changed
+ * cells are sent. Runs of changed cells are sent as one window while the
+ * unchanged cells between them cost less than another window.
+ */
+static void lcd_text_line(int fd, uint16_t x, uint16_t y, const char *text,
+			  uint16_t n, uint8_t scale, uint16_t fg, uint16_t bg,
+			  uint8_t fg_transparent, uint8_t bg_transparent)
+{
+	static __thread uint8_t cell[LCD_TEXT_CELL_SIZE];
+	const uint16_t cell_x = FONT_X_LEN * scale;
+	const uint16_t cell_y = FONT_Y_LEN * scale;
+	const uint32_t cell_size = cell_x * BY_PER_PIX;
+	const uint32_t pitch = lcd_panel.width * BY_PER_PIX;
+	const uint16_t gap_max = LCD_WINDOW_COST / (cell_x * cell_y);
+	uint16_t first = 0, last = 0, changed = 0;
+	for (uint16_t i = 0; i < n; i++) {
+		uint8_t *pos = lcd_fb_pos(x + i * cell_x, y);
+		uint16_t r;
+		for (r = 0; r < cell_y; r++)
+			memcpy(&cell[r * cell_size], pos + r * pitch, cell_size);
+		lcd_put_text_scaled(pos, pitch, &text[i], 1, scale, fg, bg, 
+				    fg_transparent, bg_transparent);
+		r = 0;
+		while (r < cell_y && !memcmp(&cell[r * cell_size], 
+					     pos + r * pitch, cell_size))
+			r++;
+		if (r == cell_y)
+			continue;
+		if (changed && i - last - 1 > gap_max) {
+			lcd_flush_rect(fd, x + first * cell_x, y, 
+				       (last - first + 1) * cell_x, cell_y);
+			changed = 0;
 		}
+		if (!changed)
+			first = i;
+		last = i;
+		changed = 1;
 	}
-	return 0;
+	if (changed)
+		lcd_flush_rect(fd, x + first * cell_x, y, 
+			       (last - first + 1) * cell_x, cell_y);
 }
 
-void lcd_converse_colors(uint8_t *mem, uint8_t *mem_out, uint32_t size)
+static int lcd_draw_text_scaled(int fd, struct ipc_buffer *buf, uint8_t scale)
 {
-	uint8_t red, green, blue;
-	uint32_t i_out = 0;
-	for (uint32_t i = 0; i < size; i += 3) {
-		red = mem[i] >> 3;
-		green = mem[i + 1] >> 2;
-		blue = mem[i + 2] >> 3;
-		lcd_color_prepare(red, green, blue, &mem_out[i_out]);	
-		i_out += 2;
+	const uint16_t cell_x = FONT_X_LEN * scale;
+	const uint16_t cell_y = FONT_Y_LEN * scale;
+	const uint16_t cols = lcd_view_width() / cell_x;
+	const uint16_t rows = lcd_view_height() / cell_y;
+	uint16_t x = buf->x, y = buf->y, done = 0, fg, bg, n, area_y;
+	uint8_t fg_transparent, bg_transparent;
+	if (scale > TEXT_SCALE_MAX || x >= cols || y >= rows || 
+	    buf->dx > cols * rows) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (lcd_text_colour((buf->dy >> 8) & TEXT_COLOR_MASK, &fg, 
+			    &fg_transparent) ||
+	    lcd_text_colour(buf->dy & 0xff, &bg, &bg_transparent))
+		return -1;
+	while (done < buf->dx) {
+		n = buf->dx - done;
+		if (n > cols - x)
+			n = cols - x;
+		area_y = lcd_panel.view.y1 - cell_y * (y + 1);
+		lcd_text_line(fd, lcd_panel.view.x0 + x * cell_x, area_y, 
+			      (char *)&buf->mem[done],
+			      n, scale, fg, bg, fg_transparent, 
+			      bg_transparent);
+		done += n;
+		x = 0;
+		if (++y == rows)
+			y = 0;
 	}
+	return 0;
 }
 
-static inline int lcd_check_input(struct ipc_buffer *buf)
+/*
+ * Bounding box of the text on screen, whole view when it wraps to the
+ * top.
+ */
+int lcd_text_rect(struct ipc_buffer *buf, struct lcd_rect *rect)
 {
-	if (buf->x >= LENGTH_MAX / FONT_X_LEN) {
+	const struct lcd_rect *view = &lcd_panel.view;
+	const uint8_t scale = lcd_text_scale(buf);
+	const uint16_t cell_x = FONT_X_LEN * scale;
+	const uint16_t cell_y = FONT_Y_LEN * scale;
+	const uint16_t cols = lcd_view_width() / cell_x;
+	const uint16_t rows = lcd_view_height() / cell_y;
+	uint16_t lines;
+	if (scale > TEXT_SCALE_MAX || buf->x >= cols || buf->y >= rows) {
 		errno = EINVAL;
 		return -1;
-	} else if (buf->y >= HEIGHT_MAX / FONT_Y_LEN) {
+	}
+	memset(rect, 0, sizeof(*rect));
+	if (!buf->dx)
+		return 0;
+	lines = (buf->x + buf->dx + cols - 1) / cols;
+	if (buf->y + lines > rows) {
+		*rect = *view;
+		return 0;
+	}
+	rect->x0 = view->x0 + (lines == 1 ? buf->x * cell_x : 0);
+	rect->x1 = view->x0 + (lines == 1 ? (buf->x + buf->dx) * cell_x : 
+			       cols * cell_x);
+	rect->y0 = view->y1 - cell_y * (buf->y + lines);
+	rect->y1 = view->y1 - cell_y * buf->y;
+	return 0;
+}
+
+/*
+ * Every text line is rendered and sent on its own, so next line is
+ * rendered while previous one is on the wire.
+ */
+int lcd_draw_text(int fd, struct ipc_buffer *buf)
+{
+	return lcd_draw_text_scaled(fd, buf, lcd_text_scale(buf));
+}
+
+/*
+ * Stream rows are pitch pixels long, dx of them are shown. A clipped
+ * stream is only copied to screen record and rows are sent from there.
+ */
+struct lcd_stream {
+	uint16_t x;
+	uint16_t dx;
+	uint16_t pitch;
+	uint16_t row;
+	uint16_t row_end;
+	uint16_t flushed;
+	uint32_t offset;
+	uint8_t clipped;
+	uint8_t paced;
+};
+
+static __thread struct lcd_stream lcd_stream;
+
+/* rows of the next piece, at most left of them */
+static inline uint16_t lcd_stream_band(uint16_t left)
+{
+	const uint16_t band = LCD_BULK_SIZE / (lcd_stream.pitch * BY_PER_PIX);
+	return left < band ? left : band;
+}
+
+/*
+ * Opens memory write window, following lcd_stream_write calls fill it
+ * row by row and keep screen record up to date.
+ */
+
+int lcd_stream_begin(int fd, uint16_t x, uint16_t y, uint16_t dx, uint16_t dy)
+{
+	struct lcd_rect rect;
+	if (!dx || !dy) {
 		errno = EINVAL;
 		return -1;
-	} else if (buf->dx > (LENGTH_MAX / FONT_X_LEN) *
-		   (HEIGHT_MAX / FONT_Y_LEN)) {
+	}
+	if (lcd_view_rect(x, y, dx, dy, &rect))
+		return -1;
+	lcd_stream.x = rect.x0;
+	lcd_stream.dx = rect.x1 - rect.x0;
+	lcd_stream.pitch = dx;
+	lcd_stream.row = rect.y0;
+	lcd_stream.row_end = rect.y1;
+	lcd_stream.flushed = rect.y0;
+	lcd_stream.offset = 0;
+	lcd_stream.clipped = lcd_stream.dx != dx || rect.y1 - rect.y0 != dy;
+	lcd_stream.paced = lcd_beam_paced(lcd_stream.dx, rect.y1 - rect.y0);
+	if (lcd_stream.clipped)
+		return 0;
+	if (lcd_stream.paced)
+		lcd_beam_race(fd, rect.x0, rect.y0, dx, lcd_stream_band(dy));
+	lcd_open_window(fd, rect.x0, rect.y0, dx, dy);
+	return 0;
+}
+
+static void lcd_stream_piece(int fd, uint8_t *mem, uint32_t size)
+{
+	const uint32_t row_size = lcd_stream.pitch * BY_PER_PIX;
+	const uint32_t shown = lcd_stream.dx * BY_PER_PIX;
+	uint32_t done = 0, cnt;
+	while (done < size && lcd_stream.row < lcd_stream.row_end) {
+		cnt = row_size - lcd_stream.offset;
+		if (cnt > size - done)
+			cnt = size - done;
+		if (lcd_stream.offset < shown)
+			memcpy(lcd_fb_pos(lcd_stream.x, lcd_stream.row) + 
+			       lcd_stream.offset, mem + done, 
+			       cnt < shown - lcd_stream.offset ? 
+			       cnt : shown - lcd_stream.offset);
+		done += cnt;
+		lcd_stream.offset += cnt;
+		if (lcd_stream.offset == row_size) {
+			lcd_stream.offset = 0;
+			lcd_stream.row++;
+		}
+	}
+	if (!lcd_stream.clipped)
+		transfer_wr_data(fd, mem, size);
+}
+
+static void lcd_stream_flush(int fd)
+{
+	const uint16_t rows = lcd_stream.row - lcd_stream.flushed;
+	if (!lcd_stream.dx || !rows)
+		return;
+	if (lcd_stream.paced)
+		lcd_beam_race(fd, lcd_stream.x, lcd_stream.flushed, 
+			      lcd_stream.dx, rows);
+	lcd_flush_window(fd, lcd_stream.x, lcd_stream.flushed, lcd_stream.dx,
+			 rows);
+	lcd_flush_rows(fd, lcd_stream.x, lcd_stream.flushed, lcd_stream.dx,
+		       rows);
+	lcd_stream.flushed = lcd_stream.row;
+}
+
+/*
+ * Pixels are sent in pieces ending on a row, at most LCD_BULK_SIZE long.
+ * After every one more urgent drawing may run, as long as it stays off
+ * rows not streamed yet; streaming goes on in a window of those rows.
+ */
+void lcd_stream_write(int fd, uint8_t *mem, uint32_t size)
+{
+	const uint32_t row_size = lcd_stream.pitch * BY_PER_PIX;
+	const uint32_t band = LCD_BULK_SIZE / row_size;
+	struct lcd_rect keep;
+	uint32_t cnt;
+	uint8_t reopen;
+	while (size) {
+		cnt = row_size - lcd_stream.offset + (band - 1) * row_size;
+		if (cnt > size)
+			cnt = size;
+		lcd_stream_piece(fd, mem, cnt);
+		mem += cnt;
+		size -= cnt;
+		if (lcd_stream.offset)
+			continue;
+		if (lcd_stream.clipped)
+			lcd_stream_flush(fd);
+		if (lcd_stream.row == lcd_stream.row_end)
+			continue;
+		keep.x0 = lcd_stream.x;
+		keep.y0 = lcd_stream.row;
+		keep.x1 = lcd_stream.x + lcd_stream.dx;
+		keep.y1 = lcd_stream.row_end;
+		reopen = lcd_preempt_point(&keep);
+		if (lcd_stream.clipped)
+			continue;
+		if (lcd_stream.paced)
+			reopen |= lcd_beam_race(fd, keep.x0, keep.y0, 
+						lcd_stream.dx, lcd_stream_band(
+						keep.y1 - keep.y0));
+		if (reopen)
+			lcd_open_window(fd, keep.x0, keep.y0, lcd_stream.dx, 
+					keep.y1 - keep.y0);
+	}
+}
+
+int lcd_draw_bitmap(int fd, struct ipc_buffer *buf)
+{
+	if (lcd_stream_begin(fd, buf->x, buf->y, buf->dx, buf->dy))
+		return -1;
+	/* whole payload is in hand */
+	spi_queue_commit(fd);
+	lcd_stream_write(fd, buf->mem, BY_PER_PIX * buf->dx * buf->dy);
+	return 0;
+}
+
+/*
+ * RGBA bitmaps are blended into screen record row by row, only bounding
+ * box of pixels which were not fully transparent is sent at the end.
+ */
+struct lcd_rgba {
+	uint16_t x;
+	uint16_t dx;
+	uint16_t pitch;
+	uint16_t row;
+	uint16_t row_end;
+	uint16_t x0;
+	uint16_t x1;
+	uint16_t y0;
+	uint16_t y1;
+};
+
+static __thread struct lcd_rgba lcd_rgba;
+
+int lcd_rgba_begin(uint16_t x, uint16_t y, uint16_t dx, uint16_t dy)
+{
+	struct lcd_rect rect;
+	if (!dx || !dy) {
 		errno = EINVAL;
 		return -1;
 	}
+	if (lcd_view_rect(x, y, dx, dy, &rect))
+		return -1;
+	lcd_rgba.x = rect.x0;
+	lcd_rgba.dx = rect.x1 - rect.x0;
+	lcd_rgba.pitch = dx;
+	lcd_rgba.row = rect.y0;
+	lcd_rgba.row_end = rect.y1;
+	lcd_rgba.x0 = rect.x1;
+	lcd_rgba.x1 = rect.x0;
+	lcd_rgba.y0 = rect.y1;
+	lcd_rgba.y1 = rect.y0;
 	return 0;
 }
 
-static uint32_t lcd_set_text_area(int fd, struct ipc_buffer *buf, 
-				  uint8_t *line_cnt, uint8_t *mode)
+void lcd_rgba_write(const uint8_t *mem, uint16_t rows)
 {
-	uint16_t x = 0, y = 0, dx = 0, dy = 0;
-	uint32_t pix_cnt;
-	*mode = 0;
-	if (buf->x + buf->dx > LENGTH_MAX / FONT_X_LEN) {
-		x = 0;
-		*line_cnt = (buf->x + buf->dx) / (LENGTH_MAX / FONT_X_LEN) + 1;
-		if (buf->y + *line_cnt > HEIGHT_MAX / FONT_Y_LEN) {
-			x = 0;
-			y = 0;
-			dx = LENGTH_MAX;
-			dy = HEIGHT_MAX;
-			pix_cnt = dx * dy;
-			*mode = 1;
-		} else {
-			dx = LENGTH_MAX;
-			dy = FONT_Y_LEN * *line_cnt;
-			y = HEIGHT_MAX - FONT_Y_LEN * (buf->y + *line_cnt);
-			pix_cnt = dy * LENGTH_MAX;
+	uint16_t first, end;
+	for (; rows && lcd_rgba.row < lcd_rgba.row_end; rows--) {
+		rgba_blend_row(lcd_fb_pos(lcd_rgba.x, lcd_rgba.row), mem, 
+			       lcd_rgba.dx, &first, &end);
+		if (end > first) {
+			if (lcd_rgba.x + first < lcd_rgba.x0)
+				lcd_rgba.x0 = lcd_rgba.x + first;
+			if (lcd_rgba.x + end > lcd_rgba.x1)
+				lcd_rgba.x1 = lcd_rgba.x + end;
+			if (lcd_rgba.row < lcd_rgba.y0)
+				lcd_rgba.y0 = lcd_rgba.row;
+			lcd_rgba.y1 = lcd_rgba.row + 1;
 		}
-	} else {
-		x = 0;	
-		y = HEIGHT_MAX - FONT_Y_LEN * (buf->y + 1);
-		dx = LENGTH_MAX;
-		dy = FONT_Y_LEN;
-		pix_cnt = dx * dy; 
-		*line_cnt = 0;
+		mem += lcd_rgba.pitch * RGBA_BY_PER_PIX;
+		lcd_rgba.row++;
 	}
-	lcd_set_rectangle(fd, x, y, dx, dy);
-	return pix_cnt;
 }
 
-int lcd_draw_text(int fd, struct ipc_buffer *buf)
+void lcd_rgba_end(int fd)
 {
-	uint8_t *mem, *mem_out, line_cnt, mode;
-	uint32_t pix_cnt;
-	if (lcd_check_input(buf))
+	if (lcd_rgba.x1 > lcd_rgba.x0)
+		lcd_flush_rect(fd, lcd_rgba.x0, lcd_rgba.y0, 
+			       lcd_rgba.x1 - lcd_rgba.x0, 
+			       lcd_rgba.y1 - lcd_rgba.y0);
+}
+
+/*
+ * Moves pixels inside screen record and sends destination window only.
+ * Rows are walked against direction of the move, so overlapping areas
+ * are copied correctly.
+ */
+int lcd_copy_rect(int fd, uint16_t src_x, uint16_t src_y, uint16_t dx, 
+		  uint16_t dy, uint16_t dst_x, uint16_t dst_y)
+{
+	struct lcd_rect src, dst;
+	uint32_t row_size;
+	if (!dx || !dy) {
+		errno = EINVAL;
 		return -1;
-	pix_cnt = lcd_set_text_area(fd, buf, &line_cnt, &mode);
-	mem = malloc(pix_cnt * 3);
-	mem_out = malloc(pix_cnt * 2);
-	if ((!mem) || (!mem_out)) {
-		errno = ENOMEM;
+	}
+	if (lcd_view_rect(src_x, src_y, dx, dy, &src) || 
+	    lcd_view_rect(dst_x, dst_y, dx, dy, &dst))
 		return -1;
+	/* in a viewport both are clipped, pixels of either outside stay */
+	src_x = src.x0;
+	src_y = src.y0;
+	dst_x = dst.x0;
+	dst_y = dst.y0;
+	if (src.x1 - src.x0 < dx)
+		dx = src.x1 - src.x0;
+	if (dst.x1 - dst.x0 < dx)
+		dx = dst.x1 - dst.x0;
+	if (src.y1 - src.y0 < dy)
+		dy = src.y1 - src.y0;
+	if (dst.y1 - dst.y0 < dy)
+		dy = dst.y1 - dst.y0;
+	row_size = dx * BY_PER_PIX;
+	if (dst_y > src_y) {
+		for (uint16_t i = dy; i-- > 0; )
+			memmove(lcd_fb_pos(dst_x, dst_y + i), 
+				lcd_fb_pos(src_x, src_y + i), row_size);
+	} else {
+		for (uint16_t i = 0; i < dy; i++)
+			memmove(lcd_fb_pos(dst_x, dst_y + i), 
+				lcd_fb_pos(src_x, src_y + i), row_size);
 	}
-	transfer_rd_d(fd, pix_cnt * 3, 0x2E, mem);
-	lcd_converse_colors(mem, mem_out, pix_cnt * 3);
-	lcd_put_text(mem_out, buf, line_cnt, mode);
-	lcd_draw(fd, mem_out, NULL, pix_cnt * 2);
-	free(mem);
-	free(mem_out);
+	lcd_flush_rect(fd, dst_x, dst_y, dx, dy);
 	return 0;
 }
 
-int lcd_draw_bitmap(int fd, struct ipc_buffer *buf)
+struct lcd_palette {
+	uint16_t colour[PALETTE_SIZE];
+	uint16_t cnt;
+	uint8_t lut_bpp;
+	/* one packed byte expanded to 8 / lut_bpp pixels */
+	uint16_t lut[256][8];
+};
+
+static __thread struct lcd_palette lcd_palettes[PALETTE_CNT];
+
+int lcd_upload_palette(struct ipc_buffer *buf)
 {
-	if (buf->x + buf->dx > LENGTH_MAX) {
+	struct lcd_palette *pal;
+	if (buf->x >= PALETTE_CNT || !buf->dx || buf->dx > PALETTE_SIZE) {
 		errno = EINVAL;
 		return -1;
-	} else if (buf->y + buf->dy > HEIGHT_MAX) {
+	}
+	pal = &lcd_palettes[buf->x];
+	memset(pal->colour, 0, sizeof(pal->colour));
+	memcpy(pal->colour, buf->mem, buf->dx * BY_PER_PIX);
+	pal->cnt = buf->dx;
+	pal->lut_bpp = 0;
+	return 0;
+}
+
+static void lcd_palette_build_lut(struct lcd_palette *pal, uint8_t bpp)
+{
+	const uint8_t mask = (1 << bpp) - 1;
+	const uint8_t per_byte = 8 / bpp;
+	if (pal->lut_bpp == bpp)
+		return;
+	for (uint16_t byte = 0; byte < 256; byte++)
+		for (uint8_t i = 0; i < per_byte; i++)
+			pal->lut[byte][i] = pal->colour[(byte >> (8 - bpp * (i + 1)))
+							& mask];
+	pal->lut_bpp = bpp;
+}
+
+static void lcd_expand_indexed_row(struct lcd_palette *pal, const uint8_t *in,
+				   uint8_t *out, uint16_t dx, uint8_t bpp)
+{
+	const uint8_t per_byte = 8 / bpp;
+	uint16_t full = dx / per_byte;
+	uint16_t rest = dx % per_byte;
+	if (bpp == 8) {
+		for (uint16_t i = 0; i < dx; i++)
+			memcpy(&out[i * BY_PER_PIX], &pal->colour[in[i]], 
+			       BY_PER_PIX);
+		return;
+	}
+	for (uint16_t i = 0; i < full; i++) {
+		memcpy(out, pal->lut[in[i]], per_byte * BY_PER_PIX);
+		out += per_byte * BY_PER_PIX;
+	}
+	if (rest)
+		memcpy(out, pal->lut[in[full]], rest * BY_PER_PIX);
+}
+
+int lcd_draw_bitmap_indexed(int fd, struct ipc_buffer *buf, 
+			    struct ipc_indexed *idx)
+{
+	static __thread uint8_t chunk[LCD_CHUNK_SIZE];
+	const uint32_t row_in = INDEXED_ROW_SIZE(buf->dx, idx->bpp);
+	const uint32_t row_out = BY_PER_PIX * buf->dx;
+	struct lcd_palette *pal;
+	uint16_t rows, row = 0;
+	if (idx->bpp != 1 && idx->bpp != 2 && idx->bpp != 4 && idx->bpp != 8) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (idx->palette >= PALETTE_CNT) {
 		errno = EINVAL;
 		return -1;
 	}
-	lcd_set_rectangle(fd, buf->x, buf->y, buf->dx, buf->dy);
-	lcd_draw(fd, buf->mem, NULL, BY_PER_PIX*buf->dx*buf->dy);
+	pal = &lcd_palettes[idx->palette];
+	if (!pal->cnt) {
+		errno = ENOENT;
+		return -1;
+	}
+	if (lcd_stream_begin(fd, buf->x, buf->y, buf->dx, buf->dy))
+		return -1;
+	if (idx->bpp != 8)
+		lcd_palette_build_lut(pal, idx->bpp);
+	rows = spi_queue_chunk() / row_out;
+	while (row < buf->dy) {
+		uint16_t cnt = buf->dy - row < rows ? buf->dy - row : rows;
+		for (uint16_t i = 0; i < cnt; i++)
+			lcd_expand_indexed_row(pal, &buf->mem[(row + i) * row_in],
+					       &chunk[i * row_out], buf->dx,
+					       idx->bpp);
+		lcd_stream_write(fd, chunk, cnt * row_out);
+		row += cnt;
+	}
 	return 0;
 }
 
 int lcd_clear_background(int fd) 
 {
-	return lcd_draw_rectangle(fd, 0, 0, LENGTH_MAX, HEIGHT_MAX, 0, 
-				  0, 0);
+	return lcd_draw_rectangle(fd, 0, 0, lcd_panel.width, lcd_panel.height,
+				  0, 0, 0);
 }
 
+static inline int lcd_check_rotation(uint16_t rotation)
+{
+	return rotation == 0 || rotation == 90 || rotation == 180 ||
+	       rotation == 270;
+}
+
+/*
+ * Rotation is done by panel controller, only logical geometry changes
+ * here.
+ */
+static void lcd_set_geometry(int fd, uint16_t rotation)
+{
+	lcd_panel.rotation = rotation;
+	if (rotation == 90 || rotation == 270) {
+		lcd_panel.width = HEIGHT_MAX;
+		lcd_panel.height = LENGTH_MAX;
+	} else {
+		lcd_panel.width = LENGTH_MAX;
+		lcd_panel.height = HEIGHT_MAX;
+	}
+	lcd_set_view(NULL);
+	transfer_wr_cmd_data(fd, 2, 0x36, lcd_madctl(rotation));
+	spi_queue_barrier(fd);
+	lcd_dedup_reset();
+	lcd_panel.window.valid = 0;
+	lcd_state_rotation(rotation);
+}
 
-int switch_to_daemon(int fd_lcd, int fd_touch)
+/*
+ * Content drawn in previous orientation is cleared.
+ */
+int lcd_set_orientation(int fd, uint16_t rotation)
+{
+	if (!lcd_check_rotation(rotation)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (lcd_panel.compose) {
+		errno = EBUSY;
+		return -1;
+	}
+	lcd_set_geometry(fd, rotation);
+	return lcd_clear_background(fd);
+}
+
+/*
+ * Called by thread which is going to drive the panel, rendering state of
+ * the panel belongs to that thread. Record kept by previous daemon is
+ * what the panel shows, unless the panel had to be reset or that daemon
+ * did not finish cleanly; it is sent again then instead of clearing.
+ */
+int lcd_panel_start(int fd, int fd_touch, uint16_t rotation, uint8_t display)
+{
+	enum lcd_state_found found;
+	int ready;
+	lcd_panel.fb = lcd_state_open(display, rotation, &found);
+	if (!lcd_panel.fb)
+		return -1;
+	/* a panel showing the record must not flip even for a moment */
+	lcd_panel.rotation = rotation;
+	ready = lcd_init(fd, fd_touch);
+	if (found == LCD_STATE_NONE) {
+		lcd_set_orientation(fd, rotation);
+	} else {
+		lcd_set_geometry(fd, rotation);
+		if (!ready || found == LCD_STATE_STALE)
+			lcd_flush_rect(fd, 0, 0, lcd_panel.width, 
+				       lcd_panel.height);
+	}
+	return spi_queue_start(fd);
+}
+
+static void lcd_close_panels(struct ipc_panel *panels, uint8_t cnt)
+{
+	for (uint8_t i = 0; i < cnt; i++) {
+		close(panels[i].fd_lcd);
+		if (panels[i].fd_touch >= 0)
+			close(panels[i].fd_touch);
+	}
+}
+
+static int lcd_open_panel(struct ipc_panel *panel, const char *lcd, 
+			  const char *touch, unsigned int rotation)
+{
+	if (!lcd_check_rotation(rotation)) {
+		fprintf(stderr, "Rotation must be 0, 90, 180 or 270.\n");
+		return -1;
+	}
+	panel->rotation = rotation;
+	if (!strcmp(lcd, LCD_VIRTUAL))
+		panel->fd_lcd = lcd_virtual_open();
+	else
+		panel->fd_lcd = open(lcd, O_RDWR);
+	if (panel->fd_lcd < 0) {
+		perror(lcd);
+		return -1;
+	}
+	panel->fd_touch = -1;
+	if (!strcmp(touch, "-"))
+		return 0;
+	panel->fd_touch = open(touch, O_RDWR);
+	if (panel->fd_touch < 0) {
+		perror(touch);
+		close(panel->fd_lcd);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Config has one panel per line: LCD device, touchpad device or "-" and
+ * optional rotation. Display IDs follow order of lines, empty lines and
+ * lines starting with '#' are skipped.
+ */
+static int lcd_read_config(const char *path, struct ipc_panel *panels,
+			   unsigned int rotation)
+{
+	char line[256], lcd[128], touch[128];
+	unsigned int line_rotation;
+	int cnt = 0, ret;
+	FILE *config = fopen(path, "r");
+	if (!config) {
+		perror(path);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), config)) {
+		line_rotation = rotation;
+		ret = sscanf(line, "%127s %127s %u", lcd, touch, 
+			     &line_rotation);
+		if (ret < 1 || lcd[0] == '#')
+			continue;
+		if (ret < 2 || cnt == DISPLAY_CNT) {
+			fprintf(stderr, "%s: bad line or more than %d panels: "
+				"%s", path, DISPLAY_CNT, line);
+			goto err;
+		}
+		if (lcd_open_panel(&panels[cnt], lcd, touch, line_rotation))
+			goto err;
+		cnt++;
+	}
+	fclose(config);
+	if (!cnt)
+		fprintf(stderr, "%s: no panels.\n", path);
+	return cnt ? cnt : -1;
+err:
+	fclose(config);
+	lcd_close_panels(panels, cnt);
+	return -1;
+}
+
+int switch_to_daemon(void)
 {
 	pid_t pid;
 	pid = fork();
@@ -608,8 +1448,6 @@ int switch_to_daemon(int fd_lcd, int fd_touch)
 	case 0:
 		break;
 	default:
-		close(fd_lcd);
-		close(fd_touch);
 		exit(0);
 	}
 	umask(0);
@@ -630,20 +1468,52 @@ int switch_to_daemon(int fd_lcd, int fd_touch)
 
 int main(int argc, char *argv[])
 {
-	int fd_lcd, fd_touch;
-	fd_lcd = open(device_lcd, O_RDWR);
-	if (fd_lcd < 0) 
-		return -1;
-	fd_touch = open(device_touch, O_RDWR);
-	if (fd_touch < 0) {
-		close(fd_lcd);
-		return -1;
+	struct ipc_panel panels[DISPLAY_CNT];
+	const char *config = NULL;
+	int cnt, opt;
+	unsigned int rotation = 0, chunk;
+	while ((opt = getopt(argc, argv, "r:c:f:b")) != -1) {
+		switch (opt) {
+		case 'r':
+			if (sscanf(optarg, "%u", &rotation) != 1 ||
+			    !lcd_check_rotation(rotation)) {
+				fprintf(stderr, "Rotation must be 0, 90, 180 or "
+					"270.\n");
+				return -1;
+			}
+			break;
+		case 'c':
+			if (sscanf(optarg, "%u", &chunk) != 1 ||
+			    spi_queue_set_chunk(chunk)) {
+				fprintf(stderr, "Chunk must be %d to %d bytes.\n",
+					SPI_CHUNK_MIN, SPI_STAGE_SIZE);
+				return -1;
+			}
+			break;
+		case 'f':
+			config = optarg;
+			break;
+		case 'b':
+			lcd_beam_enable();
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-r rotation] [-c chunk] "
+				"[-f config] [-b]\n", argv[0]);
+			return -1;
+		}
+	}
+	if (config) {
+		cnt = lcd_read_config(config, panels, rotation);
+		if (cnt < 0)
+			return -1;
+	} else {
+		if (lcd_open_panel(&panels[0], device_lcd, device_touch, 
+				   rotation))
+			return -1;
+		cnt = 1;
 	}
-	switch_to_daemon(fd_lcd, fd_touch);
-	lcd_init(fd_lcd, fd_touch);
-	lcd_clear_background(fd_lcd);
-	ipc_main(fd_lcd, fd_touch);
-	close(fd_lcd);
-	close(fd_touch);
+	switch_to_daemon();
+	ipc_main(panels, cnt);
+	lcd_close_panels(panels, cnt);
 	return 0;
 }
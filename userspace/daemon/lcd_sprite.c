@@ -0,0 +1,195 @@
+#include "lcd_sprite.h"
+
+#define SPRITE_PIX_MAX (SPRITE_SIZE_MAX * SPRITE_SIZE_MAX)
+
+struct lcd_sprite {
+	int16_t x;
+	int16_t y;
+	uint16_t dx;
+	uint16_t dy;
+	uint8_t visible;
+	/* part of sprite on screen while it is in the record */
+	struct lcd_rect shown;
+	uint8_t image[SPRITE_PIX_MAX * BY_PER_PIX];
+	uint8_t mask[SPRITE_MASK_SIZE(SPRITE_SIZE_MAX, SPRITE_SIZE_MAX)];
+	uint8_t under[SPRITE_PIX_MAX * BY_PER_PIX];
+};
+
+static __thread struct lcd_sprite lcd_sprites[SPRITE_CNT];
+
+static void sprite_clip(struct lcd_sprite *sprite, struct lcd_rect *rect)
+{
+	int x0 = sprite->x, y0 = sprite->y;
+	int x1 = x0 + sprite->dx, y1 = y0 + sprite->dy;
+	memset(rect, 0, sizeof(*rect));
+	if (x0 < 0)
+		x0 = 0;
+	if (y0 < 0)
+		y0 = 0;
+	if (x1 > lcd_panel.width)
+		x1 = lcd_panel.width;
+	if (y1 > lcd_panel.height)
+		y1 = lcd_panel.height;
+	if (x1 <= x0 || y1 <= y0)
+		return;
+	rect->x0 = x0;
+	rect->y0 = y0;
+	rect->x1 = x1;
+	rect->y1 = y1;
+}
+
+static void sprite_lift(struct lcd_sprite *sprite)
+{
+	struct lcd_rect *rect = &sprite->shown;
+	const uint32_t row_size = (rect->x1 - rect->x0) * BY_PER_PIX;
+	if (lcd_rect_empty(rect))
+		return;
+	for (uint16_t y = rect->y0; y < rect->y1; y++)
+		memcpy(lcd_fb_pos(rect->x0, y), 
+		       &sprite->under[(y - rect->y0) * row_size], row_size);
+	memset(rect, 0, sizeof(*rect));
+}
+
+static void sprite_drop(struct lcd_sprite *sprite)
+{
+	struct lcd_rect *rect = &sprite->shown;
+	const uint16_t mask_row = INDEXED_ROW_SIZE(sprite->dx, 1);
+	uint32_t row_size;
+	uint16_t sx, sy;
+	if (!sprite->visible)
+		return;
+	sprite_clip(sprite, rect);
+	if (lcd_rect_empty(rect))
+		return;
+	row_size = (rect->x1 - rect->x0) * BY_PER_PIX;
+	for (uint16_t y = rect->y0; y < rect->y1; y++) {
+		uint8_t *pix = lcd_fb_pos(rect->x0, y);
+		memcpy(&sprite->under[(y - rect->y0) * row_size], pix, 
+		       row_size);
+		sy = y - sprite->y;
+		for (uint16_t x = rect->x0; x < rect->x1; 
+		     x++, pix += BY_PER_PIX) {
+			sx = x - sprite->x;
+			if (sprite->mask[sy * mask_row + sx / 8] & 
+			    (0x80 >> (sx % 8)))
+				memcpy(pix, &sprite->image[(sy * sprite->dx + 
+							    sx) * BY_PER_PIX],
+				       BY_PER_PIX);
+		}
+	}
+}
+
+void lcd_sprites_lift(void)
+{
+	for (int i = SPRITE_CNT - 1; i >= 0; i--)
+		sprite_lift(&lcd_sprites[i]);
+	lcd_damage_reset();
+}
+
+/*
+ * Sprites overwritten on panel by the last drawing are sent again.
+ */
+void lcd_sprites_drop(int fd)
+{
+	struct lcd_rect damage = lcd_panel.damage;
+	int err = errno;
+	for (int i = 0; i < SPRITE_CNT; i++) {
+		struct lcd_sprite *sprite = &lcd_sprites[i];
+		sprite_drop(sprite);
+		if (lcd_rect_overlap(&sprite->shown, &damage))
+			lcd_flush_rect(fd, sprite->shown.x0, sprite->shown.y0,
+				       sprite->shown.x1 - sprite->shown.x0,
+				       sprite->shown.y1 - sprite->shown.y0);
+	}
+	errno = err;
+}
+
+/*
+ * Sends old and new place of a sprite, as one window when the pixels
+ * between them are cheaper than another window.
+ */
+static void sprite_flush(int fd, struct lcd_rect *old, struct lcd_rect *new)
+{
+	struct lcd_rect both = *old;
+	lcd_rect_union(&both, new);
+	if (lcd_rect_area(&both) > lcd_rect_area(old) + lcd_rect_area(new) + 
+				   LCD_WINDOW_COST) {
+		lcd_flush_rect(fd, old->x0, old->y0, old->x1 - old->x0,
+			       old->y1 - old->y0);
+		lcd_flush_rect(fd, new->x0, new->y0, new->x1 - new->x0,
+			       new->y1 - new->y0);
+		return;
+	}
+	lcd_flush_rect(fd, both.x0, both.y0, both.x1 - both.x0, 
+		       both.y1 - both.y0);
+}
+
+static void sprite_update(struct lcd_sprite *sprite, int16_t x, int16_t y, 
+			  uint8_t visible, uint16_t dx, uint16_t dy,
+			  const uint8_t *mem)
+{
+	lcd_sprites_lift();
+	sprite->x = x;
+	sprite->y = y;
+	sprite->visible = visible;
+	if (mem) {
+		sprite->dx = dx;
+		sprite->dy = dy;
+		memcpy(sprite->image, mem, dx * dy * BY_PER_PIX);
+		memcpy(sprite->mask, mem + dx * dy * BY_PER_PIX, 
+		       SPRITE_MASK_SIZE(dx, dy));
+	}
+	for (int i = 0; i < SPRITE_CNT; i++)
+		sprite_drop(&lcd_sprites[i]);
+}
+
+/*
+ * Moves sprite in screen record only, old and new places on screen are
+ * returned for the caller to send.
+ */
+int lcd_sprite_place(uint8_t id, int16_t x, int16_t y, uint16_t flags, 
+		     struct lcd_rect *old, struct lcd_rect *new)
+{
+	struct lcd_sprite *sprite;
+	if (id >= SPRITE_CNT) {
+		errno = EINVAL;
+		return -1;
+	}
+	sprite = &lcd_sprites[id];
+	if (!sprite->dx) {
+		errno = ENOENT;
+		return -1;
+	}
+	*old = sprite->shown;
+	sprite_update(sprite, x, y, flags & SPRITE_VISIBLE, 0, 0, NULL);
+	*new = sprite->shown;
+	return 0;
+}
+
+int lcd_sprite_define(int fd, uint8_t id, uint16_t dx, uint16_t dy, 
+		      const uint8_t *mem)
+{
+	struct lcd_sprite *sprite;
+	struct lcd_rect old;
+	if (id >= SPRITE_CNT || !dx || !dy || dx > SPRITE_SIZE_MAX || 
+	    dy > SPRITE_SIZE_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	sprite = &lcd_sprites[id];
+	old = sprite->shown;
+	sprite_update(sprite, sprite->x, sprite->y, sprite->visible, dx, dy, 
+		      mem);
+	sprite_flush(fd, &old, &sprite->shown);
+	return 0;
+}
+
+int lcd_sprite_move(int fd, uint8_t id, int16_t x, int16_t y, 
+		    uint16_t flags)
+{
+	struct lcd_rect old, new;
+	if (lcd_sprite_place(id, x, y, flags, &old, &new))
+		return -1;
+	sprite_flush(fd, &old, &new);
+	return 0;
+}
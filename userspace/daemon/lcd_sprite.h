@@ -0,0 +1,20 @@
+#ifndef _LCD_SPRITE_H_
+#define _LCD_SPRITE_H_
+
+#include "lcd_spi.h"
+
+/*
+ * Sprites live in screen record on top of other content. Before any
+ * other drawing they are lifted (pixels under them restored), afterwards
+ * dropped again and sent when the drawing touched them.
+ */
+int lcd_sprite_define(int fd, uint8_t id, uint16_t dx, uint16_t dy, 
+		      const uint8_t *mem);
+int lcd_sprite_move(int fd, uint8_t id, int16_t x, int16_t y, 
+		    uint16_t flags);
+int lcd_sprite_place(uint8_t id, int16_t x, int16_t y, uint16_t flags, 
+		     struct lcd_rect *old, struct lcd_rect *new);
+void lcd_sprites_lift(void);
+void lcd_sprites_drop(int fd);
+
+#endif
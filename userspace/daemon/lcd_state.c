@@ -0,0 +1,59 @@
+#include <sys/mman.h>
+
+#include "lcd_state.h"
+#include "lcd_spi.h"
+
+static __thread struct lcd_state *lcd_state;
+
+static uint8_t *lcd_state_map(uint8_t display)
+{
+	char path[64];
+	const size_t size = LCD_STATE_HEAD + TOT_MEM_SIZE;
+	struct stat st;
+	void *mem;
+	int fd;
+	snprintf(path, sizeof(path), LCD_STATE_PATH, display);
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) || (st.st_size != size && ftruncate(fd, size))) {
+		close(fd);
+		return NULL;
+	}
+	mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	return mem == MAP_FAILED ? NULL : mem;
+}
+
+uint8_t *lcd_state_open(uint8_t display, uint16_t rotation,
+			enum lcd_state_found *found)
+{
+	uint8_t *mem = lcd_state_map(display);
+	*found = LCD_STATE_NONE;
+	if (!mem)
+		return calloc(1, TOT_MEM_SIZE);
+	lcd_state = (struct lcd_state *)mem;
+	if (lcd_state->magic == LCD_STATE_MAGIC &&
+	    lcd_state->size == TOT_MEM_SIZE && lcd_state->rotation == rotation)
+		*found = lcd_state->clean ? LCD_STATE_CLEAN : LCD_STATE_STALE;
+	lcd_state->magic = LCD_STATE_MAGIC;
+	lcd_state->size = TOT_MEM_SIZE;
+	lcd_state->rotation = rotation;
+	lcd_state->clean = 0;
+	return mem + LCD_STATE_HEAD;
+}
+
+void lcd_state_rotation(uint16_t rotation)
+{
+	if (lcd_state)
+		lcd_state->rotation = rotation;
+}
+
+/*
+ * Everything drawn must be on the panel already.
+ */
+void lcd_state_close(void)
+{
+	if (lcd_state)
+		lcd_state->clean = 1;
+}
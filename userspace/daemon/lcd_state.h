@@ -0,0 +1,37 @@
+#ifndef _LCD_STATE_H_
+#define _LCD_STATE_H_
+
+#include <stdint.h>
+
+/*
+ * Screen record of every panel lives in a file mapped into the daemon, so
+ * the next daemon knows what the panel shows and does not clear it. The
+ * file starts with a page of struct lcd_state, the record follows. Clean
+ * is set only by a daemon which sent all it drew and let go of the panel,
+ * a record left otherwise may differ from the panel and is sent again.
+ */
+#define LCD_STATE_PATH "/run/lcd_spi_state%u"
+#define LCD_STATE_MAGIC 0x4c434453
+#define LCD_STATE_HEAD 4096
+
+struct lcd_state {
+	uint32_t magic;
+	uint32_t size;
+	uint16_t rotation;
+	uint8_t clean;
+};
+
+enum lcd_state_found {
+	LCD_STATE_NONE, LCD_STATE_STALE, LCD_STATE_CLEAN
+};
+
+/*
+ * Returns the record of the display; found tells whether one of the same
+ * rotation was kept. Without the file the record is only in memory.
+ */
+uint8_t *lcd_state_open(uint8_t display, uint16_t rotation,
+			enum lcd_state_found *found);
+void lcd_state_rotation(uint16_t rotation);
+void lcd_state_close(void);
+
+#endif
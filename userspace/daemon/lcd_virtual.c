@@ -0,0 +1,64 @@
+#include "lcd_virtual.h"
+#include "lcd_spi.h"
+
+static int lcd_virtual_fds[DISPLAY_CNT];
+static uint8_t lcd_virtual_cnt;
+
+int lcd_virtual_open(void)
+{
+	int fd;
+	if (lcd_virtual_cnt == DISPLAY_CNT)
+		return -1;
+	fd = open("/dev/null", O_RDWR);
+	if (fd >= 0)
+		lcd_virtual_fds[lcd_virtual_cnt++] = fd;
+	return fd;
+}
+
+int lcd_virtual_owns(int fd)
+{
+	for (uint8_t i = 0; i < lcd_virtual_cnt; i++)
+		if (lcd_virtual_fds[i] == fd)
+			return 1;
+	return 0;
+}
+
+static uint16_t lcd_virtual_scanline(void)
+{
+	struct timespec now;
+	uint64_t ns;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ns = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+	return ns % LCD_VIRTUAL_PERIOD_NS * LCD_VIRTUAL_LINES / 
+	       LCD_VIRTUAL_PERIOD_NS;
+}
+
+/*
+ * Reply bytes after the dummy one, as the driver returns them.
+ */
+int lcd_virtual_read(int fd, uint8_t cmd, uint8_t *rx, uint32_t n)
+{
+	uint16_t line;
+	memset(rx, 0, n);
+	switch (cmd) {
+	/* display status and pixel format: awake, on, 16 bit pixels */
+	case 0x09:
+		if (n >= 3) {
+			rx[1] = LCD_STATUS_SLEEP_OUT;
+			rx[2] = LCD_STATUS_DISPLAY_ON;
+		}
+		break;
+	case 0x0C:
+		if (n >= 1)
+			rx[0] = LCD_COLMOD_16BIT;
+		break;
+	case 0x45:
+		line = lcd_virtual_scanline();
+		if (n >= 2) {
+			rx[0] = line >> 8;
+			rx[1] = line & 0xff;
+		}
+		break;
+	}
+	return 0;
+}
@@ -0,0 +1,21 @@
+#ifndef _LCD_VIRTUAL_H_
+#define _LCD_VIRTUAL_H_
+
+#include <stdint.h>
+
+/*
+ * Panel without hardware, given as LCD device "virtual". Writes go
+ * nowhere (the descriptor is /dev/null), reads answer as the controller
+ * would, one which is always ready. The scanline runs through
+ * LCD_VIRTUAL_LINES lines every LCD_VIRTUAL_PERIOD_NS, as ILI9341 does
+ * at its default 70 Hz with 2 lines of front and back porch.
+ */
+#define LCD_VIRTUAL "virtual"
+#define LCD_VIRTUAL_LINES 324
+#define LCD_VIRTUAL_PERIOD_NS 14285714
+
+int lcd_virtual_open(void);
+int lcd_virtual_owns(int fd);
+int lcd_virtual_read(int fd, uint8_t cmd, uint8_t *rx, uint32_t n);
+
+#endif
@@ -0,0 +1,123 @@
+#include <string.h>
+
+#include "qoi_decoder.h"
+
+#define QOI_OP_INDEX	0x00
+#define QOI_OP_DIFF	0x40
+#define QOI_OP_LUMA	0x80
+#define QOI_OP_RUN	0xc0
+#define QOI_OP_RGB	0xfe
+#define QOI_OP_RGBA	0xff
+#define QOI_MASK_2	0xc0
+
+#define QOI_HASH(p) (((p).r * 3 + (p).g * 5 + (p).b * 7 + (p).a * 11) % 64)
+
+static inline uint32_t qoi_read_32(const uint8_t *in)
+{
+	return in[0] << 24 | in[1] << 16 | in[2] << 8 | in[3];
+}
+
+static inline void qoi_put_pixel(const struct qoi_rgba *px, uint8_t *out)
+{
+	out[0] = (px->r & 0xf8) | (px->g >> 5);
+	out[1] = ((px->g << 3) & 0xe0) | (px->b >> 3);
+}
+
+int qoi_decode_header(struct qoi_decoder *dec, const uint8_t *in)
+{
+	if (memcmp(in, "qoif", 4))
+		return QOI_ERROR;
+	dec->width = qoi_read_32(&in[4]);
+	dec->height = qoi_read_32(&in[8]);
+	dec->channels = in[12];
+	if (!dec->width || !dec->height)
+		return QOI_ERROR;
+	if (dec->channels != 3 && dec->channels != 4)
+		return QOI_ERROR;
+	dec->px_left = dec->width * dec->height;
+	dec->run = 0;
+	dec->px.r = 0;
+	dec->px.g = 0;
+	dec->px.b = 0;
+	dec->px.a = 255;
+	memset(dec->index, 0, sizeof(dec->index));
+	return 0;
+}
+
+static inline uint8_t qoi_op_size(uint8_t op)
+{
+	if (op == QOI_OP_RGB)
+		return 4;
+	if (op == QOI_OP_RGBA)
+		return 5;
+	if ((op & QOI_MASK_2) == QOI_OP_LUMA)
+		return 2;
+	return 1;
+}
+
+/*
+ * Decodes as many pixels as fit into out (BY_PER_PIX bytes each) from
+ * available input. Returns QOI_DONE when whole image was produced.
+ */
+int qoi_decode(struct qoi_decoder *dec, const uint8_t *in, uint32_t in_size,
+	       uint32_t *consumed, uint8_t *out, uint32_t out_size, 
+	       uint32_t *produced)
+{
+	uint32_t pos = 0, out_pos = 0;
+	uint8_t op;
+	while (dec->px_left) {
+		if (out_pos + 2 > out_size)
+			goto out_full;
+		if (dec->run) {
+			dec->run--;
+			goto put;
+		}
+		if (pos >= in_size)
+			goto need_input;
+		op = in[pos];
+		if (pos + qoi_op_size(op) > in_size)
+			goto need_input;
+		pos++;
+		if (op == QOI_OP_RGB) {
+			dec->px.r = in[pos++];
+			dec->px.g = in[pos++];
+			dec->px.b = in[pos++];
+		} else if (op == QOI_OP_RGBA) {
+			dec->px.r = in[pos++];
+			dec->px.g = in[pos++];
+			dec->px.b = in[pos++];
+			dec->px.a = in[pos++];
+		} else if ((op & QOI_MASK_2) == QOI_OP_INDEX) {
+			dec->px = dec->index[op];
+		} else if ((op & QOI_MASK_2) == QOI_OP_DIFF) {
+			dec->px.r += ((op >> 4) & 0x03) - 2;
+			dec->px.g += ((op >> 2) & 0x03) - 2;
+			dec->px.b += (op & 0x03) - 2;
+		} else if ((op & QOI_MASK_2) == QOI_OP_LUMA) {
+			uint8_t b2 = in[pos++];
+			int vg = (op & 0x3f) - 32;
+			dec->px.r += vg - 8 + ((b2 >> 4) & 0x0f);
+			dec->px.g += vg;
+			dec->px.b += vg - 8 + (b2 & 0x0f);
+		} else {
+			/* run is stored with bias -1, current pixel is put below */
+			dec->run = op & 0x3f;
+		}
+		dec->index[QOI_HASH(dec->px)] = dec->px;
+put:
+		qoi_put_pixel(&dec->px, &out[out_pos]);
+		out_pos += 2;
+		dec->px_left--;
+	}
+	*consumed = pos;
+	*produced = out_pos;
+	return QOI_DONE;
+out_full:
+	*consumed = pos;
+	*produced = out_pos;
+	return QOI_OUTPUT_FULL;
+need_input:
+	*consumed = pos;
+	*produced = out_pos;
+	return QOI_NEED_INPUT;
+}
@@ -0,0 +1,39 @@
+#ifndef _QOI_DECODER_H_
+#define _QOI_DECODER_H_
+
+#include <stdint.h>
+
+/*
+ * Streaming decoder of QOI images (qoiformat.org) producing RGB565 pixels
+ * in panel byte order. Input may be fed in pieces of any size; operation
+ * split between pieces is left unconsumed and must be passed again.
+ */
+
+#define QOI_HEADER_SIZE 14
+#define QOI_END_SIZE 8
+
+#define QOI_NEED_INPUT	0
+#define QOI_OUTPUT_FULL	1
+#define QOI_DONE	2
+#define QOI_ERROR	-1
+
+struct qoi_rgba {
+	uint8_t r, g, b, a;
+};
+
+struct qoi_decoder {
+	uint32_t width;
+	uint32_t height;
+	uint8_t channels;
+	uint32_t px_left;
+	uint8_t run;
+	struct qoi_rgba px;
+	struct qoi_rgba index[64];
+};
+
+int qoi_decode_header(struct qoi_decoder *dec, const uint8_t *in);
+int qoi_decode(struct qoi_decoder *dec, const uint8_t *in, uint32_t in_size,
+	       uint32_t *consumed, uint8_t *out, uint32_t out_size, 
+	       uint32_t *produced);
+
+#endif
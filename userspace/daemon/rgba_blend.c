@@ -0,0 +1,115 @@
+#include "rgba_blend.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define RGBA_BLEND_NEON
+#endif
+
+/* green in upper, red and blue in lower half with space for carries */
+#define RGBA_SPREAD_MASK 0x07e0f81f
+
+static inline uint16_t rgba_pack(const uint8_t *rgba)
+{
+	return (rgba[0] & 0xf8) << 8 | (rgba[1] & 0xfc) << 3 | rgba[2] >> 3;
+}
+
+static inline void rgba_damage(uint16_t i, uint16_t n, uint16_t *first, 
+			       uint16_t *end)
+{
+	if (i < *first)
+		*first = i;
+	*end = i + n;
+}
+
+/*
+ * Fixed point blend of all three channels in one 32 bit multiply, alpha
+ * is reduced to 5 bits which is the precision of red and blue anyway.
+ */
+static inline void rgba_blend_pixel(uint8_t *dst, const uint8_t *rgba)
+{
+	uint32_t d = dst[0] << 8 | dst[1];
+	uint32_t s = rgba_pack(rgba);
+	uint32_t a = (rgba[3] + 4) >> 3;
+	d = (d | d << 16) & RGBA_SPREAD_MASK;
+	s = (s | s << 16) & RGBA_SPREAD_MASK;
+	d = (d + ((s - d) * a >> 5)) & RGBA_SPREAD_MASK;
+	d |= d >> 16;
+	dst[0] = d >> 8;
+	dst[1] = d;
+}
+
+static void rgba_blend_scalar(uint8_t *dst, const uint8_t *rgba, 
+			      uint16_t i, uint16_t cnt, uint16_t *first, 
+			      uint16_t *end)
+{
+	uint16_t colour;
+	for (; i < cnt; i++) {
+		const uint8_t *src = &rgba[i * RGBA_BY_PER_PIX];
+		if (!src[3])
+			continue;
+		if (src[3] == 0xff) {
+			colour = rgba_pack(src);
+			dst[i * 2] = colour >> 8;
+			dst[i * 2 + 1] = colour;
+		} else {
+			rgba_blend_pixel(&dst[i * 2], src);
+		}
+		rgba_damage(i, 1, first, end);
+	}
+}
+
+#ifdef RGBA_BLEND_NEON
+/*
+ * Eight pixels per step with exact division by 255, panel byte order
+ * lets vld2/vst2 split high and low bytes of RGB565 for free.
+ */
+static uint16_t rgba_blend_neon(uint8_t *dst, const uint8_t *rgba, 
+				uint16_t cnt, uint16_t *first, uint16_t *end)
+{
+	uint16_t i;
+	for (i = 0; i + 8 <= cnt; i += 8) {
+		uint8x8x4_t src = vld4_u8(&rgba[i * RGBA_BY_PER_PIX]);
+		uint64_t alpha = vget_lane_u64(vreinterpret_u64_u8(src.val[3]),
+					       0);
+		uint8x8x2_t pix;
+		if (!alpha)
+			continue;
+		if (alpha != ~0ULL) {
+			uint8x8_t inv = vmvn_u8(src.val[3]);
+			uint8x8x2_t old = vld2_u8(&dst[i * 2]);
+			uint8x8_t chan[3], tmp;
+			uint16x8_t sum;
+			chan[0] = vsri_n_u8(old.val[0], old.val[0], 5);
+			tmp = vorr_u8(vshl_n_u8(old.val[0], 5), 
+				      vshr_n_u8(vand_u8(old.val[1], 
+							vdup_n_u8(0xe0)), 3));
+			chan[1] = vsri_n_u8(tmp, tmp, 6);
+			tmp = vshl_n_u8(old.val[1], 3);
+			chan[2] = vsri_n_u8(tmp, tmp, 5);
+			for (int c = 0; c < 3; c++) {
+				sum = vmull_u8(src.val[c], src.val[3]);
+				sum = vmlal_u8(sum, chan[c], inv);
+				src.val[c] = vraddhn_u16(sum, 
+							 vrshrq_n_u16(sum, 8));
+			}
+		}
+		pix.val[0] = vsri_n_u8(src.val[0], src.val[1], 5);
+		pix.val[1] = vsri_n_u8(vshl_n_u8(src.val[1], 3), src.val[2], 3);
+		vst2_u8(&dst[i * 2], pix);
+		rgba_damage(i, 8, first, end);
+	}
+	return i;
+}
+#endif
+
+void rgba_blend_row(uint8_t *dst, const uint8_t *rgba, uint16_t cnt,
+		    uint16_t *first, uint16_t *end)
+{
+	uint16_t i = 0;
+	*first = cnt;
+	*end = 0;
+#ifdef RGBA_BLEND_NEON
+	i = rgba_blend_neon(dst, rgba, cnt, first, end);
+#endif
+	rgba_blend_scalar(dst, rgba, i, cnt, first, end);
+}
@@ -0,0 +1,16 @@
+#ifndef _RGBA_BLEND_H_
+#define _RGBA_BLEND_H_
+
+#include <stdint.h>
+
+#define RGBA_BY_PER_PIX 4
+
+/*
+ * Blends cnt RGBA8888 pixels over RGB565 pixels in panel byte order.
+ * Touched pixels are reported as [*first, *end), *end <= *first when the
+ * whole row was transparent.
+ */
+void rgba_blend_row(uint8_t *dst, const uint8_t *rgba, uint16_t cnt,
+		    uint16_t *first, uint16_t *end);
+
+#endif
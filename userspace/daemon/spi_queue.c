@@ -0,0 +1,557 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <semaphore.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <time.h>
+
+#include "spi_queue.h"
+#include "lcd_spi.h"
+#include "lcd_virtual.h"
+
+/*
+ * Op is claimed by I/O thread before it is sent, renderer may still drop
+ * a queued one which turned out to be covered.
+ */
+enum spi_op_state {
+	SPI_OP_QUEUED, SPI_OP_SENT, SPI_OP_DROPPED
+};
+
+struct spi_op {
+	unsigned int cmd;
+	uint32_t offset;
+	uint32_t size;
+	uint8_t state;
+};
+
+struct spi_stage {
+	struct spi_op op[SPI_STAGE_OPS];
+	uint16_t op_cnt;
+	uint32_t used;
+	uint8_t mem[SPI_STAGE_SIZE];
+};
+
+/*
+ * Transfer time is modelled as fixed cost plus cost per byte, both are
+ * running averages over measured ioctls. Byte cost is in 1/16 ns.
+ */
+struct spi_tune {
+	uint32_t chunk;
+	uint8_t fixed;
+	uint32_t op_ns;
+	uint32_t byte_cost;
+};
+
+/*
+ * Pixel data of a window, from the op after its RAMWR (stage sequence
+ * number and op index) to its last data op. Exclusive ends as lcd_rect.
+ */
+struct spi_window {
+	uint16_t x0;
+	uint16_t y0;
+	uint16_t x1;
+	uint16_t y1;
+	uint32_t stage;
+	uint16_t first;
+	uint32_t last_stage;
+	uint16_t last;
+	uint32_t left;
+	uint8_t committed;
+};
+
+enum spi_window_state {
+	SPI_WIN_NONE, SPI_WIN_RAMWR, SPI_WIN_DATA
+};
+
+/*
+ * Single producer, single consumer ring. head is written by renderer,
+ * tail by I/O thread, semaphores count free and filled stages. Every
+ * panel has its own queue and I/O thread; the renderer finds its queue
+ * through a thread-local pointer set by spi_queue_start. error is the
+ * errno of the first write which failed since the renderer took the last
+ * one; writes of a virtual panel are not sent at all.
+ */
+struct spi_queue {
+	struct spi_stage stage[SPI_QUEUE_DEPTH];
+	struct spi_tune tune;
+	uint32_t head;
+	uint32_t tail;
+	uint8_t open;
+	uint8_t virtual;
+	int fd;
+	int error;
+	/* renderer only: window being queued and complete ones still queued */
+	struct spi_window win;
+	uint8_t win_state;
+	struct spi_window done[SPI_WINDOWS];
+	uint8_t done_cnt;
+	uint32_t superseded;
+	uint32_t superseded_bytes;
+	sem_t free;
+	sem_t filled;
+	pthread_t thread;
+};
+
+/* chunk given on command line, 0 when tuned */
+static uint32_t spi_chunk_fixed;
+static __thread struct spi_queue *spi_queue;
+
+static inline uint64_t spi_now_ns(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static inline void spi_average(uint32_t *value, uint32_t sample)
+{
+	*value = *value ? *value - *value / 8 + sample / 8 : sample;
+}
+
+/*
+ * Short transfers (commands and their arguments) measure fixed cost,
+ * long ones the cost per byte. Costs are measured with fixed chunk too.
+ */
+static void spi_tune_update(struct spi_tune *tune, uint32_t size, uint64_t ns)
+{
+	uint32_t chunk;
+	if (size <= 4) {
+		spi_average(&tune->op_ns, ns);
+		return;
+	}
+	if (size < SPI_CHUNK_MIN || ns <= tune->op_ns)
+		return;
+	spi_average(&tune->byte_cost, (ns - tune->op_ns) * 16 / size);
+	if (tune->fixed || !tune->op_ns || !tune->byte_cost)
+		return;
+	chunk = (uint64_t)tune->op_ns * 16 * SPI_TUNE_RATIO / 
+		tune->byte_cost;
+	chunk = chunk < SPI_CHUNK_MIN ? SPI_CHUNK_MIN : chunk;
+	chunk = chunk > SPI_STAGE_SIZE ? SPI_STAGE_SIZE : chunk;
+	__atomic_store_n(&tune->chunk, chunk & ~(SPI_CHUNK_MIN - 1), 
+			 __ATOMIC_RELAXED);
+}
+
+/*
+ * Keeps the first error until the renderer takes it.
+ */
+static inline void spi_queue_fail(struct spi_queue *queue, int err)
+{
+	int none = 0;
+	__atomic_compare_exchange_n(&queue->error, &none, err, 0, 
+				    __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
+static void *spi_queue_thread(void *arg)
+{
+	struct spi_queue *queue = arg;
+	struct spi_stage *stage;
+	struct lcdd_transfer tr;
+	uint64_t start;
+	while (1) {
+		while (sem_wait(&queue->filled))
+			;
+		stage = &queue->stage[queue->tail % SPI_QUEUE_DEPTH];
+		for (uint16_t i = 0; i < stage->op_cnt; i++) {
+			uint8_t queued = SPI_OP_QUEUED;
+			if (!__atomic_compare_exchange_n(&stage->op[i].state, 
+							 &queued, SPI_OP_SENT,
+							 0, __ATOMIC_ACQ_REL,
+							 __ATOMIC_ACQUIRE))
+				continue;
+			tr.byte_cnt = stage->op[i].size;
+			tr.tx_buf = &stage->mem[stage->op[i].offset];
+			tr.rx_buf = NULL;
+			if (queue->virtual)
+				continue;
+			start = spi_now_ns();
+			/* failed ones tell nothing of transfer time */
+			if (ioctl(queue->fd, stage->op[i].cmd, &tr) < 0)
+				spi_queue_fail(queue, errno);
+			else
+				spi_tune_update(&queue->tune, tr.byte_cnt, 
+						spi_now_ns() - start);
+		}
+		__atomic_store_n(&queue->tail, queue->tail + 1, 
+				 __ATOMIC_RELEASE);
+		sem_post(&queue->free);
+	}
+	return NULL;
+}
+
+int spi_queue_start(int fd)
+{
+	struct spi_queue *queue = calloc(1, sizeof(*queue));
+	if (!queue)
+		return -1;
+	queue->tune.chunk = spi_chunk_fixed ? spi_chunk_fixed : SPI_STAGE_SIZE;
+	queue->tune.fixed = spi_chunk_fixed != 0;
+	if (sem_init(&queue->free, 0, SPI_QUEUE_DEPTH) ||
+	    sem_init(&queue->filled, 0, 0)) {
+		free(queue);
+		return -1;
+	}
+	queue->fd = fd;
+	queue->virtual = lcd_virtual_owns(fd);
+	errno = pthread_create(&queue->thread, NULL, spi_queue_thread, queue);
+	if (errno) {
+		free(queue);
+		return -1;
+	}
+	spi_queue = queue;
+	return 0;
+}
+
+/*
+ * Applies to queues started afterwards.
+ */
+int spi_queue_set_chunk(uint32_t size)
+{
+	if (size < SPI_CHUNK_MIN || size > SPI_STAGE_SIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+	spi_chunk_fixed = size;
+	return 0;
+}
+
+uint32_t spi_queue_chunk(void)
+{
+	if (!spi_queue)
+		return spi_chunk_fixed ? spi_chunk_fixed : SPI_STAGE_SIZE;
+	return __atomic_load_n(&spi_queue->tune.chunk, __ATOMIC_RELAXED);
+}
+
+/*
+ * Expected time of sending size bytes in chunks, 0 until measured.
+ */
+uint64_t spi_queue_cost(uint32_t size)
+{
+	uint32_t op_ns, byte_cost;
+	if (!spi_queue)
+		return 0;
+	op_ns = __atomic_load_n(&spi_queue->tune.op_ns, __ATOMIC_RELAXED);
+	byte_cost = __atomic_load_n(&spi_queue->tune.byte_cost, 
+				    __ATOMIC_RELAXED);
+	return (uint64_t)(size / spi_queue_chunk() + 1) * op_ns + 
+	       (uint64_t)size * byte_cost / 16;
+}
+
+/*
+ * Expected time until everything queued is sent, from the ops not sent
+ * yet. Ops of stages handed over are claimed by I/O thread meanwhile; the
+ * last one claimed may still be on the wire, so it is counted whole.
+ */
+uint64_t spi_queue_left(void)
+{
+	struct spi_stage *stage;
+	uint32_t end, sent = 0;
+	uint64_t ns = 0;
+	if (!spi_queue)
+		return 0;
+	end = spi_queue->head + spi_queue->open;
+	for (uint32_t seq = __atomic_load_n(&spi_queue->tail, __ATOMIC_ACQUIRE);
+	     seq != end; seq++) {
+		stage = &spi_queue->stage[seq % SPI_QUEUE_DEPTH];
+		for (uint16_t i = 0; i < stage->op_cnt; i++)
+			switch (__atomic_load_n(&stage->op[i].state, 
+						__ATOMIC_ACQUIRE)) {
+			case SPI_OP_QUEUED:
+				ns += spi_queue_cost(stage->op[i].size);
+				break;
+			case SPI_OP_SENT:
+				sent = stage->op[i].size;
+				break;
+			}
+	}
+	return ns + (ns || sent ? spi_queue_cost(sent) : 0);
+}
+
+int spi_queue_owns(int fd)
+{
+	return spi_queue && fd == spi_queue->fd;
+}
+
+static struct spi_stage *spi_queue_open(void)
+{
+	struct spi_stage *stage;
+	if (!spi_queue->open) {
+		while (sem_wait(&spi_queue->free))
+			;
+		stage = &spi_queue->stage[spi_queue->head % SPI_QUEUE_DEPTH];
+		stage->op_cnt = 0;
+		stage->used = 0;
+		spi_queue->open = 1;
+	}
+	return &spi_queue->stage[spi_queue->head % SPI_QUEUE_DEPTH];
+}
+
+/*
+ * Hands open stage over to I/O thread.
+ */
+void spi_queue_kick(void)
+{
+	if (!spi_queue || !spi_queue->open)
+		return;
+	spi_queue->open = 0;
+	spi_queue->head++;
+	sem_post(&spi_queue->filled);
+}
+
+static inline int spi_queue_idle(void)
+{
+	return __atomic_load_n(&spi_queue->tail, __ATOMIC_ACQUIRE) == 
+	       spi_queue->head;
+}
+
+static inline int spi_window_covers(const struct spi_window *win,
+				    const struct spi_window *other)
+{
+	return win->x0 <= other->x0 && win->y0 <= other->y0 && 
+	       win->x1 >= other->x1 && win->y1 >= other->y1;
+}
+
+/*
+ * Drops data ops of window which were not sent yet. Stages before tail
+ * are done, the ones from tail on are not reused until tail passes them.
+ * Returns dropped byte count.
+ */
+static uint32_t spi_window_drop(const struct spi_window *win)
+{
+	const uint32_t tail = __atomic_load_n(&spi_queue->tail, 
+					      __ATOMIC_ACQUIRE);
+	uint32_t bytes = 0;
+	for (uint32_t seq = win->stage; seq - win->stage <= 
+	     win->last_stage - win->stage; seq++) {
+		struct spi_stage *stage = &spi_queue->stage[seq % 
+							    SPI_QUEUE_DEPTH];
+		uint16_t i = seq == win->stage ? win->first : 0;
+		uint16_t end = seq == win->last_stage ? win->last + 1 :
+			       stage->op_cnt;
+		if ((int32_t)(seq - tail) < 0)
+			continue;
+		for (; i < end; i++) {
+			uint8_t queued = SPI_OP_QUEUED;
+			if (stage->op[i].cmd != SPI_IO_WR_DATA)
+				continue;
+			if (__atomic_compare_exchange_n(&stage->op[i].state,
+							&queued, 
+							SPI_OP_DROPPED, 0,
+							__ATOMIC_ACQ_REL,
+							__ATOMIC_ACQUIRE))
+				bytes += stage->op[i].size;
+		}
+	}
+	return bytes;
+}
+
+/*
+ * Older complete windows covered by the one being queued need not reach
+ * the panel. Data sent partly is harmless, the rest of such window is
+ * overwritten anyway.
+ */
+static void spi_window_supersede(void)
+{
+	const uint32_t tail = __atomic_load_n(&spi_queue->tail, 
+					      __ATOMIC_ACQUIRE);
+	struct spi_window *win = &spi_queue->win;
+	uint8_t kept = 0;
+	uint32_t bytes;
+	for (uint8_t i = 0; i < spi_queue->done_cnt; i++) {
+		struct spi_window *old = &spi_queue->done[i];
+		if ((int32_t)(old->last_stage - tail) < 0)
+			continue;
+		if (!spi_window_covers(win, old)) {
+			spi_queue->done[kept++] = *old;
+			continue;
+		}
+		bytes = spi_window_drop(old);
+		if (bytes) {
+			spi_queue->superseded++;
+			spi_queue->superseded_bytes += bytes;
+		}
+	}
+	spi_queue->done_cnt = kept;
+}
+
+/*
+ * Window got all its pixels, from now on it may supersede older ones.
+ */
+static void spi_window_done(void)
+{
+	if (!spi_queue->win.committed)
+		spi_window_supersede();
+	if (spi_queue->done_cnt == SPI_WINDOWS) {
+		memmove(spi_queue->done, spi_queue->done + 1, 
+			(SPI_WINDOWS - 1) * sizeof(struct spi_window));
+		spi_queue->done_cnt--;
+	}
+	spi_queue->done[spi_queue->done_cnt++] = spi_queue->win;
+}
+
+/*
+ * Follows ops of the window being queued: RAMWR, then its pixels. Any
+ * other command ends the window before it is complete.
+ */
+static void spi_window_op(unsigned int cmd, uint16_t op, uint32_t size)
+{
+	struct spi_window *win = &spi_queue->win;
+	switch (spi_queue->win_state) {
+	case SPI_WIN_RAMWR:
+		if (cmd == SPI_IO_WR_DATA)
+			break;
+		win->stage = spi_queue->head;
+		win->first = op + 1;
+		win->last_stage = spi_queue->head;
+		win->last = op;
+		spi_queue->win_state = SPI_WIN_DATA;
+		return;
+	case SPI_WIN_DATA:
+		if (cmd != SPI_IO_WR_DATA)
+			break;
+		win->last_stage = spi_queue->head;
+		win->last = op;
+		win->left -= size < win->left ? size : win->left;
+		if (win->left)
+			return;
+		spi_window_done();
+		break;
+	default:
+		return;
+	}
+	spi_queue->win_state = SPI_WIN_NONE;
+}
+
+void spi_queue_window(int fd, uint16_t x, uint16_t y, uint16_t dx, 
+		      uint16_t dy)
+{
+	struct spi_window *win;
+	if (!spi_queue_owns(fd))
+		return;
+	win = &spi_queue->win;
+	win->x0 = x;
+	win->y0 = y;
+	win->x1 = x + dx;
+	win->y1 = y + dy;
+	win->left = (uint32_t)dx * dy * BY_PER_PIX;
+	win->committed = 0;
+	spi_queue->win_state = win->left ? SPI_WIN_RAMWR : SPI_WIN_NONE;
+}
+
+/*
+ * Caller is going to write the whole window being queued, so covered
+ * windows are dropped at once instead of when its last pixel is queued.
+ */
+void spi_queue_commit(int fd)
+{
+	if (!spi_queue_owns(fd) || spi_queue->win_state == SPI_WIN_NONE)
+		return;
+	spi_window_supersede();
+	spi_queue->win.committed = 1;
+}
+
+/*
+ * Window in controller is not known after a failed write, so the next
+ * one is set in full.
+ */
+static int spi_queue_failed(void)
+{
+	const int err = __atomic_load_n(&spi_queue->error, __ATOMIC_ACQUIRE);
+	if (err)
+		lcd_panel.window.valid = 0;
+	return err;
+}
+
+/*
+ * Takes error of a failed write, to be returned to the client being
+ * served: -1 and errno set when there was one.
+ */
+int spi_queue_error(void)
+{
+	int err;
+	if (!spi_queue || !spi_queue_failed())
+		return 0;
+	err = __atomic_exchange_n(&spi_queue->error, 0, __ATOMIC_ACQ_REL);
+	errno = err;
+	return -1;
+}
+
+int spi_queue_barrier(int fd)
+{
+	int err;
+	if (!spi_queue_owns(fd))
+		return 0;
+	spi_queue->win_state = SPI_WIN_NONE;
+	spi_queue->done_cnt = 0;
+	err = spi_queue_failed();
+	if (!err)
+		return 0;
+	errno = err;
+	return -1;
+}
+
+void spi_queue_stats(struct ipc_stats *stats)
+{
+	if (!spi_queue)
+		return;
+	stats->superseded = spi_queue->superseded;
+	stats->superseded_bytes = spi_queue->superseded_bytes;
+}
+
+int spi_queue_write(int fd, unsigned int cmd, const uint8_t *mem, 
+		    uint32_t size)
+{
+	const uint32_t chunk = spi_queue_chunk();
+	struct spi_stage *stage;
+	uint32_t cnt;
+	if (!size)
+		return 0;
+	spi_queue_failed();
+	do {
+		stage = spi_queue_open();
+		if (stage->used >= chunk || stage->op_cnt == SPI_STAGE_OPS) {
+			spi_queue_kick();
+			continue;
+		}
+		cnt = chunk - stage->used;
+		if (cnt > size)
+			cnt = size;
+		memcpy(&stage->mem[stage->used], mem, cnt);
+		stage->op[stage->op_cnt].cmd = cmd;
+		stage->op[stage->op_cnt].offset = stage->used;
+		stage->op[stage->op_cnt].size = cnt;
+		stage->op[stage->op_cnt].state = SPI_OP_QUEUED;
+		spi_window_op(cmd, stage->op_cnt, cnt);
+		stage->op_cnt++;
+		stage->used += cnt;
+		mem += cnt;
+		size -= cnt;
+	} while (size);
+	/* nothing else in flight, start transfer at once */
+	if (spi_queue_idle())
+		spi_queue_kick();
+	return 0;
+}
+
+/*
+ * Waits until everything queued is on the wire. Returns -1 with errno
+ * set when a write failed and the error was not taken yet.
+ */
+int spi_queue_drain(void)
+{
+	int err;
+	if (!spi_queue)
+		return 0;
+	spi_queue_kick();
+	for (int i = 0; i < SPI_QUEUE_DEPTH; i++)
+		while (sem_wait(&spi_queue->free))
+			;
+	for (int i = 0; i < SPI_QUEUE_DEPTH; i++)
+		sem_post(&spi_queue->free);
+	err = spi_queue_failed();
+	if (!err)
+		return 0;
+	errno = err;
+	return -1;
+}
@@ -0,0 +1,53 @@
+#ifndef _SPI_QUEUE_H_
+#define _SPI_QUEUE_H_
+
+#include <stdint.h>
+
+/*
+ * Writes to one SPI device are copied into staging buffers and sent by
+ * a dedicated I/O thread, so rendering of next data overlaps transfer
+ * of previous one. Staging buffers are handed over without locks, their
+ * count bounds how far the renderer may run ahead. Apart from
+ * spi_queue_set_chunk, calls act on the queue the calling thread started.
+ */
+#define SPI_QUEUE_DEPTH 4
+#define SPI_STAGE_SIZE 16384
+#define SPI_STAGE_OPS 64
+/*
+ * Stages are handed over every chunk bytes. Unless set, chunk is tuned so
+ * that fixed cost of one transfer stays below 1/SPI_TUNE_RATIO of it.
+ */
+#define SPI_CHUNK_MIN 1024
+#define SPI_TUNE_RATIO 16
+/*
+ * Pixels of a window written in full make queued pixels of older windows
+ * inside it useless, those are dropped before they are sent. Up to
+ * SPI_WINDOWS complete windows are remembered while still queued;
+ * spi_queue_barrier forgets them when window coordinates change meaning.
+ * Writers sure to send the whole window call spi_queue_commit after
+ * setting it, so they drop covered pixels before queueing their own.
+ * A write failing on the wire is kept until spi_queue_error takes it;
+ * spi_queue_drain and spi_queue_barrier report it meanwhile.
+ */
+#define SPI_WINDOWS 16
+
+struct ipc_stats;
+
+int spi_queue_start(int fd);
+int spi_queue_owns(int fd);
+int spi_queue_set_chunk(uint32_t size);
+uint32_t spi_queue_chunk(void);
+uint64_t spi_queue_cost(uint32_t size);
+uint64_t spi_queue_left(void);
+int spi_queue_write(int fd, unsigned int cmd, const uint8_t *mem, 
+		    uint32_t size);
+void spi_queue_kick(void);
+int spi_queue_drain(void);
+void spi_queue_window(int fd, uint16_t x, uint16_t y, uint16_t dx, 
+		      uint16_t dy);
+void spi_queue_commit(int fd);
+int spi_queue_barrier(int fd);
+int spi_queue_error(void);
+void spi_queue_stats(struct ipc_stats *stats);
+
+#endif